@@ -1,115 +1,291 @@
-#ifndef _SPI_API_H_
-#define _SPI_API_H_
-
-#include <stdint.h>
-
-/**
- * @brief Enum for the status of the SPI operations.
- *
- * @details The status codes returned by the SPI operations in the driver.
- */
-typedef enum
-{
-    API_OK,                     /**< The operation was successful. */
-    API_FAILED_SPI_SET_PIN,     /**< The pin has failed to have been set */
-    API_FAILED_SPI_SET_LEVEL,   /**< The spi level failed to be set for a pin */
-    API_FAILED_SPI_CHIP_SELECT, /**< The SPI chip select operation failed. */
-    API_FAILED_SPI_ADD_DEVICE,  /**< The spi device failed to be added */
-    API_FAILED_SPI_INIT,        /**< The SPI initialization failed. */
-    API_FAILED_SPI_READ,        /**< The SPI read operation failed. */
-    API_FAILED_SPI_READ_BUF,    /**< The SPI read buffer operation failed. */
-    API_FAILED_SPI_WRITE,       /**< The SPI write operation failed. */
-    API_FAILED_SPI_WRITE_BUF,   /**< The SPI write buffer operation failed. */
-    API_BUFFER_TOO_LARGE,       /**< The buffer is to large to assign. */
-    API_NULL_POINTER_ERROR,     /**< The pointer is NULL. */
-    API_SPI_ERROR               /**< The SPI operation encountered an error. */
-} api_status_t;
-
-/**
- * @brief Initialize the SPI interface.
- *
- * @details This function initializes the SPI interface for communication.
- *
- * @return api_status_t Result of the initialization.
- *         - API_OK: The initialization was successful.
- *         - API_SPI_ERROR: There was an error during initialization.
- */
-api_status_t spi_init(void);
-
-/**
- * @brief Write a value to an SPI register.
- *
- * @details This function writes a single byte value to the specified SPI register.
- *
- * @param reg The register to write to.
- * @param val The value to write to the register.
- *
- * @return api_status_t Result of the write operation.
- *         - API_OK: The write operation was successful.
- *         - API_SPI_ERROR: There was an error during the write operation.
- */
-api_status_t spi_write(uint8_t reg, uint8_t val);
-
-/**
- * @brief Write a buffer to an SPI register.
- *
- * @details This function writes a buffer of data to the specified SPI register.
- *
- * @param reg The register to write to.
- * @param val Pointer to the buffer containing the data to write.
- * @param len The length of the data buffer.
- *
- * @return api_status_t Result of the write operation.
- *         - API_OK: The write operation was successful.
- *         - API_SPI_ERROR: There was an error during the write operation.
- */
-api_status_t spi_write_buf(uint8_t reg, uint8_t *val, uint8_t len);
-
-/**
- * @brief Read a value from an SPI register.
- *
- * @details This function reads a single byte value from the specified SPI register.
- *
- * @param reg The register to read from.
- * @param val Pointer to the variable to store the read value.
- *
- * @return api_status_t Result of the read operation.
- *         - API_OK: The read operation was successful.
- *         - API_SPI_ERROR: There was an error during the read operation.
- */
-api_status_t spi_read(uint8_t reg, uint8_t *val);
-
-/**
- * @brief Read a buffer from an SPI register.
- *
- * @details This function reads a buffer of data from the specified SPI register.
- *
- * @param reg The register to read from.
- * @param val Pointer to the buffer to store the read data.
- * @param len The length of the data to read.
- *
- * @return api_status_t Result of the read operation.
- *         - API_OK: The read operation was successful.
- *         - API_SPI_ERROR: There was an error during the read operation.
- */
-api_status_t spi_read_buf(uint8_t reg, uint8_t *val, uint8_t len);
-
-/**
- * @brief Delay execution for a specified number of ms.
- *
- * @details This function introduces a delay in execution for a given number of ms.
- *
- * @param ms The number of ms to delay.
- */
-void lora_delay(uint32_t ms);
-
-/**
- * @brief Reset the LoRa module.
- *
- * @details This function resets the LoRa module by toggling the reset pin.
- *
- * @return api_status_t Result of the reset operation.
- */
-api_status_t lora_reset(void);
-
-#endif // _SPI_API_H_
+#ifndef _SPI_API_H_
+#define _SPI_API_H_
+
+#include <stdint.h>
+
+/**
+ * @brief Enum for the status of the SPI operations.
+ *
+ * @details The status codes returned by the SPI operations in the driver.
+ */
+typedef enum
+{
+    API_OK,                     /**< The operation was successful. */
+    API_FAILED_SPI_SET_PIN,     /**< The pin has failed to have been set */
+    API_FAILED_SPI_SET_LEVEL,   /**< The spi level failed to be set for a pin */
+    API_FAILED_SPI_CHIP_SELECT, /**< The SPI chip select operation failed. */
+    API_FAILED_SPI_ADD_DEVICE,  /**< The spi device failed to be added */
+    API_FAILED_SPI_INIT,        /**< The SPI initialization failed. */
+    API_FAILED_SPI_READ,        /**< The SPI read operation failed. */
+    API_FAILED_SPI_READ_BUF,    /**< The SPI read buffer operation failed. */
+    API_FAILED_SPI_WRITE,       /**< The SPI write operation failed. */
+    API_FAILED_SPI_WRITE_BUF,   /**< The SPI write buffer operation failed. */
+    API_BUFFER_TOO_LARGE,       /**< The buffer is to large to assign. */
+    API_NULL_POINTER_ERROR,     /**< The pointer is NULL. */
+    API_SPI_ERROR,              /**< The SPI operation encountered an error. */
+    API_FAILED_ISR_ATTACH,      /**< The interrupt handler failed to be attached. */
+    API_TIMEOUT                 /**< The wait operation timed out. */
+} api_status_t;
+
+typedef struct api_handle api_handle_t;
+
+/**
+ * @brief A register transfer queued on the transport.
+ *
+ * @details The descriptor belongs to the caller and must stay valid until the
+ * transfer is completed by lora_transport_ops_t::flush().
+ */
+typedef struct api_transfer
+{
+    uint8_t reg;   /**< The register to access. */
+    uint8_t write; /**< Non-zero to write buf to the register, zero to read into it. */
+    uint8_t len;   /**< The length of the data buffer. */
+    uint8_t data;  /**< Inline storage that buf may point to for single-byte writes. */
+    uint8_t *buf;  /**< Pointer to the data buffer. */
+    void (*done)(struct api_transfer *xfer, api_status_t status); /**< Optional completion callback. */
+    void *arg;     /**< User argument for the completion callback. */
+} api_transfer_t;
+
+/**
+ * @brief Transport operations used by the driver to access the LoRa module.
+ *
+ * @details A platform provides one table per kind of bus it supports. The
+ * blocking operations are required. The queued operations are optional and may
+ * be NULL; when present, the driver stages whole register sequences (e.g. a
+ * FIFO transfer plus the registers around it) with queue() and waits once with
+ * flush(), so DMA-capable backends move the data without CPU involvement.
+ */
+typedef struct
+{
+    /**
+     * @brief Initialize the bus and the device handle in handle->spi.
+     *
+     * @param handle Platform resources of the module.
+     *
+     * @return api_status_t Result of the initialization.
+     *         - API_OK: The initialization was successful.
+     *         - API_SPI_ERROR: There was an error during initialization.
+     */
+    api_status_t (*init)(api_handle_t *handle);
+
+    /**
+     * @brief Write a single byte value to the specified register.
+     *
+     * @param handle Platform resources of the module.
+     * @param reg The register to write to.
+     * @param val The value to write to the register.
+     *
+     * @return api_status_t Result of the write operation.
+     *         - API_OK: The write operation was successful.
+     *         - API_SPI_ERROR: There was an error during the write operation.
+     */
+    api_status_t (*write)(api_handle_t *handle, uint8_t reg, uint8_t val);
+
+    /**
+     * @brief Write a buffer of data to the specified register.
+     *
+     * @param handle Platform resources of the module.
+     * @param reg The register to write to.
+     * @param val Pointer to the buffer containing the data to write.
+     * @param len The length of the data buffer.
+     *
+     * @return api_status_t Result of the write operation.
+     *         - API_OK: The write operation was successful.
+     *         - API_SPI_ERROR: There was an error during the write operation.
+     */
+    api_status_t (*write_buf)(api_handle_t *handle, uint8_t reg, uint8_t *val, uint8_t len);
+
+    /**
+     * @brief Read a single byte value from the specified register.
+     *
+     * @param handle Platform resources of the module.
+     * @param reg The register to read from.
+     * @param val Pointer to the variable to store the read value.
+     *
+     * @return api_status_t Result of the read operation.
+     *         - API_OK: The read operation was successful.
+     *         - API_SPI_ERROR: There was an error during the read operation.
+     */
+    api_status_t (*read)(api_handle_t *handle, uint8_t reg, uint8_t *val);
+
+    /**
+     * @brief Read a buffer of data from the specified register.
+     *
+     * @param handle Platform resources of the module.
+     * @param reg The register to read from.
+     * @param val Pointer to the buffer to store the read data.
+     * @param len The length of the data to read.
+     *
+     * @return api_status_t Result of the read operation.
+     *         - API_OK: The read operation was successful.
+     *         - API_SPI_ERROR: There was an error during the read operation.
+     */
+    api_status_t (*read_buf)(api_handle_t *handle, uint8_t reg, uint8_t *val, uint8_t len);
+
+    /**
+     * @brief Queue a transfer without waiting for it (optional).
+     *
+     * @details Transfers are executed in queue order. No blocking operation is
+     * issued by the driver until the queue was flushed.
+     *
+     * @param handle Platform resources of the module.
+     * @param xfer Transfer to queue.
+     *
+     * @return api_status_t Result of the queue operation.
+     *         - API_OK: The transfer was queued.
+     *         - API_SPI_ERROR: The transfer could not be queued.
+     */
+    api_status_t (*queue)(api_handle_t *handle, api_transfer_t *xfer);
+
+    /**
+     * @brief Wait for every queued transfer to complete (optional).
+     *
+     * @details The completion callbacks of the transfers are called from here,
+     * in queue order.
+     *
+     * @param handle Platform resources of the module.
+     *
+     * @return api_status_t Result of the queued transfers.
+     *         - API_OK: All transfers were successful.
+     *         - API_SPI_ERROR: At least one transfer failed.
+     */
+    api_status_t (*flush)(api_handle_t *handle);
+} lora_transport_ops_t;
+
+/**
+ * @brief Platform resources of one LoRa module.
+ *
+ * @details The pin and bus fields and the transport are filled in by the
+ * application. The handle fields are owned by the platform layer and set up by
+ * lora_platform_init() and the transport's init operation.
+ */
+struct api_handle
+{
+    const lora_transport_ops_t *ops; /**< Transport used to reach the module. */
+    int spi_host;  /**< SPI bus the module is connected to. */
+    int miso_pin;  /**< SPI MISO pin. */
+    int mosi_pin;  /**< SPI MOSI pin. */
+    int sck_pin;   /**< SPI clock pin. */
+    int cs_pin;    /**< Chip select pin. */
+    int reset_pin; /**< Reset pin, -1 if not wired. */
+    int dio0_pin;  /**< DIO0 interrupt pin, -1 if not wired. */
+    int dio1_pin;  /**< DIO1 interrupt pin, -1 if not wired. */
+    void *spi;     /**< Platform SPI device handle. */
+    void *event;   /**< Platform event object used by lora_event_wait(). */
+    void *lock;    /**< Platform recursive mutex used by lora_lock(). */
+};
+
+/**
+ * @brief Interrupt handler called on a rising edge of a DIO pin.
+ *
+ * @details Runs in interrupt context, so it must not perform SPI transfers.
+ *
+ * @param arg User argument passed to lora_dio_attach_isr().
+ */
+typedef void (*api_dio_handler_t)(void *arg);
+
+/**
+ * @brief Create the operating system objects of a LoRa module.
+ *
+ * @details This function creates the event and the lock used by
+ * lora_event_wait() and lora_lock() for this module.
+ *
+ * @param handle Platform resources of the module.
+ *
+ * @return api_status_t Result of the initialization.
+ *         - API_OK: The initialization was successful.
+ *         - API_FAILED_SPI_INIT: The objects could not be created.
+ */
+api_status_t lora_platform_init(api_handle_t *handle);
+
+/**
+ * @brief Delay execution for a specified number of ms.
+ *
+ * @details This function introduces a delay in execution for a given number of ms.
+ *
+ * @param ms The number of ms to delay.
+ */
+void lora_delay(uint32_t ms);
+
+/**
+ * @brief Read a monotonic time source.
+ *
+ * @details This function returns the time elapsed since an arbitrary fixed point
+ * (typically boot). It must be safe to call from interrupt context.
+ *
+ * @return uint64_t Current time in microseconds.
+ */
+uint64_t lora_time_us(void);
+
+/**
+ * @brief Reset the LoRa module.
+ *
+ * @details This function resets the LoRa module by toggling the reset pin.
+ *
+ * @param handle Platform resources of the module.
+ *
+ * @return api_status_t Result of the reset operation.
+ */
+api_status_t lora_reset(api_handle_t *handle);
+
+/**
+ * @brief Attach an interrupt handler to a DIO pin.
+ *
+ * @details This function configures the GPIO connected to the given DIO pin of
+ * the LoRa module as an input and calls the handler on each rising edge.
+ *
+ * @param handle Platform resources of the module.
+ * @param dio Number of the DIO pin (0 to 5).
+ * @param handler Handler to call from the interrupt.
+ * @param arg User argument passed to the handler.
+ *
+ * @return api_status_t Result of the operation.
+ *         - API_OK: The handler was attached.
+ *         - API_FAILED_ISR_ATTACH: The pin is not wired or the handler could not be attached.
+ */
+api_status_t lora_dio_attach_isr(api_handle_t *handle, uint8_t dio, api_dio_handler_t handler, void *arg);
+
+/**
+ * @brief Wait for an event signalled by lora_event_signal().
+ *
+ * @details This function blocks the calling task until the event is signalled or
+ * the timeout expires. The event behaves as a binary semaphore: signals raised
+ * before the call are not lost, and several signals collapse into one.
+ *
+ * @param handle Platform resources of the module.
+ * @param timeout_ms Maximum time to wait in ms, 0 to only consume a pending signal.
+ *
+ * @return api_status_t Result of the wait operation.
+ *         - API_OK: The event was signalled.
+ *         - API_TIMEOUT: The timeout expired before the event was signalled.
+ */
+api_status_t lora_event_wait(api_handle_t *handle, uint32_t timeout_ms);
+
+/**
+ * @brief Signal the event waited on by lora_event_wait().
+ *
+ * @details This function is safe to call from interrupt context.
+ *
+ * @param handle Platform resources of the module.
+ */
+void lora_event_signal(api_handle_t *handle);
+
+/**
+ * @brief Take the lock of a LoRa module.
+ *
+ * @details This function blocks until the calling task owns the lock created by
+ * lora_platform_init() for this module. The lock is recursive: a task that already owns
+ * it may take it again and must release it as many times.
+ *
+ * @param handle Platform resources of the module.
+ */
+void lora_lock(api_handle_t *handle);
+
+/**
+ * @brief Release the lock taken by lora_lock().
+ *
+ * @param handle Platform resources of the module.
+ */
+void lora_unlock(api_handle_t *handle);
+
+#endif // _SPI_API_H_
@@ -0,0 +1,297 @@
+#include <string.h>
+#include "driver/spi_master.h"
+#include "driver/gpio.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+#include "lora_api_esp32.h"
+#include "lora_driver_defs.h"
+
+#define LORA_ESP32_SPI_CLOCK_HZ 8000000
+#define LORA_ESP32_QUEUE_DEPTH LORA_MAX_STAGED
+#define LORA_ESP32_WRITE_FLAG 0x80
+
+typedef struct
+{
+   spi_device_handle_t spi;
+   spi_transaction_t trans[LORA_ESP32_QUEUE_DEPTH];
+   api_transfer_t *pending[LORA_ESP32_QUEUE_DEPTH];
+   uint8_t n_pending;
+   bool in_use;
+} esp32_spi_t;
+
+static esp32_spi_t __spi_devices[LORA_MAX_DEVICES];
+
+static api_status_t esp32_spi_init(api_handle_t *handle)
+{
+   esp32_spi_t *dev = NULL;
+
+   for (uint8_t i = 0; i < LORA_MAX_DEVICES; i++)
+   {
+      if (!__spi_devices[i].in_use)
+      {
+         dev = &__spi_devices[i];
+         break;
+      }
+   }
+   if (NULL == dev)
+   {
+      return API_FAILED_SPI_ADD_DEVICE;
+   }
+
+   spi_bus_config_t bus = {
+       .miso_io_num = handle->miso_pin,
+       .mosi_io_num = handle->mosi_pin,
+       .sclk_io_num = handle->sck_pin,
+       .quadwp_io_num = -1,
+       .quadhd_io_num = -1,
+       .max_transfer_sz = LORA_MAX_PAYLOAD + 1,
+   };
+
+   /* Several radios may share one bus: ESP_ERR_INVALID_STATE means it is already up. */
+   esp_err_t err = spi_bus_initialize(handle->spi_host, &bus, SPI_DMA_CH_AUTO);
+   if (ESP_OK != err && ESP_ERR_INVALID_STATE != err)
+   {
+      return API_FAILED_SPI_INIT;
+   }
+
+   spi_device_interface_config_t cfg = {
+       .address_bits = 8,
+       .clock_speed_hz = LORA_ESP32_SPI_CLOCK_HZ,
+       .mode = 0,
+       .spics_io_num = handle->cs_pin,
+       .queue_size = LORA_ESP32_QUEUE_DEPTH,
+   };
+
+   if (ESP_OK != spi_bus_add_device(handle->spi_host, &cfg, &dev->spi))
+   {
+      return API_FAILED_SPI_ADD_DEVICE;
+   }
+
+   dev->n_pending = 0;
+   dev->in_use = true;
+   handle->spi = dev;
+
+   if (handle->reset_pin >= 0)
+   {
+      gpio_reset_pin(handle->reset_pin);
+      gpio_set_direction(handle->reset_pin, GPIO_MODE_OUTPUT);
+      gpio_set_level(handle->reset_pin, 1);
+   }
+
+   return API_OK;
+}
+
+static void esp32_fill(spi_transaction_t *t, uint8_t reg, bool write, uint8_t *buf, uint8_t len)
+{
+   memset(t, 0, sizeof(*t));
+   t->addr = write ? (reg | LORA_ESP32_WRITE_FLAG) : reg;
+   t->length = 8 * len;
+
+   if (write)
+   {
+      t->tx_buffer = buf;
+   }
+   else
+   {
+      t->rxlength = 8 * len;
+      t->rx_buffer = buf;
+   }
+}
+
+static api_status_t esp32_transfer(api_handle_t *handle, uint8_t reg, bool write, uint8_t *buf, uint8_t len)
+{
+   esp32_spi_t *dev = handle->spi;
+   spi_transaction_t t;
+
+   esp32_fill(&t, reg, write, buf, len);
+   return (ESP_OK == spi_device_polling_transmit(dev->spi, &t)) ? API_OK : API_SPI_ERROR;
+}
+
+static api_status_t esp32_spi_write(api_handle_t *handle, uint8_t reg, uint8_t val)
+{
+   return (API_OK == esp32_transfer(handle, reg, true, &val, 1)) ? API_OK : API_FAILED_SPI_WRITE;
+}
+
+static api_status_t esp32_spi_write_buf(api_handle_t *handle, uint8_t reg, uint8_t *val, uint8_t len)
+{
+   return (API_OK == esp32_transfer(handle, reg, true, val, len)) ? API_OK : API_FAILED_SPI_WRITE_BUF;
+}
+
+static api_status_t esp32_spi_read(api_handle_t *handle, uint8_t reg, uint8_t *val)
+{
+   return (API_OK == esp32_transfer(handle, reg, false, val, 1)) ? API_OK : API_FAILED_SPI_READ;
+}
+
+static api_status_t esp32_spi_read_buf(api_handle_t *handle, uint8_t reg, uint8_t *val, uint8_t len)
+{
+   return (API_OK == esp32_transfer(handle, reg, false, val, len)) ? API_OK : API_FAILED_SPI_READ_BUF;
+}
+
+static api_status_t esp32_spi_queue(api_handle_t *handle, api_transfer_t *xfer)
+{
+   esp32_spi_t *dev = handle->spi;
+
+   if (LORA_ESP32_QUEUE_DEPTH == dev->n_pending)
+   {
+      return API_SPI_ERROR;
+   }
+
+   spi_transaction_t *t = &dev->trans[dev->n_pending];
+   esp32_fill(t, xfer->reg, xfer->write, xfer->buf, xfer->len);
+   t->user = xfer;
+
+   if (ESP_OK != spi_device_queue_trans(dev->spi, t, portMAX_DELAY))
+   {
+      return API_SPI_ERROR;
+   }
+
+   dev->pending[dev->n_pending++] = xfer;
+   return API_OK;
+}
+
+static api_status_t esp32_spi_flush(api_handle_t *handle)
+{
+   esp32_spi_t *dev = handle->spi;
+   api_status_t ret = API_OK;
+
+   while (dev->n_pending > 0)
+   {
+      spi_transaction_t *t;
+      api_status_t status = API_OK;
+
+      if (ESP_OK != spi_device_get_trans_result(dev->spi, &t, portMAX_DELAY))
+      {
+         status = API_SPI_ERROR;
+         ret = API_SPI_ERROR;
+      }
+
+      api_transfer_t *xfer = (API_OK == status) ? t->user : dev->pending[0];
+      dev->n_pending--;
+      memmove(&dev->pending[0], &dev->pending[1], dev->n_pending * sizeof(dev->pending[0]));
+
+      if (xfer->done)
+      {
+         xfer->done(xfer, status);
+      }
+   }
+
+   return ret;
+}
+
+const lora_transport_ops_t lora_esp32_transport = {
+    .init = esp32_spi_init,
+    .write = esp32_spi_write,
+    .write_buf = esp32_spi_write_buf,
+    .read = esp32_spi_read,
+    .read_buf = esp32_spi_read_buf,
+    .queue = esp32_spi_queue,
+    .flush = esp32_spi_flush,
+};
+
+api_status_t lora_platform_init(api_handle_t *handle)
+{
+   if (NULL == handle->event)
+   {
+      handle->event = xSemaphoreCreateBinary();
+   }
+   if (NULL == handle->lock)
+   {
+      handle->lock = xSemaphoreCreateRecursiveMutex();
+   }
+
+   return (handle->event && handle->lock) ? API_OK : API_FAILED_SPI_INIT;
+}
+
+void lora_delay(uint32_t ms)
+{
+   vTaskDelay(pdMS_TO_TICKS(ms));
+}
+
+uint64_t lora_time_us(void)
+{
+   return (uint64_t)esp_timer_get_time();
+}
+
+api_status_t lora_reset(api_handle_t *handle)
+{
+   if (handle->reset_pin < 0)
+   {
+      return API_FAILED_SPI_SET_PIN;
+   }
+
+   if (ESP_OK != gpio_set_level(handle->reset_pin, 0))
+   {
+      return API_FAILED_SPI_SET_LEVEL;
+   }
+   lora_delay(1);
+   if (ESP_OK != gpio_set_level(handle->reset_pin, 1))
+   {
+      return API_FAILED_SPI_SET_LEVEL;
+   }
+   /* The SX127x needs 5 ms after reset before it accepts SPI access. */
+   lora_delay(LORA_DELAY_10MS);
+
+   return API_OK;
+}
+
+api_status_t lora_dio_attach_isr(api_handle_t *handle, uint8_t dio, api_dio_handler_t handler, void *arg)
+{
+   int pin = (0 == dio) ? handle->dio0_pin : (1 == dio) ? handle->dio1_pin : -1;
+
+   if (pin < 0)
+   {
+      return API_FAILED_ISR_ATTACH;
+   }
+
+   gpio_config_t cfg = {
+       .pin_bit_mask = 1ULL << pin,
+       .mode = GPIO_MODE_INPUT,
+       .pull_up_en = GPIO_PULLUP_DISABLE,
+       .pull_down_en = GPIO_PULLDOWN_DISABLE,
+       .intr_type = GPIO_INTR_POSEDGE,
+   };
+
+   if (ESP_OK != gpio_config(&cfg))
+   {
+      return API_FAILED_ISR_ATTACH;
+   }
+
+   esp_err_t err = gpio_install_isr_service(0);
+   if (ESP_OK != err && ESP_ERR_INVALID_STATE != err)
+   {
+      return API_FAILED_ISR_ATTACH;
+   }
+
+   return (ESP_OK == gpio_isr_handler_add(pin, handler, arg)) ? API_OK : API_FAILED_ISR_ATTACH;
+}
+
+api_status_t lora_event_wait(api_handle_t *handle, uint32_t timeout_ms)
+{
+   return (pdTRUE == xSemaphoreTake(handle->event, pdMS_TO_TICKS(timeout_ms))) ? API_OK : API_TIMEOUT;
+}
+
+void lora_event_signal(api_handle_t *handle)
+{
+   if (xPortInIsrContext())
+   {
+      BaseType_t woken = pdFALSE;
+      xSemaphoreGiveFromISR(handle->event, &woken);
+      portYIELD_FROM_ISR(woken);
+   }
+   else
+   {
+      xSemaphoreGive(handle->event);
+   }
+}
+
+void lora_lock(api_handle_t *handle)
+{
+   xSemaphoreTakeRecursive(handle->lock, portMAX_DELAY);
+}
+
+void lora_unlock(api_handle_t *handle)
+{
+   xSemaphoreGiveRecursive(handle->lock);
+}
@@ -0,0 +1,33 @@
+/**
+ * @file lora_api_esp32.h
+ * @brief ESP-IDF implementation of the LoRa platform API
+ *
+ * Provides the SPI transport and the GPIO, timing and RTOS primitives declared
+ * in api/driver_api.h for ESP32 targets.
+ */
+
+#ifndef _LORA_API_ESP32_H_
+#define _LORA_API_ESP32_H_
+
+#include "api/driver_api.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /**
+     * @brief SPI transport based on the ESP-IDF SPI master driver.
+     *
+     * Blocking operations use polling transactions. Queued operations use
+     * spi_device_queue_trans() with DMA, and flush() collects the results with
+     * spi_device_get_trans_result(), so the calling task sleeps while the FIFO
+     * is transferred.
+     */
+    extern const lora_transport_ops_t lora_esp32_transport;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _LORA_API_ESP32_H_
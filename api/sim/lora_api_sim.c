@@ -0,0 +1,678 @@
+#include <string.h>
+#include "lora_api_sim.h"
+#include "lora_driver_defs.h"
+#include "lora_airtime.h"
+
+/* SX127x CAD duration, in symbols. */
+#define SIM_CAD_SYMBOLS 2
+#define SIM_NEVER UINT64_MAX
+/* Channels with a level set by lora_sim_channel_rssi(); the others read the noise floor. */
+#define SIM_MAX_LEVELS 16
+#define SIM_NOISE_DBM -120
+
+typedef struct
+{
+   lora_sim_config_t cfg;
+   lora_sim_counters_t counters;
+   uint64_t now_ns;
+
+   uint8_t regs[0x80];
+   /* Frequency in use: RegFrf is only applied when its LSB is written. */
+   uint32_t frf;
+   uint8_t fifo[256];
+   /* Where the modem writes the next received byte. */
+   uint8_t rx_write;
+
+   uint64_t tx_done_at;
+   uint64_t cad_done_at;
+   uint64_t rx_single_at;
+   /* Next FhssChangeChannel of the frame being sent. */
+   uint64_t hop_at;
+   bool wedged;
+   uint32_t cad_busy;
+
+   bool pending;
+   uint8_t pending_frame[256];
+   uint8_t pending_len;
+   int16_t pending_rssi;
+   int8_t pending_snr;
+   bool pending_crc_error;
+
+   uint8_t tx_frame[256];
+   uint8_t tx_len;
+
+   api_dio_handler_t dio[2];
+   void *dio_arg[2];
+   bool event;
+   int lock_depth;
+
+   api_transfer_t *queued[LORA_MAX_STAGED];
+   uint8_t n_queued;
+
+   uint32_t level_frf[SIM_MAX_LEVELS];
+   int16_t level_dbm[SIM_MAX_LEVELS];
+   uint8_t n_levels;
+   uint32_t wideband;
+} lora_sim_t;
+
+static lora_sim_t __sim;
+
+const lora_sim_config_t lora_sim_default_config = {
+    .spi_hz = 8000000,
+    .xfer_overhead_ns = 12000,
+    .queue_overhead_ns = 4000,
+    .flush_overhead_ns = 8000,
+    .dio0_wired = true,
+    .dio1_wired = true,
+};
+
+static uint64_t sim_now_us(void)
+{
+   return __sim.now_ns / 1000;
+}
+
+static lora_modem_params_t sim_modem(void)
+{
+   const uint8_t *r = __sim.regs;
+   lora_modem_params_t params = {
+       .spreading_factor = r[REG_MODEM_CONFIG_2] >> 4,
+       .bandwidth = r[REG_MODEM_CONFIG_1] >> 4,
+       .coding_rate = (r[REG_MODEM_CONFIG_1] >> 1) & 0x07,
+       .preamble_length = (uint16_t)((r[REG_PREAMBLE_MSB] << 8) | r[REG_PREAMBLE_LSB]),
+       .implicit_header = r[REG_MODEM_CONFIG_1] & 0x01,
+       .crc = r[REG_MODEM_CONFIG_2] & 0x04,
+       .low_data_rate = r[REG_MODEM_CONFIG_3] & 0x08,
+   };
+
+   return params;
+}
+
+static uint64_t sim_symbol_ns(void)
+{
+   return (uint64_t)lora_symbol_time_us(__sim.regs[REG_MODEM_CONFIG_2] >> 4, __sim.regs[REG_MODEM_CONFIG_1] >> 4) * 1000;
+}
+
+static uint8_t sim_mode(void)
+{
+   return __sim.regs[REG_OP_MODE] & 0x07;
+}
+
+static void sim_set_mode(uint8_t mode)
+{
+   __sim.regs[REG_OP_MODE] = (__sim.regs[REG_OP_MODE] & ~0x07) | mode;
+}
+
+/*
+ * Set IRQ flags and pulse the DIO lines whose mapping selects one of them.
+ */
+static void sim_raise(uint8_t flags)
+{
+   static const uint8_t dio0_flags[4] = {IRQ_RX_DONE_MASK, IRQ_TX_DONE_MASK, IRQ_CAD_DONE_MASK, 0};
+   static const uint8_t dio1_flags[4] = {IRQ_RX_TIMEOUT_MASK, IRQ_FHSS_CHANGE_CHANNEL_MASK, IRQ_CAD_DETECTED_MASK, 0};
+   uint8_t mapping = __sim.regs[REG_DIO_MAPPING_1];
+
+   __sim.regs[REG_IRQ_FLAGS] |= flags;
+
+   if (__sim.dio[0] && (flags & dio0_flags[mapping >> 6]))
+   {
+      __sim.dio[0](__sim.dio_arg[0]);
+   }
+   if (__sim.dio[1] && (flags & dio1_flags[(mapping >> 4) & 0x03]))
+   {
+      __sim.dio[1](__sim.dio_arg[1]);
+   }
+}
+
+static uint32_t sim_frf(void)
+{
+   return __sim.frf;
+}
+
+/*
+ * Register value of an RSSI in dBm on the current channel.
+ */
+static uint8_t sim_rssi_reg(int16_t rssi)
+{
+   bool low_band = ((uint64_t)sim_frf() * 15625 >> 8) < 868000000;
+
+   return (uint8_t)(rssi + (low_band ? 164 : 157));
+}
+
+/*
+ * Copy a frame into the FIFO as the modem does on reception.
+ */
+static void sim_receive(const uint8_t *payload, uint8_t len, int16_t rssi, int8_t snr, bool crc_error)
+{
+
+   __sim.regs[REG_FIFO_RX_CURRENT_ADDR] = __sim.rx_write;
+   for (uint16_t i = 0; i < len; i++)
+   {
+      __sim.fifo[__sim.rx_write++] = payload[i];
+   }
+   __sim.regs[REG_RX_NB_BYTES] = len;
+   __sim.regs[REG_PKT_SNR_VALUE] = (uint8_t)(snr * 4);
+   __sim.regs[REG_PKT_RSSI_VALUE] = sim_rssi_reg(rssi);
+
+   sim_raise(IRQ_VALID_HEADER_MASK | IRQ_RX_DONE_MASK | (crc_error ? IRQ_PAYLOAD_CRC_ERROR_MASK : 0));
+}
+
+static uint64_t sim_next_event(void)
+{
+   uint64_t next = __sim.tx_done_at;
+
+   if (__sim.cad_done_at < next)
+   {
+      next = __sim.cad_done_at;
+   }
+   if (__sim.rx_single_at < next)
+   {
+      next = __sim.rx_single_at;
+   }
+   if (__sim.hop_at < next)
+   {
+      next = __sim.hop_at;
+   }
+   return next;
+}
+
+static void sim_process(void)
+{
+   if (__sim.now_ns >= __sim.tx_done_at)
+   {
+      __sim.tx_done_at = SIM_NEVER;
+      __sim.hop_at = SIM_NEVER;
+      sim_set_mode(MODE_STDBY);
+      sim_raise(IRQ_TX_DONE_MASK);
+   }
+
+   if (__sim.now_ns >= __sim.hop_at)
+   {
+      /* The driver had a whole hop period to retune and clear the flag. */
+      if (__sim.regs[REG_IRQ_FLAGS] & IRQ_FHSS_CHANGE_CHANNEL_MASK)
+      {
+         __sim.counters.missed_hops++;
+      }
+      __sim.counters.hops++;
+      __sim.hop_at += __sim.regs[REG_HOP_PERIOD] * sim_symbol_ns();
+      sim_raise(IRQ_FHSS_CHANGE_CHANNEL_MASK);
+   }
+
+   if (__sim.now_ns >= __sim.cad_done_at)
+   {
+      bool detected = __sim.pending || __sim.cad_busy > 0;
+
+      __sim.cad_done_at = SIM_NEVER;
+      if (__sim.cad_busy > 0)
+      {
+         __sim.cad_busy--;
+      }
+      sim_set_mode(MODE_STDBY);
+      sim_raise(IRQ_CAD_DONE_MASK | (detected ? IRQ_CAD_DETECTED_MASK : 0));
+   }
+
+   if (__sim.now_ns >= __sim.rx_single_at)
+   {
+      __sim.rx_single_at = SIM_NEVER;
+      sim_set_mode(MODE_STDBY);
+      if (__sim.pending)
+      {
+         __sim.pending = false;
+         sim_receive(__sim.pending_frame, __sim.pending_len, __sim.pending_rssi, __sim.pending_snr,
+                     __sim.pending_crc_error);
+      }
+      else
+      {
+         sim_raise(IRQ_RX_TIMEOUT_MASK);
+      }
+   }
+}
+
+/*
+ * Run the radio up to the given simulated time, handling events in order.
+ */
+static void sim_advance(uint64_t until_ns)
+{
+   uint64_t next;
+
+   while ((next = sim_next_event()) <= until_ns)
+   {
+      if (next > __sim.now_ns)
+      {
+         __sim.now_ns = next;
+      }
+      sim_process();
+   }
+
+   if (until_ns > __sim.now_ns)
+   {
+      __sim.now_ns = until_ns;
+   }
+}
+
+static void sim_op_mode(uint8_t val)
+{
+   uint8_t mode = val & 0x07;
+
+   /* LongRangeMode only changes from or into sleep. */
+   if (MODE_SLEEP != sim_mode() && MODE_SLEEP != mode)
+   {
+      val = (val & ~MODE_LONG_RANGE_MODE) | (__sim.regs[REG_OP_MODE] & MODE_LONG_RANGE_MODE);
+   }
+   if (MODE_SLEEP == mode && MODE_SLEEP != sim_mode())
+   {
+      /* The FIFO does not keep its content in sleep. */
+      memset(__sim.fifo, 0, sizeof(__sim.fifo));
+   }
+
+   __sim.regs[REG_OP_MODE] = val;
+   __sim.tx_done_at = SIM_NEVER;
+   __sim.cad_done_at = SIM_NEVER;
+   __sim.rx_single_at = SIM_NEVER;
+   __sim.hop_at = SIM_NEVER;
+
+   lora_modem_params_t params = sim_modem();
+
+   if (MODE_TX == mode)
+   {
+      __sim.tx_len = __sim.regs[REG_PAYLOAD_LENGTH];
+      for (uint16_t i = 0; i < __sim.tx_len; i++)
+      {
+         __sim.tx_frame[i] = __sim.fifo[(uint8_t)(__sim.regs[REG_FIFO_TX_BASE_ADDR] + i)];
+      }
+      if (!__sim.wedged)
+      {
+         __sim.tx_done_at = __sim.now_ns + (uint64_t)lora_airtime_us(&params, __sim.tx_len) * 1000;
+         if (__sim.regs[REG_HOP_PERIOD])
+         {
+            __sim.hop_at = __sim.now_ns + __sim.regs[REG_HOP_PERIOD] * sim_symbol_ns();
+         }
+      }
+   }
+   else if (MODE_RX_CONTINUOUS == mode)
+   {
+      __sim.rx_write = __sim.regs[REG_FIFO_RX_BASE_ADDR];
+   }
+   else if (MODE_RX_SINGLE == mode)
+   {
+      __sim.rx_write = __sim.regs[REG_FIFO_RX_BASE_ADDR];
+      if (__sim.pending)
+      {
+         __sim.rx_single_at = __sim.now_ns + (uint64_t)lora_airtime_us(&params, __sim.pending_len) * 1000;
+      }
+      else
+      {
+         uint16_t timeout = ((__sim.regs[REG_MODEM_CONFIG_2] & 0x03) << 8) | __sim.regs[REG_SYMB_TIMEOUT_LSB];
+         __sim.rx_single_at = __sim.now_ns + timeout * sim_symbol_ns();
+      }
+   }
+   else if (MODE_CAD == mode)
+   {
+      __sim.cad_done_at = __sim.now_ns + SIM_CAD_SYMBOLS * sim_symbol_ns();
+   }
+}
+
+static void sim_write(uint8_t reg, uint8_t val)
+{
+   if (REG_FIFO == reg)
+   {
+      if (MODE_SLEEP == sim_mode())
+      {
+         /* The FIFO cannot be accessed in sleep. */
+         return;
+      }
+      __sim.fifo[__sim.regs[REG_FIFO_ADDR_PTR]++] = val;
+   }
+   else if (REG_IRQ_FLAGS == reg)
+   {
+      __sim.regs[reg] &= ~val;
+   }
+   else if (REG_OP_MODE == reg)
+   {
+      sim_op_mode(val);
+   }
+   else if (REG_VERSION != reg && reg < sizeof(__sim.regs))
+   {
+      __sim.regs[reg] = val;
+      if (REG_FRF_LSB == reg)
+      {
+         __sim.frf = ((uint32_t)__sim.regs[REG_FRF_MSB] << 16) | (__sim.regs[REG_FRF_MID] << 8) | val;
+      }
+   }
+}
+
+static uint8_t sim_read(uint8_t reg)
+{
+   if (REG_FIFO == reg)
+   {
+      if (MODE_SLEEP == sim_mode())
+      {
+         return 0;
+      }
+      return __sim.fifo[__sim.regs[REG_FIFO_ADDR_PTR]++];
+   }
+
+   if (REG_RSSI_VALUE == reg)
+   {
+      int16_t rssi = SIM_NOISE_DBM;
+      for (uint8_t i = 0; i < __sim.n_levels; i++)
+      {
+         if (__sim.level_frf[i] == sim_frf())
+         {
+            rssi = __sim.level_dbm[i];
+         }
+      }
+      return sim_rssi_reg(rssi);
+   }
+
+   if (REG_RSSI_WIDEBAND == reg)
+   {
+      __sim.wideband ^= __sim.wideband << 13;
+      __sim.wideband ^= __sim.wideband >> 17;
+      __sim.wideband ^= __sim.wideband << 5;
+      return (uint8_t)__sim.wideband;
+   }
+
+   return (reg < sizeof(__sim.regs)) ? __sim.regs[reg] : 0;
+}
+
+/*
+ * One chip select cycle: the address byte, then len data bytes with the
+ * address auto-incremented (except for the FIFO).
+ */
+static void sim_transfer(uint8_t reg, bool write, uint8_t *buf, uint8_t len, uint32_t overhead_ns)
+{
+   __sim.counters.transactions++;
+   __sim.counters.bytes += 1 + (uint32_t)len;
+   sim_advance(__sim.now_ns + overhead_ns + (uint64_t)(1 + len) * 8 * 1000000000ULL / __sim.cfg.spi_hz);
+
+   for (uint16_t i = 0; i < len; i++)
+   {
+      uint8_t addr = (REG_FIFO == reg) ? reg : (uint8_t)(reg + i);
+
+      if (write)
+      {
+         sim_write(addr, buf[i]);
+      }
+      else
+      {
+         buf[i] = sim_read(addr);
+      }
+   }
+}
+
+static api_status_t sim_spi_init(api_handle_t *handle)
+{
+   handle->spi = &__sim;
+   return API_OK;
+}
+
+static api_status_t sim_spi_write(api_handle_t *handle, uint8_t reg, uint8_t val)
+{
+   (void)handle;
+   sim_transfer(reg, true, &val, 1, __sim.cfg.xfer_overhead_ns);
+   return API_OK;
+}
+
+static api_status_t sim_spi_write_buf(api_handle_t *handle, uint8_t reg, uint8_t *val, uint8_t len)
+{
+   (void)handle;
+   sim_transfer(reg, true, val, len, __sim.cfg.xfer_overhead_ns);
+   return API_OK;
+}
+
+static api_status_t sim_spi_read(api_handle_t *handle, uint8_t reg, uint8_t *val)
+{
+   (void)handle;
+   sim_transfer(reg, false, val, 1, __sim.cfg.xfer_overhead_ns);
+   return API_OK;
+}
+
+static api_status_t sim_spi_read_buf(api_handle_t *handle, uint8_t reg, uint8_t *val, uint8_t len)
+{
+   (void)handle;
+   sim_transfer(reg, false, val, len, __sim.cfg.xfer_overhead_ns);
+   return API_OK;
+}
+
+static api_status_t sim_spi_queue(api_handle_t *handle, api_transfer_t *xfer)
+{
+   (void)handle;
+   if (LORA_MAX_STAGED == __sim.n_queued)
+   {
+      return API_SPI_ERROR;
+   }
+
+   __sim.queued[__sim.n_queued++] = xfer;
+   return API_OK;
+}
+
+static api_status_t sim_spi_flush(api_handle_t *handle)
+{
+   (void)handle;
+   __sim.counters.flushes++;
+   sim_advance(__sim.now_ns + __sim.cfg.flush_overhead_ns);
+
+   for (uint8_t i = 0; i < __sim.n_queued; i++)
+   {
+      api_transfer_t *xfer = __sim.queued[i];
+
+      sim_transfer(xfer->reg, xfer->write, xfer->buf, xfer->len, __sim.cfg.queue_overhead_ns);
+      if (xfer->done)
+      {
+         xfer->done(xfer, API_OK);
+      }
+   }
+   __sim.n_queued = 0;
+
+   return API_OK;
+}
+
+const lora_transport_ops_t lora_sim_transport = {
+    .init = sim_spi_init,
+    .write = sim_spi_write,
+    .write_buf = sim_spi_write_buf,
+    .read = sim_spi_read,
+    .read_buf = sim_spi_read_buf,
+    .queue = sim_spi_queue,
+    .flush = sim_spi_flush,
+};
+
+const lora_transport_ops_t lora_sim_transport_blocking = {
+    .init = sim_spi_init,
+    .write = sim_spi_write,
+    .write_buf = sim_spi_write_buf,
+    .read = sim_spi_read,
+    .read_buf = sim_spi_read_buf,
+};
+
+/*
+ * Power-on values of the registers the driver relies on.
+ */
+static void sim_power_on(void)
+{
+   memset(__sim.regs, 0, sizeof(__sim.regs));
+   memset(__sim.fifo, 0, sizeof(__sim.fifo));
+
+   __sim.regs[REG_OP_MODE] = MODE_STDBY;
+   __sim.regs[REG_FRF_MSB] = 0x6c;
+   __sim.regs[REG_FRF_MID] = 0x80;
+   __sim.frf = 0x6c8000;
+   __sim.regs[REG_PA_CONFIG] = 0x4f;
+   __sim.regs[REG_LNA] = 0x20;
+   __sim.regs[REG_FIFO_TX_BASE_ADDR] = 0x80;
+   __sim.regs[REG_MODEM_CONFIG_1] = 0x72;
+   __sim.regs[REG_MODEM_CONFIG_2] = 0x70;
+   __sim.regs[REG_SYMB_TIMEOUT_LSB] = 0x64;
+   __sim.regs[REG_PREAMBLE_LSB] = 0x08;
+   __sim.regs[REG_PAYLOAD_LENGTH] = 0x01;
+   __sim.regs[REG_DETECTION_OPTIMIZE] = 0xc3;
+   __sim.regs[REG_DETECTION_THRESHOLD] = 0x0a;
+   __sim.regs[REG_SYNC_WORD] = 0x12;
+   __sim.regs[REG_VERSION] = 0x12;
+
+   __sim.rx_write = 0;
+   __sim.tx_done_at = SIM_NEVER;
+   __sim.cad_done_at = SIM_NEVER;
+   __sim.rx_single_at = SIM_NEVER;
+   __sim.hop_at = SIM_NEVER;
+   __sim.wideband = 0x2545f491u;
+}
+
+void lora_sim_init(const lora_sim_config_t *cfg)
+{
+   memset(&__sim, 0, sizeof(__sim));
+   __sim.cfg = cfg ? *cfg : lora_sim_default_config;
+   sim_power_on();
+}
+
+void lora_sim_counters(lora_sim_counters_t *out)
+{
+   *out = __sim.counters;
+   out->time_us = sim_now_us();
+}
+
+void lora_sim_inject(const uint8_t *payload, uint8_t len, int16_t rssi_dbm, int8_t snr_db, bool crc_error)
+{
+   if (MODE_RX_CONTINUOUS == sim_mode())
+   {
+      sim_receive(payload, len, rssi_dbm, snr_db, crc_error);
+      return;
+   }
+
+   memcpy(__sim.pending_frame, payload, len);
+   __sim.pending_len = len;
+   __sim.pending_rssi = rssi_dbm;
+   __sim.pending_snr = snr_db;
+   __sim.pending_crc_error = crc_error;
+   __sim.pending = true;
+}
+
+uint32_t lora_sim_frf(void)
+{
+   return __sim.frf;
+}
+
+void lora_sim_channel_rssi(long frequency, int16_t rssi_dbm)
+{
+   uint32_t frf = (uint32_t)(((uint64_t)frequency << 19) / 32000000);
+   uint8_t i = 0;
+
+   while (i < __sim.n_levels && __sim.level_frf[i] != frf)
+   {
+      i++;
+   }
+   if (i == SIM_MAX_LEVELS)
+   {
+      return;
+   }
+   if (i == __sim.n_levels)
+   {
+      __sim.n_levels++;
+   }
+   __sim.level_frf[i] = frf;
+   __sim.level_dbm[i] = rssi_dbm;
+}
+
+void lora_sim_cad_busy(uint32_t count)
+{
+   __sim.cad_busy = count;
+}
+
+void lora_sim_wedge_tx(bool wedged)
+{
+   __sim.wedged = wedged;
+}
+
+const uint8_t *lora_sim_last_tx(uint8_t *len)
+{
+   *len = __sim.tx_len;
+   return __sim.tx_frame;
+}
+
+uint8_t lora_sim_reg(uint8_t reg)
+{
+   return sim_read((uint8_t)(reg & 0x7f));
+}
+
+int lora_sim_lock_depth(void)
+{
+   return __sim.lock_depth;
+}
+
+api_status_t lora_platform_init(api_handle_t *handle)
+{
+   (void)handle;
+   return API_OK;
+}
+
+void lora_delay(uint32_t ms)
+{
+   sim_advance(__sim.now_ns + (uint64_t)ms * 1000000);
+}
+
+uint64_t lora_time_us(void)
+{
+   return sim_now_us();
+}
+
+api_status_t lora_reset(api_handle_t *handle)
+{
+   (void)handle;
+   sim_power_on();
+   lora_delay(LORA_DELAY_10MS);
+
+   return API_OK;
+}
+
+api_status_t lora_dio_attach_isr(api_handle_t *handle, uint8_t dio, api_dio_handler_t handler, void *arg)
+{
+   (void)handle;
+   if (dio > 1 || (0 == dio && !__sim.cfg.dio0_wired) || (1 == dio && !__sim.cfg.dio1_wired))
+   {
+      return API_FAILED_ISR_ATTACH;
+   }
+
+   __sim.dio[dio] = handler;
+   __sim.dio_arg[dio] = arg;
+   return API_OK;
+}
+
+api_status_t lora_event_wait(api_handle_t *handle, uint32_t timeout_ms)
+{
+   uint64_t end_ns = __sim.now_ns + (uint64_t)timeout_ms * 1000000;
+   uint64_t next;
+
+   (void)handle;
+   /* Skip ahead from radio event to radio event until one signals us. */
+   while (!__sim.event && (next = sim_next_event()) <= end_ns)
+   {
+      sim_advance(next);
+   }
+
+   if (__sim.event)
+   {
+      __sim.event = false;
+      return API_OK;
+   }
+
+   sim_advance(end_ns);
+   return API_TIMEOUT;
+}
+
+void lora_event_signal(api_handle_t *handle)
+{
+   (void)handle;
+   __sim.event = true;
+}
+
+void lora_lock(api_handle_t *handle)
+{
+   (void)handle;
+   __sim.lock_depth++;
+}
+
+void lora_unlock(api_handle_t *handle)
+{
+   (void)handle;
+   __sim.lock_depth--;
+}
@@ -0,0 +1,136 @@
+/**
+ * @file lora_api_sim.h
+ * @brief Host implementation of the LoRa platform API on a simulated SX127x
+ *
+ * Models the register file, the FIFO and its address pointer, IRQ flags, DIO
+ * lines and the timing of TX (with FHSS hops), RX, RX_SINGLE and CAD on a simulated clock, and
+ * counts the SPI traffic the driver generates. Meant for host builds that
+ * measure the driver without hardware; one radio is simulated.
+ */
+
+#ifndef _LORA_API_SIM_H_
+#define _LORA_API_SIM_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "api/driver_api.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /**
+     * @brief Bus and wiring of the simulated radio.
+     */
+    typedef struct
+    {
+        uint32_t spi_hz;            /**< SPI clock. */
+        uint32_t xfer_overhead_ns;  /**< Cost of one blocking transaction besides its bits. */
+        uint32_t queue_overhead_ns; /**< Cost of one queued transaction besides its bits. */
+        uint32_t flush_overhead_ns; /**< Cost of waiting for a queue to complete. */
+        bool dio0_wired;            /**< DIO0 interrupt available. */
+        bool dio1_wired;            /**< DIO1 interrupt available. */
+    } lora_sim_config_t;
+
+    /**
+     * @brief SPI traffic and simulated time.
+     */
+    typedef struct
+    {
+        uint32_t transactions; /**< Chip select assertions. */
+        uint32_t bytes;        /**< Bytes on the bus, address bytes included. */
+        uint32_t flushes;      /**< Queue flushes. */
+        uint32_t hops;         /**< FhssChangeChannel interrupts raised during TX. */
+        uint32_t missed_hops;  /**< Hops raised while the previous one was still unhandled. */
+        uint64_t time_us;      /**< Simulated time. */
+    } lora_sim_counters_t;
+
+    /** @brief Default configuration: 8 MHz bus, rough ESP32 overheads, DIO0 and DIO1 wired. */
+    extern const lora_sim_config_t lora_sim_default_config;
+
+    /** @brief Transport with queue support, like lora_esp32_transport. */
+    extern const lora_transport_ops_t lora_sim_transport;
+
+    /** @brief Transport with blocking operations only. */
+    extern const lora_transport_ops_t lora_sim_transport_blocking;
+
+    /**
+     * @brief Reset the simulated radio, clock and counters.
+     * @param cfg Configuration, NULL for lora_sim_default_config.
+     */
+    void lora_sim_init(const lora_sim_config_t *cfg);
+
+    /**
+     * @brief Read the SPI counters and the simulated time.
+     * @param out Filled with the counters.
+     */
+    void lora_sim_counters(lora_sim_counters_t *out);
+
+    /**
+     * @brief Make a frame arrive.
+     *
+     * In MODE_RX_CONTINUOUS the frame is received right away. Otherwise it is
+     * kept until the next RX_SINGLE window, and CADs detect it until then.
+     *
+     * @param payload Frame data.
+     * @param len Frame length.
+     * @param rssi_dbm Packet RSSI.
+     * @param snr_db Packet SNR.
+     * @param crc_error Receive the frame with a payload CRC error.
+     */
+    void lora_sim_inject(const uint8_t *payload, uint8_t len, int16_t rssi_dbm, int8_t snr_db, bool crc_error);
+
+    /**
+     * @brief Return the frequency the modem runs on.
+     * @return RegFrf as applied by the last RegFrfLsb write.
+     */
+    uint32_t lora_sim_frf(void);
+
+    /**
+     * @brief Set the level RegRssiValue reads on a channel.
+     *
+     * Channels left unset read -120 dBm; up to 16 channels can be set.
+     *
+     * @param frequency Channel frequency in Hz.
+     * @param rssi_dbm RSSI while the radio listens on the channel.
+     */
+    void lora_sim_channel_rssi(long frequency, int16_t rssi_dbm);
+
+    /**
+     * @brief Make the next CADs report channel activity.
+     * @param count Number of CADs that detect a preamble.
+     */
+    void lora_sim_cad_busy(uint32_t count);
+
+    /**
+     * @brief Never raise TxDone, to exercise the transmit timeout.
+     * @param wedged true to swallow TxDone.
+     */
+    void lora_sim_wedge_tx(bool wedged);
+
+    /**
+     * @brief Return the last transmitted frame.
+     * @param len Set to its length.
+     * @return Frame data.
+     */
+    const uint8_t *lora_sim_last_tx(uint8_t *len);
+
+    /**
+     * @brief Return the current value of a register.
+     * @param reg Register index.
+     * @return Register value.
+     */
+    uint8_t lora_sim_reg(uint8_t reg);
+
+    /**
+     * @brief Return the lock nesting depth, 0 when every lock was released.
+     * @return Lock depth.
+     */
+    int lora_sim_lock_depth(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _LORA_API_SIM_H_
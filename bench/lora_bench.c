@@ -0,0 +1,667 @@
+/**
+ * @file lora_bench.c
+ * @brief SPI cost of the driver's main operations on the simulated SX127x
+ *
+ * Runs each scenario on the queued and on the blocking transport of
+ * api/sim and prints the SPI transactions, bus bytes and simulated time it
+ * took. A scenario that needs more transactions than its budget fails the run,
+ * so the exit status catches regressions of the burst and caching paths.
+ *
+ * Build and run on the host from the repository root:
+ *
+ *     gcc -O2 -Wall -I. -Idriver bench/lora_bench.c api/sim/lora_api_sim.c \
+ *         driver/lora_driver.c driver/lora_airtime.c driver/lora_trace.c driver/lora_frag.c \
+ *         driver/lora_adr.c driver/lora_gateway.c -o lora_bench
+ *     ./lora_bench
+ *
+ * Add -DLORA_CONFIG_PROFILE=LORA_CONFIG_PROFILE_SENSOR or _GATEWAY to run it on
+ * another profile; scenarios of features the profile leaves out are skipped.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "lora_driver.h"
+#include "lora_frag.h"
+#include "lora_adr.h"
+#include "lora_gateway.h"
+#include "api/sim/lora_api_sim.h"
+
+typedef struct
+{
+   const char *name;
+   /* Transaction budget on the queued and on the blocking transport. */
+   uint32_t budget[2];
+   lora_status_t (*run)(lora_dev_t *dev);
+} bench_case_t;
+
+/* The gateway scenarios need the receive ring, two devices, two workers and room for two frames. */
+#define BENCH_GATEWAY                                                                                                 \
+   (LORA_CONFIG_RX_RING && LORA_MAX_DEVICES >= 2 && LORA_GW_MAX_WORKERS >= 2 && LORA_RX_RING_LEN >= 2 &&              \
+    LORA_GW_QUEUE_LEN >= 2 && LORA_TX_QUEUE_LEN >= 2)
+
+static const lora_radio_profile_t __profile = {
+    .frequency = 868100000,
+    .spreading_factor = 7,
+    .bandwidth = 7,
+    .coding_rate = 5,
+    .preamble_length = 8,
+    .sync_word = 0x12,
+    .crc = true,
+    .tx_power = 14,
+};
+
+static uint8_t __payload[32] = "benchmark payload 0123456789abc";
+static uint8_t __async_done;
+static api_handle_t __io;
+
+static void bench_tx_done(lora_status_t status, uint64_t timestamp_us, void *ctx)
+{
+   (void)timestamp_us;
+   (void)ctx;
+   if (LORA_OK == status)
+   {
+      __async_done++;
+   }
+}
+
+static lora_status_t bench_init(lora_dev_t *dev)
+{
+   return lora_driver_init(dev);
+}
+
+static lora_status_t bench_profile(lora_dev_t *dev)
+{
+   return lora_apply_profile(dev, &__profile);
+}
+
+static lora_status_t bench_profile_sf(lora_dev_t *dev)
+{
+   lora_radio_profile_t profile = __profile;
+
+   profile.spreading_factor = 9;
+   return lora_apply_profile(dev, &profile);
+}
+
+static lora_status_t bench_send(lora_dev_t *dev)
+{
+   return lora_send_packet(dev, __payload, sizeof(__payload));
+}
+
+/*
+ * 8 frames through the transmit queue, topped up as frames complete when the
+ * build has a shorter queue.
+ */
+static lora_status_t bench_send_async(lora_dev_t *dev)
+{
+   lora_status_t ret = LORA_OK;
+   uint8_t queued = 0;
+
+   __async_done = 0;
+   for (uint8_t i = 0; i < 64 && __async_done < 8; i++)
+   {
+      while (queued < 8 && LORA_OK == ret)
+      {
+         ret = lora_send_packet_async(dev, __payload, sizeof(__payload), bench_tx_done, NULL);
+         queued += (LORA_OK == ret);
+      }
+      ret = (LORA_QUEUE_FULL == ret) ? LORA_OK : ret;
+      lora_service(dev, 100);
+   }
+
+   return (LORA_OK == ret && 8 == __async_done) ? LORA_OK : LORA_FAILED_SEND_PACKET;
+}
+
+static lora_status_t bench_send_loop(lora_dev_t *dev)
+{
+   lora_status_t ret = LORA_OK;
+
+   for (uint8_t i = 0; i < 8; i++)
+   {
+      ret += lora_send_packet(dev, __payload, sizeof(__payload));
+   }
+
+   return ret;
+}
+
+#if LORA_CONFIG_BATCH
+static lora_status_t bench_send_batch(lora_dev_t *dev)
+{
+   struct iovec frames[8];
+   uint8_t sent;
+
+   for (uint8_t i = 0; i < 8; i++)
+   {
+      frames[i].iov_base = __payload;
+      frames[i].iov_len = sizeof(__payload);
+   }
+
+   lora_status_t ret = lora_send_batch(dev, frames, 8, &sent);
+   return (8 == sent) ? ret : LORA_FAILED_SEND_PACKET;
+}
+#endif
+
+#if LORA_CONFIG_CHANNEL_PLAN
+static const long __channels[4] = {868100000, 868300000, 868500000, 867100000};
+#endif
+
+#if LORA_CONFIG_HOPPING
+
+/*
+ * Send 8 frames from the queue on the given hop setting, then go back to the
+ * profile frequency.
+ */
+static lora_status_t bench_send_hopping(lora_dev_t *dev, uint8_t hop_period)
+{
+   lora_channel_plan_t plan;
+   lora_status_t ret = lora_channel_plan_init(&plan, __channels, 4, 0x2545f491);
+
+   ret += lora_set_hopping(dev, &plan, hop_period);
+   ret += bench_send_async(dev);
+   ret += lora_set_hopping(dev, NULL, 0);
+   ret += lora_set_frequency(dev, __profile.frequency);
+
+   return ret;
+}
+
+static lora_status_t bench_send_hop_frames(lora_dev_t *dev)
+{
+   return bench_send_hopping(dev, 0);
+}
+
+static lora_status_t bench_send_fhss(lora_dev_t *dev)
+{
+   lora_sim_counters_t before, after;
+
+   lora_sim_counters(&before);
+   lora_status_t ret = bench_send_hopping(dev, 16);
+   lora_sim_counters(&after);
+
+   /* Every hop of every frame has to be followed before the next one. */
+   return (after.hops > before.hops && after.missed_hops == before.missed_hops) ? ret : LORA_FAILED_SEND_PACKET;
+}
+#endif
+
+#if LORA_CONFIG_CHANNEL_PLAN
+/*
+ * 868.1 and 868.225 MHz share RegFrfLsb; the retune only takes effect when
+ * the LSB is written anyway.
+ */
+static lora_status_t bench_set_channel(lora_dev_t *dev)
+{
+   static const long channels[2] = {868100000, 868225000};
+   lora_channel_plan_t plan;
+   lora_status_t ret = lora_channel_plan_init(&plan, channels, 2, 0);
+
+   ret += lora_set_channel(dev, &plan, 1);
+   uint32_t frf = lora_sim_frf();
+   ret += lora_set_channel(dev, &plan, 0);
+
+   return (LORA_OK == ret && 0xd90e66 == frf && 0xd90666 == lora_sim_frf()) ? LORA_OK : LORA_FAIL;
+}
+#endif
+
+static lora_status_t bench_set_frequency(lora_dev_t *dev)
+{
+   lora_status_t ret = lora_set_frequency(dev, 868225000);
+   uint32_t frf = lora_sim_frf();
+
+   ret += lora_set_frequency(dev, __profile.frequency);
+
+   return (LORA_OK == ret && 0xd90e66 == frf && 0xd90666 == lora_sim_frf()) ? LORA_OK : LORA_FAIL;
+}
+
+#if LORA_CONFIG_RX_RING
+static lora_status_t bench_receive(lora_dev_t *dev)
+{
+   lora_rx_packet_t pkts[8];
+   size_t n = 0;
+   lora_status_t ret = lora_rx_start(dev);
+
+   lora_service(dev, 0);
+   for (uint8_t i = 0; i < 8; i++)
+   {
+      lora_sim_inject(__payload, sizeof(__payload), -80, 9, false);
+      lora_service(dev, 0);
+      /* Drained as it goes, for rings shorter than 8. */
+      n += lora_rx_pop_many(dev, &pkts[n], 8 - n);
+   }
+   if (8 != n || memcmp(pkts[7].payload, __payload, sizeof(__payload)))
+   {
+      ret = LORA_FAILED_RECEIVE_PACKET;
+   }
+   ret += lora_rx_stop(dev);
+   lora_service(dev, 0);
+
+   return ret;
+}
+#endif
+
+static lora_status_t bench_receive_single(lora_dev_t *dev)
+{
+   lora_rx_packet_t pkt;
+
+   lora_sim_inject(__payload, sizeof(__payload), -80, 9, false);
+   return lora_receive_single(dev, 32, lora_time_us() + 500000, &pkt);
+}
+
+#if LORA_CONFIG_ACK
+static lora_status_t bench_send_confirmed(lora_dev_t *dev)
+{
+   static const uint8_t ack[2] = {0xac, 0x01};
+   static const lora_confirm_t confirm = {.ack = ack, .ack_len = sizeof(ack), .retries = 2, .turnaround_us = 2000};
+   struct iovec iov = {.iov_base = __payload, .iov_len = sizeof(__payload)};
+
+   /* The peer's reply, received in the ACK window that follows TxDone. */
+   lora_sim_inject(ack, sizeof(ack), -80, 9, false);
+   __async_done = 0;
+   lora_status_t ret = lora_send_confirmed_async(dev, &iov, 1, &confirm, bench_tx_done, NULL);
+   for (uint8_t i = 0; i < 16 && 0 == __async_done; i++)
+   {
+      lora_service(dev, 100);
+   }
+
+   return (LORA_OK == ret && 1 == __async_done) ? LORA_OK : LORA_FAILED_SEND_PACKET;
+}
+#endif
+
+#if LORA_CONFIG_SCAN
+/*
+ * One sweep of 8 samples over the 4 channels, from standby; the third channel
+ * is the quiet one.
+ */
+static lora_status_t bench_scan(lora_dev_t *dev)
+{
+   static const int16_t levels[4] = {-92, -104, -118, -97};
+   uint32_t counts[4 * 8] = {0};
+   lora_scan_t scan = {.counts = counts, .n_buckets = 8, .bucket_db = 5, .floor_dbm = -125, .samples = 8};
+   lora_channel_plan_t plan;
+   uint8_t quietest = 0;
+
+   for (uint8_t i = 0; i < 4; i++)
+   {
+      lora_sim_channel_rssi(__channels[i], levels[i]);
+   }
+   lora_status_t ret = lora_channel_plan_init(&plan, __channels, 4, 0);
+   ret += lora_scan_sweep(dev, &plan, &scan);
+   ret += lora_scan_quietest(&scan, 4, &quietest);
+
+   return (LORA_OK == ret && 2 == quietest) ? LORA_OK : LORA_FAIL;
+}
+#endif
+
+/*
+ * 50 ms owed on a 0.1 % sub-band clear after 50 s, however often the budget
+ * is looked at: polled every 500 us, as a busy service loop does, the frame
+ * must be held until then and released within one poll of it.
+ */
+static lora_status_t bench_duty_cycle_poll(lora_dev_t *dev)
+{
+   static const lora_sub_band_t band = {863000000, 870000000, 1000};
+   lora_duty_cycle_t dc;
+   uint64_t now = 0;
+
+   (void)dev;
+   lora_duty_cycle_init(&dc, &band, 1, now);
+   lora_duty_cycle_consume(&dc, __profile.frequency, 50000, now);
+   while (now < 60000000 && 0 != lora_duty_cycle_wait_us(&dc, __profile.frequency, 0, now))
+   {
+      now += 500;
+   }
+
+   return (now >= 50000000 && now <= 50000500) ? LORA_OK : LORA_FAIL;
+}
+
+static lora_frag_rx_t __frag_rx;
+static uint32_t __frag_messages;
+static uint8_t __frag_msg[sizeof(__payload)];
+static size_t __frag_len;
+
+static void bench_frag_msg(const uint8_t *msg, size_t len, uint8_t id, void *ctx)
+{
+   (void)id;
+   (void)ctx;
+   __frag_messages++;
+   __frag_len = len;
+   memcpy(__frag_msg, msg, len < sizeof(__frag_msg) ? len : sizeof(__frag_msg));
+}
+
+/*
+ * Feed the payload as 3 fragments of up to 12 bytes, in the given order; an
+ * index given twice is a duplicate that must not count towards completion.
+ * Exactly the payload has to come out once, with no slot left behind.
+ */
+static lora_status_t bench_frag_feed(const uint8_t *order, uint8_t n)
+{
+   lora_status_t ret = LORA_OK;
+
+   lora_frag_rx_init(&__frag_rx, 0, bench_frag_msg, NULL);
+   __frag_messages = 0;
+   __frag_len = 0;
+   for (uint8_t i = 0; i < n; i++)
+   {
+      uint8_t frame[LORA_FRAG_HEADER_LEN + 12] = {0x17, order[i], 3, 12};
+      uint8_t size = (2 == order[i]) ? sizeof(__payload) - 24 : 12;
+
+      memcpy(&frame[LORA_FRAG_HEADER_LEN], &__payload[order[i] * 12], size);
+      ret += lora_frag_rx_feed(&__frag_rx, frame, LORA_FRAG_HEADER_LEN + size, lora_time_us());
+   }
+
+   return (LORA_OK == ret && 1 == __frag_messages && sizeof(__payload) == __frag_len &&
+           !memcmp(__frag_msg, __payload, sizeof(__payload)) && 0 == __frag_rx.dropped &&
+           !__frag_rx.slots[0].in_use && !__frag_rx.slots[1].in_use)
+             ? LORA_OK
+             : LORA_FAILED_RECEIVE_PACKET;
+}
+
+static lora_status_t bench_frag_in_order(lora_dev_t *dev)
+{
+   static const uint8_t order[3] = {0, 1, 2};
+
+   (void)dev;
+   return bench_frag_feed(order, 3);
+}
+
+static lora_status_t bench_frag_out_of_order(lora_dev_t *dev)
+{
+   static const uint8_t order[4] = {2, 0, 0, 1};
+
+   (void)dev;
+   return bench_frag_feed(order, 4);
+}
+
+/*
+ * A last fragment that starts inside the reassembly buffer but runs past its
+ * end: 17 fragments of 251 bytes end at 4267. The frame has to be dropped.
+ */
+static lora_status_t bench_frag_overflow(lora_dev_t *dev)
+{
+   uint8_t frame[LORA_FRAG_HEADER_LEN + 251] = {0x42, 16, 17, 251};
+
+   (void)dev;
+   lora_frag_rx_init(&__frag_rx, 0, bench_frag_msg, NULL);
+   __frag_messages = 0;
+
+   lora_status_t ret = lora_frag_rx_feed(&__frag_rx, frame, sizeof(frame), lora_time_us());
+
+   return (LORA_OK == ret && 1 == __frag_rx.dropped && 0 == __frag_messages && !__frag_rx.slots[0].in_use &&
+           !__frag_rx.slots[1].in_use)
+             ? LORA_OK
+             : LORA_FAILED_RECEIVE_PACKET;
+}
+
+static lora_adr_t __adr;
+
+/*
+ * Peers heard at SF 7 and 14 dBm with an SNR of 8, -12 and -25 dB, against a
+ * 10 dB margin: the first keeps SF 7 and gives up the 5 dB it has spare, the
+ * second needs SF 12 and 2 dB more, the third cannot close the link and gets
+ * the most robust settings. A peer with too few samples gets no decision.
+ */
+static lora_status_t bench_adr(lora_dev_t *dev)
+{
+   lora_radio_profile_t strong, weak, dead, few;
+
+   (void)dev;
+   lora_adr_init(&__adr, &__profile, LORA_ADR_DEFAULT_MARGIN_DB);
+   for (uint8_t i = 0; i < 8; i++)
+   {
+      lora_adr_record(&__adr, 1, -90, 8);
+      lora_adr_record(&__adr, 2, -125, -12);
+      lora_adr_record(&__adr, 3, -135, -25);
+   }
+   lora_adr_record(&__adr, 4, -90, 8);
+
+   lora_status_t ret = lora_adr_select(&__adr, 1, &strong);
+   ret += lora_adr_select(&__adr, 2, &weak);
+   ret += lora_adr_select(&__adr, 3, &dead);
+
+   return (LORA_OK == ret && LORA_FAIL == lora_adr_select(&__adr, 4, &few) && 7 == strong.spreading_factor &&
+           9 == strong.tx_power && 12 == weak.spreading_factor && 16 == weak.tx_power &&
+           12 == dead.spreading_factor && 17 == dead.tx_power)
+             ? LORA_OK
+             : LORA_FAIL;
+}
+
+#if BENCH_GATEWAY
+static uint8_t __gw_handled;
+static uint8_t __gw_first[2];
+static uint8_t __gw_worker[2];
+
+static void bench_gw_rx(const lora_gw_packet_t *pkt, uint8_t worker, void *ctx)
+{
+   (void)ctx;
+   if (__gw_handled < 2 && 0 == pkt->radio)
+   {
+      __gw_first[__gw_handled] = pkt->pkt.payload[0];
+      __gw_worker[__gw_handled] = worker;
+   }
+   __gw_handled++;
+}
+
+/*
+ * Two frames land on the only radio, which belongs to worker 0. Worker 0
+ * handles the first, worker 1 has no radio and takes the second from the
+ * queue of worker 0, after which both are idle.
+ */
+static lora_status_t bench_gw_steal(lora_dev_t *dev)
+{
+   lora_gw_t *gw = lora_gw_create(2, bench_gw_rx, NULL);
+   lora_gw_stats_t own, thief;
+   uint8_t frame[sizeof(__payload)];
+
+   if (NULL == gw)
+   {
+      return LORA_FAIL;
+   }
+
+   __gw_handled = 0;
+   lora_status_t ret = lora_gw_add_radio(gw, dev, NULL);
+   lora_service(dev, 0);
+   /* The bench is the only task, so the ring can fill before worker 0 looks. */
+   memcpy(frame, __payload, sizeof(frame));
+   for (uint8_t i = 0; i < 2; i++)
+   {
+      frame[0] = i;
+      lora_sim_inject(frame, sizeof(frame), -80, 9, false);
+      lora_service(dev, 0);
+   }
+
+   bool own_first = lora_gw_work(gw, 0, 0);
+   bool stolen = lora_gw_work(gw, 1, 0);
+   bool idle = !lora_gw_work(gw, 1, 0) && !lora_gw_work(gw, 0, 0);
+   lora_gw_get_stats(gw, 0, &own);
+   lora_gw_get_stats(gw, 1, &thief);
+
+   ret += lora_rx_stop(dev);
+   lora_service(dev, 0);
+   lora_gw_destroy(gw);
+
+   return (LORA_OK == ret && own_first && stolen && idle && 2 == __gw_handled && 0 == __gw_first[0] &&
+           0 == __gw_worker[0] && 1 == __gw_first[1] && 1 == __gw_worker[1] && 2 == own.received &&
+           1 == own.handled && 0 == own.stolen && 0 == thief.received && 1 == thief.handled && 1 == thief.stolen)
+             ? LORA_OK
+             : LORA_FAILED_RECEIVE_PACKET;
+}
+
+/*
+ * Radio 1 is a second device on the simulated chip that is never serviced:
+ * it only holds a transmit queue. Its initialization takes over the DIO
+ * handlers, so the bench device is initialized again to get them back and
+ * resync its cache with the chip. With the sub-band of radio 0 closed the
+ * downlink goes to radio 1 and radio 0 alone cannot take it; while radio 0
+ * owes seconds of off-time the next one still queues behind the frame on
+ * radio 1. Once radio 0 is free again it wins, and sends.
+ */
+static lora_status_t bench_gw_route(lora_dev_t *dev)
+{
+   static const lora_sub_band_t closed = {863000000, 870000000, 0};
+   static const lora_sub_band_t one_percent = {863000000, 870000000, 10000};
+   struct iovec iov = {.iov_base = __payload, .iov_len = sizeof(__payload)};
+   lora_dev_t *spare = lora_dev_create(&__io);
+   lora_gw_t *gw = lora_gw_create(2, bench_gw_rx, NULL);
+   lora_duty_cycle_t dc;
+   uint8_t blocked = 0xff, owed = 0xff, open = 0xff;
+
+   if (NULL == spare || NULL == gw)
+   {
+      if (spare)
+      {
+         lora_dev_destroy(spare);
+      }
+      if (gw)
+      {
+         lora_gw_destroy(gw);
+      }
+      return LORA_FAIL;
+   }
+
+   lora_status_t ret = lora_driver_init(spare);
+   ret += lora_driver_init(dev);
+   ret += lora_gw_add_radio(gw, dev, NULL);
+   ret += lora_gw_add_radio(gw, spare, NULL);
+
+   lora_duty_cycle_init(&dc, &closed, 1, lora_time_us());
+   lora_set_duty_cycle(dev, &dc);
+   ret += lora_gw_send(gw, LORA_GW_ALL_RADIOS, &iov, 1, NULL, NULL, &blocked);
+   lora_status_t full = lora_gw_send(gw, 0x1, &iov, 1, NULL, NULL, NULL);
+
+   lora_duty_cycle_init(&dc, &one_percent, 1, lora_time_us());
+   lora_duty_cycle_consume(&dc, __profile.frequency, 100000, lora_time_us());
+   ret += lora_gw_send(gw, LORA_GW_ALL_RADIOS, &iov, 1, NULL, NULL, &owed);
+   lora_set_duty_cycle(dev, NULL);
+
+   __async_done = 0;
+   ret += lora_gw_send(gw, LORA_GW_ALL_RADIOS, &iov, 1, bench_tx_done, NULL, &open);
+   for (uint8_t i = 0; i < 16 && 0 == __async_done; i++)
+   {
+      lora_service(dev, 100);
+   }
+
+   ret += lora_rx_stop(dev);
+   lora_service(dev, 0);
+   lora_gw_destroy(gw);
+   /* Drops the frames still queued on radio 1. */
+   lora_dev_destroy(spare);
+
+   return (LORA_OK == ret && 1 == blocked && LORA_QUEUE_FULL == full && 1 == owed && 0 == open && 1 == __async_done)
+             ? LORA_OK
+             : LORA_FAILED_SEND_PACKET;
+}
+#endif
+
+static lora_status_t bench_snapshot(lora_dev_t *dev)
+{
+   lora_snapshot_t snap;
+
+   return lora_snapshot(dev, &snap);
+}
+
+#if LORA_CONFIG_WARM
+static lora_status_t bench_warm_restore(lora_dev_t *dev)
+{
+   lora_warm_state_t state;
+   lora_status_t ret = lora_warm_save(dev, &state);
+
+   return LORA_OK == ret ? lora_driver_init_warm(dev, &state) : ret;
+}
+#endif
+
+static const bench_case_t __cases[] = {
+    {"init", {12, 12}, bench_init},
+    {"apply_profile", {4, 4}, bench_profile},
+    {"apply_profile again", {0, 0}, bench_profile},
+    {"apply_profile sf", {2, 2}, bench_profile_sf},
+    {"send 32 B", {12, 16}, bench_send},
+    {"8 async sends", {72, 72}, bench_send_async},
+    {"8 sends", {72, 72}, bench_send_loop},
+#if LORA_CONFIG_BATCH
+    {"batch of 8", {56, 56}, bench_send_batch},
+#endif
+#if LORA_CONFIG_HOPPING
+    {"8 sends, hop per frame", {72, 72}, bench_send_hop_frames},
+    {"8 sends, FHSS", {160, 160}, bench_send_fhss},
+#endif
+    {"set_frequency, same LSB", {2, 2}, bench_set_frequency},
+#if LORA_CONFIG_CHANNEL_PLAN
+    {"set_channel, same LSB", {2, 2}, bench_set_channel},
+#endif
+#if LORA_CONFIG_RX_RING
+    {"receive 8 frames", {56, 56}, bench_receive},
+#endif
+    {"receive_single", {16, 16}, bench_receive_single},
+#if LORA_CONFIG_ACK
+    {"confirmed send", {20, 20}, bench_send_confirmed},
+#endif
+#if LORA_CONFIG_SCAN
+    {"scan 4 channels", {96, 96}, bench_scan},
+#endif
+    {"duty cycle, 500 us polls", {0, 0}, bench_duty_cycle_poll},
+    {"fragments in order", {0, 0}, bench_frag_in_order},
+    {"fragments reordered", {0, 0}, bench_frag_out_of_order},
+    {"fragment overflow", {0, 0}, bench_frag_overflow},
+    {"ADR selection", {0, 0}, bench_adr},
+#if BENCH_GATEWAY
+    {"gateway work stealing", {16, 16}, bench_gw_steal},
+    {"gateway downlink", {32, 32}, bench_gw_route},
+#endif
+    {"snapshot", {1, 1}, bench_snapshot},
+#if LORA_CONFIG_WARM
+    {"warm restore", {3, 3}, bench_warm_restore},
+#endif
+};
+
+static int bench_run(const char *transport_name, const lora_transport_ops_t *ops, uint8_t column)
+{
+   lora_dev_t *dev;
+   int failures = 0;
+
+   __io = (api_handle_t){.ops = ops, .reset_pin = -1, .dio0_pin = 0, .dio1_pin = 1};
+   lora_sim_init(NULL);
+   dev = lora_dev_create(&__io);
+   if (NULL == dev)
+   {
+      printf("%s: no device\n", transport_name);
+      return 1;
+   }
+
+   printf("%s transport\n", transport_name);
+   printf("  %-22s %6s %6s %10s\n", "scenario", "xfers", "bytes", "time_us");
+
+   for (size_t i = 0; i < sizeof(__cases) / sizeof(__cases[0]); i++)
+   {
+      const bench_case_t *c = &__cases[i];
+      lora_sim_counters_t before, after;
+      lora_status_t ret;
+      uint32_t xfers;
+
+      lora_sim_counters(&before);
+      ret = c->run(dev);
+      lora_sim_counters(&after);
+
+      xfers = after.transactions - before.transactions;
+      printf("  %-22s %6u %6u %10llu", c->name, (unsigned)xfers, (unsigned)(after.bytes - before.bytes),
+             (unsigned long long)(after.time_us - before.time_us));
+
+      if (LORA_OK != ret || xfers > c->budget[column] || 0 != lora_sim_lock_depth())
+      {
+         printf("  FAIL (status %d, budget %u)", ret, (unsigned)c->budget[column]);
+         failures++;
+      }
+      printf("\n");
+   }
+
+   lora_close(dev);
+   lora_dev_destroy(dev);
+
+   return failures;
+}
+
+int main(void)
+{
+   int failures = 0;
+
+   failures += bench_run("queued", &lora_sim_transport, 0);
+   failures += bench_run("blocking", &lora_sim_transport_blocking, 1);
+
+   return failures ? 1 : 0;
+}
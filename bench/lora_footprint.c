@@ -0,0 +1,46 @@
+/*
+ * Static memory report of the LoRa driver for one build configuration.
+ *
+ *   gcc -I. -Idriver -DLORA_CONFIG_PROFILE=LORA_CONFIG_PROFILE_SENSOR bench/lora_footprint.c \
+ *       api/sim/lora_api_sim.c driver/lora_driver.c driver/lora_airtime.c driver/lora_trace.c
+ *
+ * Build it with the flags of the target (and -m32 on a 64-bit host) to see
+ * what lora_config.h gives on the MCU.
+ */
+
+#include <stdio.h>
+#include "lora_driver.h"
+
+static const char *footprint_profile(void)
+{
+   switch (LORA_CONFIG_PROFILE)
+   {
+   case LORA_CONFIG_PROFILE_SENSOR:
+      return "sensor";
+   case LORA_CONFIG_PROFILE_GATEWAY:
+      return "gateway";
+   default:
+      return "default";
+   }
+}
+
+int main(void)
+{
+   lora_footprint_t fp;
+
+   lora_get_footprint(&fp);
+
+   printf("profile %s: %d devices, rx ring %d x %d B, tx queue %d x %d segments\n", footprint_profile(),
+          LORA_MAX_DEVICES, LORA_RX_RING_LEN, LORA_MAX_PAYLOAD, LORA_TX_QUEUE_LEN, LORA_TX_IOV_MAX);
+   printf("features: stats histograms %d, sniff %d, hopping %d, scan %d, rx ring %d, ack %d, lbt %d, batch %d, "
+          "warm %d\n",
+          LORA_CONFIG_STATS_HIST, LORA_CONFIG_SNIFF, LORA_CONFIG_HOPPING, LORA_CONFIG_SCAN, LORA_CONFIG_RX_RING,
+          LORA_CONFIG_ACK, LORA_CONFIG_LBT, LORA_CONFIG_BATCH, LORA_CONFIG_WARM);
+   printf("  %-10s %8zu B\n", "rx ring", fp.rx_ring);
+   printf("  %-10s %8zu B\n", "tx queue", fp.tx_queue);
+   printf("  %-10s %8zu B\n", "stats", fp.stats);
+   printf("  %-10s %8zu B\n", "device", fp.device);
+   printf("  %-10s %8zu B\n", "pool", fp.pool);
+
+   return 0;
+}
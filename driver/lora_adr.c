@@ -0,0 +1,221 @@
+#include <string.h>
+#include "lora_adr.h"
+
+/* Highest power level of lora_set_tx_power(), the reference of normalized samples. */
+#define LORA_ADR_REF_POWER 17
+
+/*
+ * Demodulation floor per spreading factor (SX1276 datasheet), quarter dB,
+ * indexed from SF 6.
+ */
+static const int16_t __snr_floor_q[7] = {-20, -30, -40, -50, -60, -70, -80};
+
+/*
+ * Noise bandwidth relative to 125 kHz, 10 * log10(bw / 125 kHz) in quarter dB:
+ * a wider channel lets in more noise and lowers the SNR by as much.
+ */
+static const int16_t __bw_noise_q[10] = {-48, -43, -36, -31, -24, -19, -12, 0, 12, 24};
+
+static uint8_t lora_adr_clamp(uint8_t val, uint8_t min, uint8_t max)
+{
+   return val < min ? min : (val > max ? max : val);
+}
+
+/*
+ * Offsets that bring a sample taken with the given settings to 125 kHz and
+ * full power, in quarter dB.
+ */
+static int16_t lora_adr_power_q(uint8_t power)
+{
+   return (int16_t)(4 * (LORA_ADR_REF_POWER - (int16_t)power));
+}
+
+static int16_t lora_adr_bw_q(uint8_t bw)
+{
+   return __bw_noise_q[bw > 9 ? 9 : bw];
+}
+
+void lora_adr_init(lora_adr_t *adr, const lora_radio_profile_t *profile, int8_t margin_db)
+{
+   memset(adr, 0, sizeof(*adr));
+   adr->profile = *profile;
+   adr->margin_q = (int16_t)(4 * margin_db);
+   lora_adr_set_limits(adr, 7, 12, profile->bandwidth, profile->bandwidth, 2, 17);
+}
+
+void lora_adr_set_limits(lora_adr_t *adr, uint8_t min_sf, uint8_t max_sf, uint8_t min_bw, uint8_t max_bw,
+                         uint8_t min_power, uint8_t max_power)
+{
+   /* SF6 only works in implicit header mode, which the profile does not switch. */
+   adr->min_sf = lora_adr_clamp(min_sf, 7, 12);
+   adr->max_sf = lora_adr_clamp(max_sf, adr->min_sf, 12);
+   adr->min_bw = lora_adr_clamp(min_bw, 0, 9);
+   adr->max_bw = lora_adr_clamp(max_bw, adr->min_bw, 9);
+   adr->min_power = lora_adr_clamp(min_power, 2, 17);
+   adr->max_power = lora_adr_clamp(max_power, adr->min_power, 17);
+}
+
+static lora_link_t *lora_adr_find(const lora_adr_t *adr, uint32_t peer)
+{
+   for (uint8_t i = 0; i < LORA_ADR_MAX_PEERS; i++)
+   {
+      if (adr->links[i].in_use && adr->links[i].peer == peer)
+      {
+         return (lora_link_t *)&adr->links[i];
+      }
+   }
+
+   return NULL;
+}
+
+void lora_adr_record(lora_adr_t *adr, uint32_t peer, int16_t rssi_dbm, int8_t snr_db)
+{
+   lora_link_t *link = lora_adr_find(adr, peer);
+   int16_t power_q = lora_adr_power_q(adr->profile.tx_power);
+
+   if (NULL == link)
+   {
+      link = &adr->links[0];
+      for (uint8_t i = 0; i < LORA_ADR_MAX_PEERS && link->in_use; i++)
+      {
+         if (!adr->links[i].in_use || adr->links[i].last_heard < link->last_heard)
+         {
+            link = &adr->links[i];
+         }
+      }
+
+      memset(link, 0, sizeof(*link));
+      link->in_use = true;
+      link->peer = peer;
+   }
+
+   link->rssi[link->head] = (int16_t)(4 * rssi_dbm + power_q);
+   link->snr[link->head] = (int16_t)(4 * snr_db + power_q + lora_adr_bw_q(adr->profile.bandwidth));
+   link->head = (link->head + 1) % LORA_ADR_WINDOW;
+   if (link->count < LORA_ADR_WINDOW)
+   {
+      link->count++;
+   }
+   link->last_heard = ++adr->tick;
+}
+
+bool lora_adr_link(const lora_adr_t *adr, uint32_t peer, lora_link_summary_t *summary)
+{
+   const lora_link_t *link = lora_adr_find(adr, peer);
+
+   if (NULL == link || 0 == link->count)
+   {
+      return false;
+   }
+
+   int32_t rssi_sum = 0;
+   int32_t snr_sum = 0;
+   int16_t rssi_min = INT16_MAX;
+   int16_t snr_max = INT16_MIN;
+
+   for (uint8_t i = 0; i < link->count; i++)
+   {
+      rssi_sum += link->rssi[i];
+      snr_sum += link->snr[i];
+      rssi_min = link->rssi[i] < rssi_min ? link->rssi[i] : rssi_min;
+      snr_max = link->snr[i] > snr_max ? link->snr[i] : snr_max;
+   }
+
+   /* Back from the normalized scale to the settings in effect. */
+   int16_t power_q = lora_adr_power_q(adr->profile.tx_power);
+   int16_t snr_q = power_q + lora_adr_bw_q(adr->profile.bandwidth);
+
+   summary->count = link->count;
+   summary->rssi_avg = (int16_t)((rssi_sum / link->count - power_q) / 4);
+   summary->rssi_min = (int16_t)((rssi_min - power_q) / 4);
+   summary->snr_avg = (int16_t)((snr_sum / link->count - snr_q) / 4);
+   summary->snr_max = (int16_t)((snr_max - snr_q) / 4);
+
+   return true;
+}
+
+void lora_adr_forget(lora_adr_t *adr, uint32_t peer)
+{
+   lora_link_t *link = lora_adr_find(adr, peer);
+
+   if (NULL != link)
+   {
+      link->in_use = false;
+   }
+}
+
+lora_status_t lora_adr_select(const lora_adr_t *adr, uint32_t peer, lora_radio_profile_t *profile)
+{
+   const lora_link_t *link = lora_adr_find(adr, peer);
+
+   if (NULL == link || link->count < LORA_ADR_MIN_SAMPLES)
+   {
+      return LORA_FAIL;
+   }
+
+   int16_t best_snr = INT16_MIN;
+   for (uint8_t i = 0; i < link->count; i++)
+   {
+      best_snr = link->snr[i] > best_snr ? link->snr[i] : best_snr;
+   }
+
+   /* Fallback: the most robust settings the limits allow. */
+   uint8_t sf = adr->max_sf;
+   uint8_t bw = adr->min_bw;
+   int16_t excess = 0;
+   uint32_t best_symbol_us = UINT32_MAX;
+
+   for (uint8_t b = adr->min_bw; b <= adr->max_bw; b++)
+   {
+      for (uint8_t s = adr->min_sf; s <= adr->max_sf; s++)
+      {
+         int16_t left = best_snr - lora_adr_power_q(adr->max_power) - lora_adr_bw_q(b) - __snr_floor_q[s - 6] -
+                        adr->margin_q;
+         uint32_t symbol_us = lora_symbol_time_us(s, b);
+
+         if (left >= 0 && symbol_us < best_symbol_us)
+         {
+            best_symbol_us = symbol_us;
+            sf = s;
+            bw = b;
+            excess = left;
+         }
+      }
+   }
+
+   /* Whatever margin is left over goes into a lower power level, one per dB. */
+   int16_t power = adr->max_power - excess / 4;
+
+   *profile = adr->profile;
+   profile->spreading_factor = sf;
+   profile->bandwidth = bw;
+   profile->tx_power = (uint8_t)(power < adr->min_power ? adr->min_power : power);
+
+   return LORA_OK;
+}
+
+lora_status_t lora_adr_apply(lora_adr_t *adr, lora_dev_t *dev, uint32_t peer)
+{
+   lora_radio_profile_t profile;
+   lora_status_t ret = lora_adr_select(adr, peer, &profile);
+
+   if (LORA_OK != ret)
+   {
+      return ret;
+   }
+
+   if (profile.spreading_factor == adr->profile.spreading_factor && profile.bandwidth == adr->profile.bandwidth &&
+       profile.tx_power == adr->profile.tx_power)
+   {
+      return LORA_OK;
+   }
+
+   /* Only the changed registers are written, in bursts. */
+   ret = lora_apply_profile(dev, &profile);
+   if (LORA_OK == ret)
+   {
+      adr->profile = profile;
+   }
+
+   return ret;
+}
@@ -0,0 +1,159 @@
+/**
+ * @file lora_adr.h
+ * @brief Per-peer link quality history and adaptive data rate
+ *
+ * Keeps a sliding window of RSSI/SNR samples per peer and picks the radio
+ * settings with the shortest airtime that still leave a target SNR margin
+ * above the demodulation floor of the spreading factor, then lowers the
+ * transmit power by whatever margin is left.
+ *
+ * Samples are normalized to 125 kHz and full power using the settings that
+ * were in effect when they were received, so history stays usable across
+ * changes. The link is assumed symmetric: the peer transmits with the same
+ * settings, as when both ends follow the same ADR decisions.
+ */
+
+#ifndef _LORA_ADR_H_
+#define _LORA_ADR_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "lora_driver.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /** @brief Samples kept per peer. */
+#define LORA_ADR_WINDOW 16
+
+    /** @brief Peers tracked at the same time; the least recently heard one is replaced. */
+#define LORA_ADR_MAX_PEERS 8
+
+    /** @brief Samples needed before lora_adr_select() makes a decision. */
+#define LORA_ADR_MIN_SAMPLES 4
+
+    /** @brief Default target margin above the demodulation floor, in dB. */
+#define LORA_ADR_DEFAULT_MARGIN_DB 10
+
+    /**
+     * @brief Summary of the sample window of one peer, at the current settings.
+     */
+    typedef struct
+    {
+        uint8_t count;    /**< Samples in the window. */
+        int16_t rssi_avg; /**< Mean RSSI in dBm. */
+        int16_t rssi_min; /**< Lowest RSSI in dBm. */
+        int16_t snr_avg;  /**< Mean SNR in dB. */
+        int16_t snr_max;  /**< Highest SNR in dB. */
+    } lora_link_summary_t;
+
+    /**
+     * @brief Sample window of one peer.
+     */
+    typedef struct
+    {
+        bool in_use;
+        uint32_t peer;
+        uint32_t last_heard; /**< Value of lora_adr_t::tick at the last sample. */
+        uint8_t head;
+        uint8_t count;
+        int16_t rssi[LORA_ADR_WINDOW]; /**< Normalized RSSI, quarter dB. */
+        int16_t snr[LORA_ADR_WINDOW];  /**< Normalized SNR, quarter dB. */
+    } lora_link_t;
+
+    /**
+     * @brief ADR state of one radio.
+     */
+    typedef struct
+    {
+        lora_radio_profile_t profile; /**< Settings in effect, updated by lora_adr_apply(). */
+        uint8_t min_sf, max_sf;
+        uint8_t min_bw, max_bw;
+        uint8_t min_power, max_power;
+        int16_t margin_q; /**< Target margin, quarter dB. */
+        uint32_t tick;
+        lora_link_t links[LORA_ADR_MAX_PEERS];
+    } lora_adr_t;
+
+    /**
+     * @brief Prepare an ADR engine.
+     *
+     * The limits start at SF 7 to 12, the bandwidth of the profile only, and
+     * power levels 2 to 17.
+     *
+     * @param adr ADR state.
+     * @param profile Settings the radio currently uses.
+     * @param margin_db Target SNR margin, LORA_ADR_DEFAULT_MARGIN_DB is a sensible value.
+     */
+    void lora_adr_init(lora_adr_t *adr, const lora_radio_profile_t *profile, int8_t margin_db);
+
+    /**
+     * @brief Restrict the settings lora_adr_select() may choose.
+     * @param adr ADR state.
+     * @param min_sf Lowest spreading factor, at least 7: SF6 needs implicit header mode.
+     * @param max_sf Highest spreading factor.
+     * @param min_bw Lowest bandwidth index.
+     * @param max_bw Highest bandwidth index, e.g. 8 where 250 kHz is the regional limit.
+     * @param min_power Lowest power level.
+     * @param max_power Highest power level.
+     */
+    void lora_adr_set_limits(lora_adr_t *adr, uint8_t min_sf, uint8_t max_sf, uint8_t min_bw, uint8_t max_bw,
+                             uint8_t min_power, uint8_t max_power);
+
+    /**
+     * @brief Add the link quality of a packet received from a peer.
+     * @param adr ADR state.
+     * @param peer Peer address, as defined by the application.
+     * @param rssi_dbm Packet RSSI, e.g. lora_rx_packet_t::rssi.
+     * @param snr_db Packet SNR, e.g. lora_rx_packet_t::snr.
+     */
+    void lora_adr_record(lora_adr_t *adr, uint32_t peer, int16_t rssi_dbm, int8_t snr_db);
+
+    /**
+     * @brief Summarize the window of a peer at the current settings.
+     * @param adr ADR state.
+     * @param peer Peer address.
+     * @param summary Filled with the summary.
+     * @return true when the peer has samples.
+     */
+    bool lora_adr_link(const lora_adr_t *adr, uint32_t peer, lora_link_summary_t *summary);
+
+    /**
+     * @brief Forget the samples of a peer.
+     * @param adr ADR state.
+     * @param peer Peer address.
+     */
+    void lora_adr_forget(lora_adr_t *adr, uint32_t peer);
+
+    /**
+     * @brief Choose settings for a peer.
+     *
+     * Among the allowed SF/BW pairs that keep the best SNR of the window at
+     * least the target margin above the floor of the SF at full power, the one
+     * with the shortest symbol wins; the power is then lowered by the margin
+     * left over. Without such a pair the most robust settings at full power
+     * are chosen.
+     *
+     * @param adr ADR state.
+     * @param peer Peer address.
+     * @param profile Filled with the current profile modified by the decision.
+     * @return lora_status_t LORA_OK, or LORA_FAIL with fewer than LORA_ADR_MIN_SAMPLES samples.
+     */
+    lora_status_t lora_adr_select(const lora_adr_t *adr, uint32_t peer, lora_radio_profile_t *profile);
+
+    /**
+     * @brief Choose settings for a peer and apply them with lora_apply_profile().
+     * @param adr ADR state.
+     * @param dev Device handle.
+     * @param peer Peer address.
+     * @return lora_status_t Result of lora_adr_select() or of the profile update.
+     */
+    lora_status_t lora_adr_apply(lora_adr_t *adr, lora_dev_t *dev, uint32_t peer);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _LORA_ADR_H_
@@ -0,0 +1,143 @@
+#include "lora_airtime.h"
+
+/*
+ * The SX127x bandwidths are 500 kHz divided by 64, 48, 32, 24, 16, 12, 8, 4, 2
+ * and 1, so the symbol time 2^SF / BW is an exact number of microseconds:
+ * this table holds it for SF 0 and the spreading factor is a shift.
+ */
+static const uint8_t __symbol_us_sf0[10] = {128, 96, 64, 48, 32, 24, 16, 8, 4, 2};
+
+const lora_sub_band_t lora_eu868_sub_bands[LORA_EU868_SUB_BANDS] = {
+    {863000000, 865000000, 1000},   /* 0.1% */
+    {865000000, 868000000, 10000},  /* 1% */
+    {868000000, 868600000, 10000},  /* 1% */
+    {868700000, 869200000, 1000},   /* 0.1% */
+    {869400000, 869650000, 100000}, /* 10% */
+    {869700000, 870000000, 10000},  /* 1% */
+};
+
+uint32_t lora_symbol_time_us(uint8_t sf, uint8_t bw)
+{
+   if (bw > 9)
+   {
+      bw = 9;
+   }
+
+   return (uint32_t)__symbol_us_sf0[bw] << sf;
+}
+
+uint32_t lora_airtime_us(const lora_modem_params_t *params, uint8_t size)
+{
+   int32_t sf = params->spreading_factor;
+   int32_t de = params->low_data_rate ? 1 : 0;
+   int32_t cr = params->coding_rate;
+
+   /* Preamble plus 4.25 sync symbols, in quarter symbols. */
+   uint32_t quarters = 4 * (uint32_t)params->preamble_length + 17;
+
+   int32_t num = 8 * size - 4 * sf + 28 + (params->crc ? 16 : 0) - (params->implicit_header ? 20 : 0);
+   int32_t den = 4 * (sf - 2 * de);
+   int32_t payload = 8;
+
+   if (num > 0)
+   {
+      payload += ((num + den - 1) / den) * (cr + 4);
+   }
+
+   quarters += 4 * (uint32_t)payload;
+
+   uint64_t us = ((uint64_t)quarters * lora_symbol_time_us(params->spreading_factor, params->bandwidth) + 3) >> 2;
+   return (uint32_t)us;
+}
+
+static int lora_duty_cycle_band(const lora_duty_cycle_t *dc, long frequency)
+{
+   for (uint8_t i = 0; i < dc->n_bands; i++)
+   {
+      if (frequency >= (long)dc->bands[i].freq_min && frequency < (long)dc->bands[i].freq_max)
+      {
+         return i;
+      }
+   }
+
+   return -1;
+}
+
+/*
+ * Pay back the debt of a sub-band for the time since its last update; the
+ * bucket never goes above zero. Only the time whole microseconds were paid
+ * back for is consumed, the rest counts towards the next update, so frequent
+ * calls do not round the repayment away.
+ */
+static void lora_duty_cycle_refill(lora_duty_cycle_t *dc, int band, uint64_t now_us)
+{
+   uint32_t ppm = dc->bands[band].duty_ppm;
+   uint64_t elapsed = now_us - dc->updated_us[band];
+   uint64_t owed = (uint64_t)-dc->tokens_us[band];
+
+   if (0 == ppm || elapsed >= owed * 1000000 / ppm)
+   {
+      dc->updated_us[band] = now_us;
+      dc->tokens_us[band] = 0;
+      return;
+   }
+
+   uint64_t credited = elapsed * ppm / 1000000;
+   dc->tokens_us[band] += (int64_t)credited;
+   dc->updated_us[band] += (credited * 1000000 + ppm - 1) / ppm;
+}
+
+void lora_duty_cycle_init(lora_duty_cycle_t *dc, const lora_sub_band_t *bands, uint8_t n_bands, uint64_t now_us)
+{
+   if (n_bands > LORA_DUTY_CYCLE_MAX_BANDS)
+   {
+      n_bands = LORA_DUTY_CYCLE_MAX_BANDS;
+   }
+
+   dc->bands = bands;
+   dc->n_bands = n_bands;
+
+   for (uint8_t i = 0; i < n_bands; i++)
+   {
+      dc->tokens_us[i] = 0;
+      dc->updated_us[i] = now_us;
+   }
+}
+
+uint64_t lora_duty_cycle_wait_us(lora_duty_cycle_t *dc, long frequency, uint32_t ahead_us, uint64_t now_us)
+{
+   int band = lora_duty_cycle_band(dc, frequency);
+
+   if (band < 0)
+   {
+      return 0;
+   }
+
+   if (0 == dc->bands[band].duty_ppm)
+   {
+      return UINT64_MAX;
+   }
+
+   /* The debt, plus the off-time of every frame ahead, has to be paid back. */
+   lora_duty_cycle_refill(dc, band, now_us);
+   uint64_t missing = (uint64_t)((int64_t)ahead_us - dc->tokens_us[band]);
+   if (0 == missing)
+   {
+      return 0;
+   }
+
+   return (missing * 1000000 + dc->bands[band].duty_ppm - 1) / dc->bands[band].duty_ppm;
+}
+
+void lora_duty_cycle_consume(lora_duty_cycle_t *dc, long frequency, uint32_t airtime_us, uint64_t now_us)
+{
+   int band = lora_duty_cycle_band(dc, frequency);
+
+   if (band < 0)
+   {
+      return;
+   }
+
+   lora_duty_cycle_refill(dc, band, now_us);
+   dc->tokens_us[band] -= airtime_us;
+}
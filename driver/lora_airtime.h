@@ -0,0 +1,118 @@
+/**
+ * @file lora_airtime.h
+ * @brief LoRa time-on-air calculation and duty-cycle accounting
+ *
+ * Integer-only helpers to compute how long a frame occupies the channel and to
+ * budget transmissions against regulatory duty-cycle limits per sub-band.
+ */
+
+#ifndef _LORA_AIRTIME_H_
+#define _LORA_AIRTIME_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /**
+     * @brief Modem settings that determine the time on air of a frame.
+     */
+    typedef struct
+    {
+        uint8_t spreading_factor; /**< Spreading factor (6-12). */
+        uint8_t bandwidth;        /**< Signal bandwidth (0 to 9). */
+        uint8_t coding_rate;      /**< Coding rate field, 1 to 4 for 4/5 to 4/8. */
+        uint16_t preamble_length; /**< Preamble length in symbols. */
+        bool implicit_header;     /**< Implicit header mode. */
+        bool crc;                 /**< Payload CRC enabled. */
+        bool low_data_rate;       /**< Low data rate optimization enabled. */
+    } lora_modem_params_t;
+
+    /**
+     * @brief Return the duration of one symbol.
+     * @param sf Spreading factor (6-12).
+     * @param bw Signal bandwidth (0 to 9).
+     * @return Symbol time in microseconds.
+     */
+    uint32_t lora_symbol_time_us(uint8_t sf, uint8_t bw);
+
+    /**
+     * @brief Compute the time on air of a frame (SX127x datasheet formula).
+     * @param params Modem settings.
+     * @param size Payload size in bytes.
+     * @return Time on air in microseconds, rounded up.
+     */
+    uint32_t lora_airtime_us(const lora_modem_params_t *params, uint8_t size);
+
+    /**
+     * @brief Regulatory sub-band with its duty-cycle limit.
+     */
+    typedef struct
+    {
+        uint32_t freq_min; /**< Lowest frequency of the sub-band in Hz. */
+        uint32_t freq_max; /**< Highest frequency of the sub-band in Hz. */
+        uint32_t duty_ppm; /**< Allowed duty cycle in parts per million (1% = 10000). */
+    } lora_sub_band_t;
+
+    /** @brief Number of EU868 sub-bands in lora_eu868_sub_bands. */
+#define LORA_EU868_SUB_BANDS 6
+
+    /** @brief EU868 sub-bands as per ETSI EN 300 220. */
+    extern const lora_sub_band_t lora_eu868_sub_bands[LORA_EU868_SUB_BANDS];
+
+    /** @brief Maximum number of sub-bands tracked by a duty-cycle budget. */
+#define LORA_DUTY_CYCLE_MAX_BANDS 8
+
+    /**
+     * @brief Airtime owed per sub-band.
+     *
+     * A frame charges its airtime to its sub-band, and the debt is paid back at
+     * duty_ppm microseconds per second. The next frame may start once nothing
+     * is owed, so every frame is followed by the off-time
+     * airtime / duty - airtime. Unused airtime is not saved up, so no window
+     * ever carries more than its share.
+     */
+    typedef struct
+    {
+        const lora_sub_band_t *bands;
+        uint8_t n_bands;
+        int64_t tokens_us[LORA_DUTY_CYCLE_MAX_BANDS];
+        uint64_t updated_us[LORA_DUTY_CYCLE_MAX_BANDS];
+    } lora_duty_cycle_t;
+
+    /**
+     * @brief Initialize a duty-cycle budget with nothing owed.
+     * @param dc Budget to initialize.
+     * @param bands Sub-band table, must stay valid while the budget is used.
+     * @param n_bands Number of sub-bands (at most LORA_DUTY_CYCLE_MAX_BANDS).
+     * @param now_us Current lora_time_us().
+     */
+    void lora_duty_cycle_init(lora_duty_cycle_t *dc, const lora_sub_band_t *bands, uint8_t n_bands, uint64_t now_us);
+
+    /**
+     * @brief Return how long to wait before a frame may be sent.
+     * @param dc Budget.
+     * @param frequency Carrier frequency in Hz; frequencies outside every sub-band are not limited.
+     * @param ahead_us Time on air of the frames sent on the sub-band before this one, 0 for the next frame.
+     * @param now_us Current lora_time_us().
+     * @return 0 when the frame may be sent now, otherwise the wait in microseconds.
+     */
+    uint64_t lora_duty_cycle_wait_us(lora_duty_cycle_t *dc, long frequency, uint32_t ahead_us, uint64_t now_us);
+
+    /**
+     * @brief Charge a transmission to its sub-band.
+     * @param dc Budget.
+     * @param frequency Carrier frequency in Hz.
+     * @param airtime_us Time on air of the frame.
+     * @param now_us Current lora_time_us().
+     */
+    void lora_duty_cycle_consume(lora_duty_cycle_t *dc, long frequency, uint32_t airtime_us, uint64_t now_us);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _LORA_AIRTIME_H_
@@ -0,0 +1,211 @@
+/**
+ * @file lora_config.h
+ * @brief Build-time configuration of the LoRa driver
+ *
+ * Sizes the static pools every buffer of the driver comes from and selects
+ * the optional features that are compiled in. Each knob can be set on the
+ * compiler command line (-DLORA_RX_RING_LEN=2) or in a header named by
+ * LORA_CONFIG_FILE; knobs left unset take the defaults of LORA_CONFIG_PROFILE.
+ *
+ * Static footprint of the device pool reported by lora_get_footprint() on an
+ * x86-64 host; 32-bit MCUs need less, their pointers are half the size:
+ *
+ *   profile   devices   per device   pool
+ *   SENSOR    1            792 B       792 B
+ *   DEFAULT   4          4 056 B    16 224 B
+ *   GATEWAY   8         11 352 B    90 816 B
+ *
+ * What SENSOR keeps is needed by every device: the SPI transfers of one
+ * staged batch (288 B), the transmit queue, the register shadow, the
+ * transport handle, the state timers and the counters.
+ *
+ * bench/lora_footprint.c prints the numbers of the configuration it is built
+ * with.
+ */
+
+#ifndef _LORA_CONFIG_H_
+#define _LORA_CONFIG_H_
+
+#ifdef LORA_CONFIG_FILE
+#include LORA_CONFIG_FILE
+#endif
+
+/** @brief Single radio that mostly transmits small frames: smallest pools, optional features left out. */
+#define LORA_CONFIG_PROFILE_SENSOR 1
+/** @brief The pools and features of the driver before profiles existed. */
+#define LORA_CONFIG_PROFILE_DEFAULT 2
+/** @brief Several radios under sustained traffic: deep rings and queues. */
+#define LORA_CONFIG_PROFILE_GATEWAY 3
+
+#ifndef LORA_CONFIG_PROFILE
+#define LORA_CONFIG_PROFILE LORA_CONFIG_PROFILE_DEFAULT
+#endif
+
+#if LORA_CONFIG_PROFILE == LORA_CONFIG_PROFILE_SENSOR
+#define LORA_PROFILE_MAX_DEVICES 1
+#define LORA_PROFILE_RX_RING_LEN 1
+#define LORA_PROFILE_MAX_PAYLOAD 64
+#define LORA_PROFILE_TX_QUEUE_LEN 2
+#define LORA_PROFILE_TX_IOV_MAX 2
+#define LORA_PROFILE_MAX_CHANNELS 8
+#define LORA_PROFILE_GW_WORKERS 1
+#define LORA_PROFILE_GW_QUEUE_LEN 2
+#define LORA_PROFILE_FEATURES 0
+#elif LORA_CONFIG_PROFILE == LORA_CONFIG_PROFILE_GATEWAY
+#define LORA_PROFILE_MAX_DEVICES 8
+#define LORA_PROFILE_RX_RING_LEN 32
+#define LORA_PROFILE_MAX_PAYLOAD 255
+#define LORA_PROFILE_TX_QUEUE_LEN 16
+#define LORA_PROFILE_TX_IOV_MAX 4
+#define LORA_PROFILE_MAX_CHANNELS 16
+#define LORA_PROFILE_GW_WORKERS 8
+#define LORA_PROFILE_GW_QUEUE_LEN 16
+#define LORA_PROFILE_FEATURES 1
+#elif LORA_CONFIG_PROFILE == LORA_CONFIG_PROFILE_DEFAULT
+#define LORA_PROFILE_MAX_DEVICES 4
+#define LORA_PROFILE_RX_RING_LEN 8
+#define LORA_PROFILE_MAX_PAYLOAD 255
+#define LORA_PROFILE_TX_QUEUE_LEN 8
+#define LORA_PROFILE_TX_IOV_MAX 4
+#define LORA_PROFILE_MAX_CHANNELS 16
+#define LORA_PROFILE_GW_WORKERS 4
+#define LORA_PROFILE_GW_QUEUE_LEN 8
+#define LORA_PROFILE_FEATURES 1
+#else
+#error "LORA_CONFIG_PROFILE must be LORA_CONFIG_PROFILE_SENSOR, _DEFAULT or _GATEWAY"
+#endif
+
+/*
+ * Pools
+ */
+
+/** @brief Devices in the pool of lora_dev_create(). */
+#ifndef LORA_MAX_DEVICES
+#define LORA_MAX_DEVICES LORA_PROFILE_MAX_DEVICES
+#endif
+
+/** @brief Frames the streaming receive engine holds per device. */
+#ifndef LORA_RX_RING_LEN
+#define LORA_RX_RING_LEN LORA_PROFILE_RX_RING_LEN
+#endif
+
+/** @brief Largest frame sent or received, up to the 255 bytes of the FIFO; longer received frames are dropped. */
+#ifndef LORA_MAX_PAYLOAD
+#define LORA_MAX_PAYLOAD LORA_PROFILE_MAX_PAYLOAD
+#endif
+
+/** @brief Frames of the asynchronous transmit queue per device. */
+#ifndef LORA_TX_QUEUE_LEN
+#define LORA_TX_QUEUE_LEN LORA_PROFILE_TX_QUEUE_LEN
+#endif
+
+/** @brief Segments per queued frame; lora_frag.c needs 2. */
+#ifndef LORA_TX_IOV_MAX
+#define LORA_TX_IOV_MAX LORA_PROFILE_TX_IOV_MAX
+#endif
+
+/** @brief Channels of a lora_channel_plan_t. */
+#ifndef LORA_MAX_CHANNELS
+#define LORA_MAX_CHANNELS LORA_PROFILE_MAX_CHANNELS
+#endif
+
+/** @brief Log2 histogram buckets; the last one covers 2^(n-1) us and up. */
+#ifndef LORA_STATS_HIST_BUCKETS
+#define LORA_STATS_HIST_BUCKETS 24
+#endif
+
+/** @brief Gateways in the pool of lora_gw_create(). */
+#ifndef LORA_GW_MAX_GATEWAYS
+#define LORA_GW_MAX_GATEWAYS 1
+#endif
+
+/** @brief Radios one gateway merges, at most 32. */
+#ifndef LORA_GW_MAX_RADIOS
+#define LORA_GW_MAX_RADIOS LORA_MAX_DEVICES
+#endif
+
+/** @brief Worker tasks of one gateway. */
+#ifndef LORA_GW_MAX_WORKERS
+#define LORA_GW_MAX_WORKERS LORA_PROFILE_GW_WORKERS
+#endif
+
+/** @brief Packets waiting per gateway worker, a power of two. */
+#ifndef LORA_GW_QUEUE_LEN
+#define LORA_GW_QUEUE_LEN LORA_PROFILE_GW_QUEUE_LEN
+#endif
+
+/*
+ * Features
+ */
+
+/** @brief Latency histograms in lora_stats_t, 3 * LORA_STATS_HIST_BUCKETS words per device. */
+#ifndef LORA_CONFIG_STATS_HIST
+#define LORA_CONFIG_STATS_HIST LORA_PROFILE_FEATURES
+#endif
+
+/** @brief Duty-cycled reception, lora_sniff_start(). */
+#ifndef LORA_CONFIG_SNIFF
+#define LORA_CONFIG_SNIFF LORA_PROFILE_FEATURES
+#endif
+
+/** @brief Channel plans and frequency hopping, lora_set_hopping(). */
+#ifndef LORA_CONFIG_HOPPING
+#define LORA_CONFIG_HOPPING LORA_PROFILE_FEATURES
+#endif
+
+/** @brief RSSI scanning of channel plans, lora_scan_sweep(). */
+#ifndef LORA_CONFIG_SCAN
+#define LORA_CONFIG_SCAN LORA_PROFILE_FEATURES
+#endif
+
+/** @brief Streaming receive engine, lora_rx_start(), with its ring of LORA_RX_RING_LEN frames per device. */
+#ifndef LORA_CONFIG_RX_RING
+#define LORA_CONFIG_RX_RING LORA_PROFILE_FEATURES
+#endif
+
+/** @brief Confirmed sends with ACK windows and retries, lora_send_confirmed_async(). */
+#ifndef LORA_CONFIG_ACK
+#define LORA_CONFIG_ACK LORA_PROFILE_FEATURES
+#endif
+
+/** @brief Channel activity detection and listen before talk, lora_cad() and lora_send_packet_lbt(). */
+#ifndef LORA_CONFIG_LBT
+#define LORA_CONFIG_LBT LORA_PROFILE_FEATURES
+#endif
+
+/** @brief Back-to-back sends, lora_send_batch(). */
+#ifndef LORA_CONFIG_BATCH
+#define LORA_CONFIG_BATCH LORA_PROFILE_FEATURES
+#endif
+
+/** @brief Configuration kept across MCU deep sleep, lora_warm_save() and lora_driver_init_warm(). */
+#ifndef LORA_CONFIG_WARM
+#define LORA_CONFIG_WARM LORA_PROFILE_FEATURES
+#endif
+
+/* Channel plans come with either of the two. */
+#define LORA_CONFIG_CHANNEL_PLAN (LORA_CONFIG_HOPPING || LORA_CONFIG_SCAN)
+
+#if LORA_MAX_DEVICES < 1 || LORA_RX_RING_LEN < 1 || LORA_TX_QUEUE_LEN < 1 || LORA_TX_IOV_MAX < 1
+#error "LoRa pools need at least one entry"
+#endif
+#if LORA_MAX_PAYLOAD < 1 || LORA_MAX_PAYLOAD > 255
+#error "LORA_MAX_PAYLOAD must be 1 to 255"
+#endif
+#if LORA_MAX_CHANNELS < 1 || LORA_MAX_CHANNELS > 255
+#error "LORA_MAX_CHANNELS must be 1 to 255"
+#endif
+#if LORA_GW_MAX_RADIOS < 1 || LORA_GW_MAX_RADIOS > 32 || LORA_GW_MAX_WORKERS < 1
+#error "A gateway needs 1 to 32 radios and at least one worker"
+#endif
+#if LORA_GW_QUEUE_LEN < 1 || (LORA_GW_QUEUE_LEN & (LORA_GW_QUEUE_LEN - 1))
+#error "LORA_GW_QUEUE_LEN must be a power of two"
+#endif
+#if LORA_CONFIG_SNIFF && !LORA_CONFIG_RX_RING
+#error "LORA_CONFIG_SNIFF puts its frames in the receive ring and needs LORA_CONFIG_RX_RING"
+#endif
+#if LORA_CONFIG_STATS_HIST && LORA_STATS_HIST_BUCKETS < 1
+#error "LORA_STATS_HIST_BUCKETS must be at least 1"
+#endif
+
+#endif // _LORA_CONFIG_H_
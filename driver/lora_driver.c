@@ -1,17 +1,333 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdbool.h>
-#include "lora_driver_defs.h"
+#include <stdatomic.h>
+#include "lora_driver.h"
+#include "lora_trace.h"
 #include "api/driver_api.h"
 
-static uint8_t __implicit;
-static long __frequency;
-static uint8_t __send_packet_lost = 0;
-static uint8_t *irq;
+typedef struct
+{
+   struct iovec iov[LORA_TX_IOV_MAX];
+   uint8_t iovcnt;
+#if LORA_CONFIG_ACK
+   /* Acknowledgement to wait for, NULL for a plain send. */
+   const lora_confirm_t *confirm;
+#endif
+   lora_tx_cb_t cb;
+   void *ctx;
+} lora_tx_frame_t;
+
+typedef enum
+{
+   LORA_STATE_SLEEP,
+   LORA_STATE_STANDBY,
+   LORA_STATE_TX,
+   LORA_STATE_RX,
+   LORA_STATE_CAD,
+   LORA_STATE_RX_SINGLE,
+   LORA_STATE_COUNT,
+} lora_state_t;
+
+struct lora_dev
+{
+   api_handle_t io;
+   bool in_use;
+
+   uint8_t implicit;
+   long frequency;
+   /* Subtracted from the RSSI registers, follows the frequency band. */
+   int16_t rssi_offset;
+   atomic_uint send_packet_lost;
+   /* Seqlock: odd while the single writer (holding the device lock) updates stats. */
+   atomic_uint stats_seq;
+   lora_stats_t stats;
+   uint64_t tx_start_us;
+   /* The frame on air is the tail of the transmit queue, not a blocking send. */
+   bool tx_from_queue;
+   /* TxDone of a batch frame is still set; the radio sits in standby. */
+   bool tx_done_pending;
+   atomic_int last_rssi;
+   atomic_int last_snr;
+   bool dio0_irq;
+   bool dio1_irq;
+   /* Written by the DIO0 interrupt before it signals the event. */
+   volatile uint64_t dio0_time_us;
+   uint64_t tx_done_us;
+   lora_state_t state;
+   uint64_t state_since_us;
+   uint64_t state_time_us[LORA_STATE_COUNT];
+   uint32_t prng;
+
+   /*
+    * Shadow copy of the register file (0x01 to REG_VERSION). Every write goes
+    * through lora_write_reg()/lora_write_reg_buffer() and updates it, so the
+    * configuration setters and getters can work from RAM instead of doing
+    * read-modify-write cycles over SPI. Status registers are also present in
+    * the image but are never served from it.
+    */
+   uint8_t shadow[REG_VERSION + 1];
+   bool shadow_valid;
+
+   api_transfer_t staged[LORA_MAX_STAGED];
+   uint8_t n_staged;
+   bool staged_write;
+   lora_status_t stage_status;
+
+   lora_tx_frame_t tx_queue[LORA_TX_QUEUE_LEN];
+   atomic_uint tx_head;
+   atomic_uint tx_tail;
+   uint64_t tx_deadline_us;
+   lora_duty_cycle_t *duty_cycle;
+   /* The head of the queue may not start before this time. */
+   uint64_t tx_hold_us;
+
+#if LORA_CONFIG_ACK
+   /*
+    * Confirmed send at the head of the queue: attempts that went unanswered,
+    * the ACK window in RX_SINGLE and the end of the backoff before the next
+    * attempt. ack_step is 1 once the window was extended for a reply that
+    * started late.
+    */
+   uint8_t ack_attempts;
+   bool ack_wait;
+   uint8_t ack_step;
+   uint64_t ack_deadline_us;
+   uint64_t ack_retry_us;
+#endif
+
+   /*
+    * Channel hopping, see lora_set_hopping(). hop_pos is the next entry of the
+    * hop order for per-frame hopping, the current one within an FHSS frame.
+    */
+#if LORA_CONFIG_HOPPING
+   const lora_channel_plan_t *hop_plan;
+   uint8_t hop_period;
+   uint8_t hop_pos;
+#endif
+
+   /*
+    * FIFO split: TX frames are written from fifo_split up, RX frames land
+    * below it. 0 means the whole FIFO is shared. tx_fifo_base/len describe
+    * the last frame handed to the transmitter.
+    */
+   uint8_t fifo_split;
+   uint8_t tx_fifo_base;
+   uint8_t tx_fifo_len;
+
+   /* Frame preloaded by lora_stage_tx(); reloaded from tx_staged_buf when dirty. */
+   bool tx_staged;
+   bool tx_staged_dirty;
+   uint8_t *tx_staged_buf;
+   uint8_t tx_staged_base;
+   uint8_t tx_staged_len;
+
+#if LORA_CONFIG_RX_RING
+   lora_rx_packet_t rx_ring[LORA_RX_RING_LEN];
+   atomic_uint rx_head;
+   atomic_uint rx_tail;
+   atomic_bool rx_active;
+#endif
+   atomic_uint rx_overruns;
+
+#if LORA_CONFIG_SNIFF
+   atomic_bool sniff_active;
+   uint32_t sniff_interval_us;
+   uint64_t sniff_next_us;
+   /* Deadline of the CAD or RX_SINGLE step in progress. */
+   uint64_t sniff_deadline_us;
+   uint16_t sniff_timeout;
+   /* RX_SINGLE progress: 0 searching the preamble, 1 waiting for the header, 2 receiving. */
+   uint8_t sniff_step;
+#endif
+   uint32_t cad_count;
+   uint32_t cad_detected;
+};
+
+static lora_dev_t __devices[LORA_MAX_DEVICES];
+
+/*
+ * Per-device lock. It is recursive, so public functions that build on each
+ * other may all take it; it is never held while waiting for the radio.
+ */
+#define LORA_LOCK(dev) lora_lock(&(dev)->io)
+#define LORA_UNLOCK(dev) lora_unlock(&(dev)->io)
+
+/*
+ * Record a radio state change and charge the time spent in the previous state.
+ */
+static void lora_set_state(lora_dev_t *dev, lora_state_t state)
+{
+   uint64_t now = lora_time_us();
+
+   LORA_LOCK(dev);
+   dev->state_time_us[dev->state] += now - dev->state_since_us;
+   dev->state_since_us = now;
+   dev->state = state;
+   if (LORA_STATE_SLEEP == state)
+   {
+      /* The FIFO does not keep its content in sleep. */
+      dev->tx_staged_dirty = true;
+   }
+   LORA_UNLOCK(dev);
+}
+
+/*
+ * Statistics are written under the device lock and published through
+ * stats_seq, so lora_get_stats() can copy them without taking the lock.
+ */
+static void lora_stats_begin(lora_dev_t *dev)
+{
+   LORA_LOCK(dev);
+   atomic_store_explicit(&dev->stats_seq, atomic_load_explicit(&dev->stats_seq, memory_order_relaxed) + 1,
+                         memory_order_relaxed);
+   atomic_thread_fence(memory_order_release);
+}
+
+static void lora_stats_end(lora_dev_t *dev)
+{
+   atomic_store_explicit(&dev->stats_seq, atomic_load_explicit(&dev->stats_seq, memory_order_relaxed) + 1,
+                         memory_order_release);
+   LORA_UNLOCK(dev);
+}
+
+static void lora_stats_add(lora_dev_t *dev, uint32_t *counter, uint32_t n)
+{
+   lora_stats_begin(dev);
+   *counter += n;
+   lora_stats_end(dev);
+}
+
+#if LORA_CONFIG_STATS_HIST
+/*
+ * Histogram bucket i counts samples in [2^i, 2^(i+1)) us, bucket 0 also
+ * takes 0 and the last one everything above.
+ */
+static void lora_stats_hist(lora_dev_t *dev, uint32_t *hist, uint64_t us)
+{
+   uint8_t bucket = 0;
+
+   while (us > 1 && bucket < LORA_STATS_HIST_BUCKETS - 1)
+   {
+      us >>= 1;
+      bucket++;
+   }
+
+   lora_stats_add(dev, &hist[bucket], 1);
+}
+
+#define LORA_STATS_HIST(dev, hist, us) lora_stats_hist((dev), (dev)->stats.hist, (us))
+#else
+/* The sample is not evaluated without histograms. */
+#define LORA_STATS_HIST(dev, hist, us) ((void)sizeof(us))
+#endif
+
+/*
+ * Account one register access: bytes on the bus, or an error of its kind.
+ */
+static void lora_stats_spi(lora_dev_t *dev, api_status_t status, uint32_t *errors, uint8_t len)
+{
+   if (API_OK == status)
+   {
+      lora_stats_add(dev, &dev->stats.spi_bytes, 1 + (uint32_t)len);
+   }
+   else
+   {
+      lora_stats_add(dev, errors, 1);
+   }
+}
+
+/*
+ * Note that FIFO bytes [base, base + len) are about to be overwritten, which
+ * spoils a preloaded frame they overlap.
+ */
+static void lora_fifo_claim(lora_dev_t *dev, unsigned int base, unsigned int len)
+{
+   unsigned int staged = dev->tx_staged_base;
+
+   if (!dev->tx_staged)
+   {
+      return;
+   }
+   if (base + len > 256 && staged < base + len - 256)
+   {
+      /* The write wraps around the end of the FIFO. */
+      dev->tx_staged_dirty = true;
+   }
+   if (base < staged + dev->tx_staged_len && staged < base + len)
+   {
+      dev->tx_staged_dirty = true;
+   }
+}
+
+/*
+ * RSSI offset of the band a frequency belongs to.
+ */
+static int16_t lora_rssi_offset(long frequency)
+{
+   return frequency < LORA_RSSI_HF_MIN_FREQUENCY ? LORA_RSSI_OFFSET_LF : LORA_RSSI_OFFSET_HF;
+}
+
+static void lora_dio0_isr(void *arg)
+{
+   lora_dev_t *dev = arg;
+
+   dev->dio0_time_us = lora_time_us();
+   lora_event_signal(&dev->io);
+}
+
+static void lora_dio1_isr(void *arg)
+{
+   lora_dev_t *dev = arg;
+
+   lora_event_signal(&dev->io);
+}
+
+/*
+ * Time of the DIO0 event being handled. Without DIO0 the best we have is the
+ * time the flag was seen.
+ */
+static uint64_t lora_event_time(lora_dev_t *dev)
+{
+   return dev->dio0_irq ? dev->dio0_time_us : lora_time_us();
+}
+
+lora_dev_t *lora_dev_create(const api_handle_t *io)
+{
+   for (uint8_t i = 0; i < LORA_MAX_DEVICES; i++)
+   {
+      lora_dev_t *dev = &__devices[i];
+      if (!dev->in_use)
+      {
+         memset(dev, 0, sizeof(*dev));
+         dev->io = *io;
+         dev->in_use = true;
+         dev->state = LORA_STATE_SLEEP;
+         dev->rssi_offset = LORA_RSSI_OFFSET_LF;
+         dev->state_since_us = lora_time_us();
+         return dev;
+      }
+   }
 
-lora_status_t lora_write_reg(uint8_t reg, uint8_t val)
+   return NULL;
+}
+
+void lora_dev_destroy(lora_dev_t *dev)
+{
+   dev->in_use = false;
+}
+
+lora_status_t lora_write_reg(lora_dev_t *dev, uint8_t reg, uint8_t val)
 {
-   api_status_t status = spi_write(reg, val);
+   LORA_LOCK(dev);
+   api_status_t status = dev->io.ops->write(&dev->io, reg, val);
+   lora_stats_spi(dev, status, &dev->stats.spi_write_errors, 1);
+
+   if (API_OK == status && reg <= REG_VERSION)
+   {
+      dev->shadow[reg] = val;
+   }
+   LORA_UNLOCK(dev);
 
    if (API_OK == status)
    {
@@ -23,9 +339,18 @@ lora_status_t lora_write_reg(uint8_t reg, uint8_t val)
    }
 }
 
-lora_status_t lora_write_reg_buffer(uint8_t reg, uint8_t *val, uint8_t len)
+lora_status_t lora_write_reg_buffer(lora_dev_t *dev, uint8_t reg, uint8_t *val, uint8_t len)
 {
-   api_status_t status = spi_write_buf(reg, val, len);
+   LORA_LOCK(dev);
+   api_status_t status = dev->io.ops->write_buf(&dev->io, reg, val, len);
+   lora_stats_spi(dev, status, &dev->stats.spi_write_buf_errors, len);
+
+   if (API_OK == status && REG_FIFO != reg && reg + len <= REG_VERSION + 1)
+   {
+      memcpy(&dev->shadow[reg], val, len);
+   }
+   LORA_UNLOCK(dev);
+
    if (API_OK == status)
    {
       return LORA_OK;
@@ -36,9 +361,13 @@ lora_status_t lora_write_reg_buffer(uint8_t reg, uint8_t *val, uint8_t len)
    }
 }
 
-lora_status_t lora_read_reg(uint8_t reg, uint8_t *val)
+lora_status_t lora_read_reg(lora_dev_t *dev, uint8_t reg, uint8_t *val)
 {
-   api_status_t status = spi_read(reg, val);
+   LORA_LOCK(dev);
+   api_status_t status = dev->io.ops->read(&dev->io, reg, val);
+   lora_stats_spi(dev, status, &dev->stats.spi_read_errors, 1);
+   LORA_UNLOCK(dev);
+
    if (API_OK == status)
    {
       return LORA_OK;
@@ -49,9 +378,13 @@ lora_status_t lora_read_reg(uint8_t reg, uint8_t *val)
    }
 }
 
-lora_status_t lora_read_reg_buffer(uint8_t reg, uint8_t *val, uint8_t len)
+lora_status_t lora_read_reg_buffer(lora_dev_t *dev, uint8_t reg, uint8_t *val, uint8_t len)
 {
-   api_status_t status = spi_read_buf(reg, val, len);
+   LORA_LOCK(dev);
+   api_status_t status = dev->io.ops->read_buf(&dev->io, reg, val, len);
+   lora_stats_spi(dev, status, &dev->stats.spi_read_buf_errors, len);
+   LORA_UNLOCK(dev);
+
    if (API_OK == status)
    {
       return LORA_OK;
@@ -62,50 +395,208 @@ lora_status_t lora_read_reg_buffer(uint8_t reg, uint8_t *val, uint8_t len)
    }
 }
 
-lora_status_t lora_explicit_header_mode(void)
+/*
+ * Reload the shadow copy when it cannot be trusted, e.g. after a failed
+ * flush left staged writes in it that never reached the radio. Called before
+ * anything merges bits into the shadow copy or returns them.
+ */
+static lora_status_t lora_shadow_load(lora_dev_t *dev)
 {
-   __implicit = 0;
-   uint8_t reg_val;
+   return dev->shadow_valid ? LORA_OK : lora_cache_resync(dev);
+}
 
-   if (lora_read_reg(REG_MODEM_CONFIG_1, &reg_val) != LORA_OK)
+/*
+ * Write a configuration register, skipping the SPI transaction when the
+ * shadow copy already holds the value.
+ */
+static lora_status_t lora_write_reg_cached(lora_dev_t *dev, uint8_t reg, uint8_t val)
+{
+   if (dev->shadow_valid && dev->shadow[reg] == val)
    {
-      return LORA_FAIL;
+      return LORA_OK;
    }
 
-   return lora_write_reg(REG_MODEM_CONFIG_1, reg_val & 0xfe);
+   return lora_write_reg(dev, reg, val);
 }
 
-lora_status_t lora_implicit_header_mode(uint8_t size)
+/*
+ * Replace the bits selected by mask in a cached configuration register. The
+ * read-modify-write of the shadow copy is done under the device lock, so
+ * setters sharing a register cannot lose each other's update.
+ */
+static lora_status_t lora_update_reg_cached(lora_dev_t *dev, uint8_t reg, uint8_t mask, uint8_t bits)
 {
    lora_status_t ret;
-   __implicit = 1;
 
-   uint8_t reg_val;
+   LORA_LOCK(dev);
+   ret = lora_shadow_load(dev);
+   if (LORA_OK == ret)
+   {
+      ret = lora_write_reg_cached(dev, reg, (dev->shadow[reg] & ~mask) | (bits & mask));
+   }
+   LORA_UNLOCK(dev);
+
+   return ret;
+}
+
+/*
+ * Register sequences on the data path are staged: on transports with queue
+ * support they are queued back to back and completed by lora_flush() with a
+ * single wait, on the others each transfer is executed right away. The first
+ * error is kept and returned by lora_flush().
+ */
+static lora_status_t lora_flush(lora_dev_t *dev)
+{
+   lora_status_t ret = dev->stage_status;
+
+   if (dev->n_staged > 0)
+   {
+      if (API_OK != dev->io.ops->flush(&dev->io) && LORA_OK == ret)
+      {
+         ret = dev->staged_write ? LORA_FAILED_SPI_WRITE_BUF : LORA_FAILED_SPI_READ_BUF;
+         lora_stats_add(dev, dev->staged_write ? &dev->stats.spi_write_buf_errors : &dev->stats.spi_read_buf_errors, 1);
+      }
+      dev->n_staged = 0;
+   }
+
+   if (LORA_OK != ret)
+   {
+      /* Staged writes updated the shadow copy before they were executed. */
+      dev->shadow_valid = false;
+   }
+
+   dev->staged_write = false;
+   dev->stage_status = LORA_OK;
+   return ret;
+}
+
+static void lora_stage(lora_dev_t *dev, uint8_t reg, bool write, uint8_t *buf, uint8_t len)
+{
+   if (LORA_OK != dev->stage_status)
+   {
+      return;
+   }
+
+   if (NULL == dev->io.ops->queue)
+   {
+      if (write)
+         dev->stage_status = (1 == len) ? lora_write_reg(dev, reg, *buf) : lora_write_reg_buffer(dev, reg, buf, len);
+      else
+         dev->stage_status = (1 == len) ? lora_read_reg(dev, reg, buf) : lora_read_reg_buffer(dev, reg, buf, len);
+      return;
+   }
+
+   if (LORA_MAX_STAGED == dev->n_staged)
+   {
+      dev->stage_status = lora_flush(dev);
+      if (LORA_OK != dev->stage_status)
+      {
+         /* Like any staged failure: nothing more is queued, lora_flush() reports it. */
+         return;
+      }
+   }
+
+   api_transfer_t *xfer = &dev->staged[dev->n_staged++];
+   xfer->reg = reg;
+   xfer->write = write;
+   xfer->len = len;
+   xfer->buf = buf;
+   xfer->done = NULL;
+
+   if (write)
+   {
+      if (1 == len)
+      {
+         xfer->data = *buf;
+         xfer->buf = &xfer->data;
+      }
+      if (REG_FIFO != reg && reg + len <= REG_VERSION + 1)
+      {
+         memcpy(&dev->shadow[reg], xfer->buf, len);
+      }
+      dev->staged_write = true;
+   }
+
+   if (API_OK != dev->io.ops->queue(&dev->io, xfer))
+   {
+      dev->stage_status = write ? LORA_FAILED_SPI_WRITE_BUF : LORA_FAILED_SPI_READ_BUF;
+      lora_stats_add(dev, write ? &dev->stats.spi_write_buf_errors : &dev->stats.spi_read_buf_errors, 1);
+      return;
+   }
+   lora_stats_add(dev, &dev->stats.spi_bytes, 1 + (uint32_t)len);
+}
 
-   ret = lora_read_reg(REG_MODEM_CONFIG_1, &reg_val);
+static void lora_stage_write(lora_dev_t *dev, uint8_t reg, uint8_t val)
+{
+   lora_stage(dev, reg, true, &val, 1);
+}
+
+lora_status_t lora_cache_resync(lora_dev_t *dev)
+{
+   LORA_LOCK(dev);
+   lora_status_t ret = lora_read_reg_buffer(dev, REG_OP_MODE, &dev->shadow[REG_OP_MODE], REG_VERSION);
+
+   dev->shadow_valid = (LORA_OK == ret);
+   LORA_UNLOCK(dev);
+
+   return ret;
+}
+
+lora_status_t lora_explicit_header_mode(lora_dev_t *dev)
+{
+   dev->implicit = 0;
+
+   return lora_update_reg_cached(dev, REG_MODEM_CONFIG_1, 0x01, 0x00);
+}
+
+lora_status_t lora_implicit_header_mode(lora_dev_t *dev, uint8_t size)
+{
+   lora_status_t ret;
+
+   LORA_LOCK(dev);
+   dev->implicit = 1;
 
-   ret += lora_write_reg(REG_MODEM_CONFIG_1, reg_val | 0x01);
-   ret += lora_write_reg(REG_PAYLOAD_LENGTH, size);
+   ret = lora_update_reg_cached(dev, REG_MODEM_CONFIG_1, 0x01, 0x01);
+   ret += lora_write_reg_cached(dev, REG_PAYLOAD_LENGTH, size);
+   LORA_UNLOCK(dev);
 
    return ret;
 }
 
-lora_status_t lora_idle_mode(void)
+lora_status_t lora_idle_mode(lora_dev_t *dev)
 {
-   return lora_write_reg(REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_STDBY);
+   lora_status_t ret = lora_write_reg(dev, REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_STDBY);
+
+   if (LORA_OK == ret)
+   {
+      lora_set_state(dev, LORA_STATE_STANDBY);
+   }
+   return ret;
 }
 
-lora_status_t lora_sleep_mode(void)
+lora_status_t lora_sleep_mode(lora_dev_t *dev)
 {
-   return lora_write_reg(REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_SLEEP);
+   lora_status_t ret = lora_write_reg(dev, REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_SLEEP);
+
+   if (LORA_OK == ret)
+   {
+      lora_set_state(dev, LORA_STATE_SLEEP);
+   }
+   return ret;
 }
 
-lora_status_t lora_receive_mode(void)
+lora_status_t lora_receive_mode(lora_dev_t *dev)
 {
-   return lora_write_reg(REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_RX_CONTINUOUS);
+   lora_status_t ret = lora_write_reg(dev, REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_RX_CONTINUOUS);
+
+   if (LORA_OK == ret)
+   {
+      lora_set_state(dev, LORA_STATE_RX);
+   }
+   return ret;
 }
 
-lora_status_t lora_set_tx_power(uint8_t level)
+lora_status_t lora_set_tx_power(lora_dev_t *dev, uint8_t level)
 {
    if (level < 2)
    {
@@ -116,24 +607,27 @@ lora_status_t lora_set_tx_power(uint8_t level)
       level = 17;
    }
 
-   return lora_write_reg(REG_PA_CONFIG, PA_BOOST | (level - 2));
+   return lora_write_reg_cached(dev, REG_PA_CONFIG, PA_BOOST | (level - 2));
 }
 
-lora_status_t lora_set_frequency(long frequency)
+lora_status_t lora_set_frequency(lora_dev_t *dev, long frequency)
 {
    lora_status_t ret;
-   __frequency = frequency;
-
    uint64_t frf = ((uint64_t)frequency << 19) / 32000000;
+   uint8_t rf[3] = {(uint8_t)(frf >> 16), (uint8_t)(frf >> 8), (uint8_t)(frf >> 0)};
+
+   LORA_LOCK(dev);
+   dev->frequency = frequency;
+   dev->rssi_offset = lora_rssi_offset(frequency);
 
-   ret = lora_write_reg(REG_FRF_MSB, (uint8_t)(frf >> 16));
-   ret += lora_write_reg(REG_FRF_MID, (uint8_t)(frf >> 8));
-   ret += lora_write_reg(REG_FRF_LSB, (uint8_t)(frf >> 0));
+   /* The new frequency is applied on the FrfLsb write, so all three bytes go out, LSB last; the shadow follows. */
+   ret = lora_write_reg_buffer(dev, REG_FRF_MSB, rf, sizeof(rf));
+   LORA_UNLOCK(dev);
 
    return ret;
 }
 
-lora_status_t lora_set_spreading_factor(uint8_t sf)
+lora_status_t lora_set_spreading_factor(lora_dev_t *dev, uint8_t sf)
 {
    lora_status_t ret;
    if (sf < 6)
@@ -145,110 +639,69 @@ lora_status_t lora_set_spreading_factor(uint8_t sf)
       sf = 12;
    }
 
+   LORA_LOCK(dev);
    if (6 == sf)
    {
-      ret = lora_write_reg(REG_DETECTION_OPTIMIZE, 0xc5);
-      ret += lora_write_reg(REG_DETECTION_THRESHOLD, 0x0c);
+      ret = lora_write_reg_cached(dev, REG_DETECTION_OPTIMIZE, 0xc5);
+      ret += lora_write_reg_cached(dev, REG_DETECTION_THRESHOLD, 0x0c);
    }
    else
    {
-      ret = lora_write_reg(REG_DETECTION_OPTIMIZE, 0xc3);
-      ret += lora_write_reg(REG_DETECTION_THRESHOLD, 0x0a);
+      ret = lora_write_reg_cached(dev, REG_DETECTION_OPTIMIZE, 0xc3);
+      ret += lora_write_reg_cached(dev, REG_DETECTION_THRESHOLD, 0x0a);
    }
 
-   uint8_t reg_val;
-   ret += lora_read_reg(REG_MODEM_CONFIG_2, &reg_val);
-   ret += lora_write_reg(REG_MODEM_CONFIG_2, (reg_val & 0x0f) | ((sf << 4) & 0xf0));
+   ret += lora_update_reg_cached(dev, REG_MODEM_CONFIG_2, 0xf0, sf << 4);
+   LORA_UNLOCK(dev);
+
    return ret;
 }
 
-lora_status_t lora_get_spreading_factor(uint8_t *sf)
+lora_status_t lora_get_spreading_factor(lora_dev_t *dev, uint8_t *sf)
 {
-   uint8_t reg_val;
-   if (lora_read_reg(REG_MODEM_CONFIG_2, &reg_val) != LORA_OK)
-   {
-      return LORA_FAIL;
-   }
+   lora_status_t ret = lora_shadow_load(dev);
 
-   *sf = (reg_val >> 4);
-   return LORA_OK;
+   *sf = (dev->shadow[REG_MODEM_CONFIG_2] >> 4);
+   return ret;
 }
 
-lora_status_t lora_set_dio_mapping(uint8_t dio, uint8_t mode)
+lora_status_t lora_set_dio_mapping(lora_dev_t *dev, uint8_t dio, uint8_t mode)
 {
-   uint8_t _mode = 0;
    lora_status_t ret;
 
    if (dio < 4)
    {
-      ret = lora_read_reg(REG_DIO_MAPPING_1, &_mode);
-      if (ret != LORA_OK)
-      {
-         return ret;
-      }
-
-      if (0 == dio)
-      {
-         _mode = _mode & 0x3F;
-         _mode = _mode | (mode << 6);
-      }
-      else if (1 == dio)
-      {
-         _mode = _mode & 0xCF;
-         _mode = _mode | (mode << 4);
-      }
-      else if (2 == dio)
-      {
-         _mode = _mode & 0xF3;
-         _mode = _mode | (mode << 2);
-      }
-      else if (3 == dio)
-      {
-         _mode = _mode & 0xFC;
-         _mode = _mode | mode;
-      }
+      uint8_t shift = 6 - 2 * dio;
 
-      ret += lora_write_reg(REG_DIO_MAPPING_1, _mode);
-      printf("REG_DIO_MAPPING_1=0x%02x", _mode);
+      ret = lora_update_reg_cached(dev, REG_DIO_MAPPING_1, 0x03 << shift, mode << shift);
+      LORA_TRACE_DEBUG(LORA_TRACE_DIO_MAPPING, (dio << 8) | mode);
       return ret;
    }
    else if (dio < 6)
    {
-      ret = lora_read_reg(REG_DIO_MAPPING_2, &mode);
-
-      if (4 == dio)
-      {
-         _mode = _mode & 0x3F;
-         _mode = _mode | (mode << 6);
-      }
-      else if (5 == dio)
-      {
-         _mode = _mode & 0xCF;
-         _mode = _mode | (mode << 4);
-      }
+      uint8_t shift = 6 - 2 * (dio - 4);
 
-      ret += lora_write_reg(REG_DIO_MAPPING_2, _mode);
-      printf("REG_DIO_MAPPING_2=0x%02x", _mode);
+      ret = lora_update_reg_cached(dev, REG_DIO_MAPPING_2, 0x03 << shift, mode << shift);
+      LORA_TRACE_DEBUG(LORA_TRACE_DIO_MAPPING, (dio << 8) | mode);
       return ret;
    }
 
    return LORA_FAIL;
 }
 
-lora_status_t lora_get_dio_mapping(uint8_t dio, uint8_t *mapping)
+lora_status_t lora_get_dio_mapping(lora_dev_t *dev, uint8_t dio, uint8_t *mapping)
 {
    uint8_t _mode;
-   lora_status_t ret;
+   lora_status_t ret = lora_shadow_load(dev);
 
-   if (dio < 4)
+   if (LORA_OK != ret)
    {
-      ret = lora_read_reg(REG_DIO_MAPPING_1, &_mode);
-      if (ret != LORA_OK)
-      {
-         return ret;
-      }
+      return ret;
+   }
 
-      printf("REG_DIO_MAPPING_1=0x%02x", _mode);
+   if (dio < 4)
+   {
+      _mode = dev->shadow[REG_DIO_MAPPING_1];
 
       if (0 == dio)
       {
@@ -271,13 +724,7 @@ lora_status_t lora_get_dio_mapping(uint8_t dio, uint8_t *mapping)
    }
    else if (dio < 6)
    {
-      ret = lora_read_reg(REG_DIO_MAPPING_2, &_mode);
-      if (ret != LORA_OK)
-      {
-         return ret;
-      }
-
-      printf("REG_DIO_MAPPING_2=0x%02x", _mode);
+      _mode = dev->shadow[REG_DIO_MAPPING_2];
 
       if (4 == dio)
       {
@@ -293,260 +740,2707 @@ lora_status_t lora_get_dio_mapping(uint8_t dio, uint8_t *mapping)
    return LORA_FAIL;
 }
 
-lora_status_t lora_set_bandwidth(uint8_t sbw)
+lora_status_t lora_set_bandwidth(lora_dev_t *dev, uint8_t sbw)
 {
-   uint8_t reg_val;
-
-   if (lora_read_reg(REG_MODEM_CONFIG_1, &reg_val) != LORA_OK)
-   {
-      return LORA_FAIL;
-   }
-
    if (sbw < 10)
    {
-      return lora_write_reg(REG_MODEM_CONFIG_1, (reg_val & 0x0f) | (sbw << 4));
+      return lora_update_reg_cached(dev, REG_MODEM_CONFIG_1, 0xf0, sbw << 4);
    }
 
    return LORA_FAIL;
 }
 
-lora_status_t lora_get_bandwidth(uint8_t *sbw)
+lora_status_t lora_get_bandwidth(lora_dev_t *dev, uint8_t *sbw)
 {
-   uint8_t reg_val;
-   if (lora_read_reg(REG_MODEM_CONFIG_1, &reg_val) != LORA_OK)
-   {
-      return LORA_FAIL;
-   }
+   lora_status_t ret = lora_shadow_load(dev);
 
-   *sbw = ((reg_val & 0xf0) >> 4);
-   return LORA_OK;
+   *sbw = ((dev->shadow[REG_MODEM_CONFIG_1] & 0xf0) >> 4);
+   return ret;
 }
 
-lora_status_t lora_set_coding_rate(uint8_t denominator)
+lora_status_t lora_set_coding_rate(lora_dev_t *dev, uint8_t denominator)
 {
-   uint8_t reg_val;
-   if (lora_read_reg(REG_MODEM_CONFIG_1, &reg_val) != LORA_OK)
-   {
-      return LORA_FAIL;
-   }
-
    if (denominator < 5)
       denominator = 5;
    else if (denominator > 8)
       denominator = 8;
 
    uint8_t cr = denominator - 4;
-   return lora_write_reg(REG_MODEM_CONFIG_1, (reg_val & 0xf1) | (cr << 1));
+   return lora_update_reg_cached(dev, REG_MODEM_CONFIG_1, 0x0e, cr << 1);
 }
 
-lora_status_t lora_get_coding_rate(uint8_t *cr)
+lora_status_t lora_get_coding_rate(lora_dev_t *dev, uint8_t *cr)
 {
-   uint8_t reg_val;
-   if (lora_read_reg(REG_MODEM_CONFIG_1, &reg_val) != LORA_OK)
-   {
-      return LORA_FAIL;
-   }
+   lora_status_t ret = lora_shadow_load(dev);
 
-   *cr = (reg_val & 0x0e) >> 1;
-   return LORA_OK;
+   *cr = (dev->shadow[REG_MODEM_CONFIG_1] & 0x0e) >> 1;
+   return ret;
 }
 
-lora_status_t lora_set_preamble_length(long length)
+lora_status_t lora_set_preamble_length(lora_dev_t *dev, long length)
 {
    lora_status_t ret;
-   ret = lora_write_reg(REG_PREAMBLE_MSB, (uint8_t)(length >> 8));
-   ret += lora_write_reg(REG_PREAMBLE_LSB, (uint8_t)(length >> 0));
+
+   LORA_LOCK(dev);
+   ret = lora_write_reg_cached(dev, REG_PREAMBLE_MSB, (uint8_t)(length >> 8));
+   ret += lora_write_reg_cached(dev, REG_PREAMBLE_LSB, (uint8_t)(length >> 0));
+   LORA_UNLOCK(dev);
+
    return ret;
 }
 
-lora_status_t lora_get_preamble_length(long *preamble)
+lora_status_t lora_get_preamble_length(lora_dev_t *dev, long *preamble)
 {
-   uint8_t reg_val;
-   if (lora_read_reg(REG_PREAMBLE_MSB, &reg_val) != LORA_OK)
-   {
-      return LORA_FAIL;
-   }
+   LORA_LOCK(dev);
+   lora_status_t ret = lora_shadow_load(dev);
+   *preamble = (dev->shadow[REG_PREAMBLE_MSB] << 8) + dev->shadow[REG_PREAMBLE_LSB];
+   LORA_UNLOCK(dev);
 
-   *preamble = (reg_val << 8);
-
-   if (lora_read_reg(REG_PREAMBLE_LSB, &reg_val) != LORA_OK)
-   {
-      return LORA_FAIL;
-   }
+   return ret;
+}
 
-   *preamble = *preamble + reg_val;
+lora_status_t lora_set_sync_word(lora_dev_t *dev, uint8_t sw)
+{
+   return lora_write_reg_cached(dev, REG_SYNC_WORD, sw);
+}
 
-   return LORA_OK;
+lora_status_t lora_enable_crc(lora_dev_t *dev)
+{
+   return lora_update_reg_cached(dev, REG_MODEM_CONFIG_2, 0x04, 0x04);
 }
 
-lora_status_t lora_set_sync_word(uint8_t sw)
+lora_status_t lora_disable_crc(lora_dev_t *dev)
 {
-   return lora_write_reg(REG_SYNC_WORD, sw);
+   return lora_update_reg_cached(dev, REG_MODEM_CONFIG_2, 0x04, 0x00);
 }
 
-lora_status_t lora_enable_crc(void)
+/*
+ * Burst-write the part of a contiguous register range that differs from the
+ * shadow copy. Unchanged bytes at either end are not sent, except those of a
+ * changed FRF.
+ */
+static lora_status_t lora_write_range_cached(lora_dev_t *dev, uint8_t reg, uint8_t *val, uint8_t len)
 {
-   uint8_t reg_val;
-   if (lora_read_reg(REG_MODEM_CONFIG_2, &reg_val) != LORA_OK)
+   uint8_t first = 0;
+   uint8_t last = len;
+
+   if (dev->shadow_valid)
    {
-      return LORA_FAIL;
+      while (first < last && dev->shadow[reg + first] == val[first])
+         first++;
+      while (last > first && dev->shadow[reg + last - 1] == val[last - 1])
+         last--;
+   }
+
+   /* The chip applies a new frequency on the FrfLsb write: a changed FRF goes out as the whole burst. */
+   if (first < last && reg <= REG_FRF_MSB && reg + len > REG_FRF_LSB && reg + first <= REG_FRF_LSB &&
+       reg + last > REG_FRF_MSB)
+   {
+      first = (reg + first < REG_FRF_MSB) ? first : REG_FRF_MSB - reg;
+      last = (reg + last > REG_FRF_LSB + 1) ? last : REG_FRF_LSB + 1 - reg;
    }
 
-   return lora_write_reg(REG_MODEM_CONFIG_2, reg_val | 0x04);
+   if (first == last)
+   {
+      return LORA_OK;
+   }
+   if (1 == last - first)
+   {
+      return lora_write_reg(dev, reg + first, val[first]);
+   }
+   return lora_write_reg_buffer(dev, reg + first, &val[first], last - first);
 }
 
-lora_status_t lora_disable_crc(void)
+lora_status_t lora_profile_image(const lora_radio_profile_t *profile, lora_profile_image_t *image)
 {
-   uint8_t reg_val;
-   if (lora_read_reg(REG_MODEM_CONFIG_2, &reg_val) != LORA_OK)
+   uint8_t sf = profile->spreading_factor;
+   uint8_t cr = profile->coding_rate;
+   uint8_t level = profile->tx_power;
+
+   if (profile->bandwidth >= 10)
    {
       return LORA_FAIL;
    }
 
-   return lora_write_reg(REG_MODEM_CONFIG_2, reg_val & 0xfb);
-}
+   if (sf < 6)
+      sf = 6;
+   else if (sf > 12)
+      sf = 12;
+
+   if (cr < 5)
+      cr = 5;
+   else if (cr > 8)
+      cr = 8;
+
+   if (level < 2)
+      level = 2;
+   else if (level > 17)
+      level = 17;
+
+   uint64_t frf = ((uint64_t)profile->frequency << 19) / 32000000;
+
+   image->frequency = profile->frequency;
+   image->rf[0] = (uint8_t)(frf >> 16);
+   image->rf[1] = (uint8_t)(frf >> 8);
+   image->rf[2] = (uint8_t)(frf >> 0);
+   image->rf[3] = PA_BOOST | (level - 2);
+   image->modem[0] = (profile->bandwidth << 4) | ((cr - 4) << 1);
+   image->modem[1] = (sf << 4) | (profile->crc ? 0x04 : 0x00);
+   image->modem[2] = 0;
+   image->modem[3] = (uint8_t)(profile->preamble_length >> 8);
+   image->modem[4] = (uint8_t)(profile->preamble_length >> 0);
+   image->modem_config_3 = lora_symbol_time_us(sf, profile->bandwidth) > LORA_LDRO_SYMBOL_US ? 0x08 : 0x00;
+   image->detection_optimize = 6 == sf ? 0xc5 : 0xc3;
+   image->detection_threshold = 6 == sf ? 0x0c : 0x0a;
+   image->sync_word = profile->sync_word;
+   image->rssi_offset = lora_rssi_offset(profile->frequency);
+
+   return LORA_OK;
+}
+
+static lora_status_t lora_apply_image_locked(lora_dev_t *dev, const lora_profile_image_t *image)
+{
+   lora_status_t ret = lora_shadow_load(dev);
+   uint8_t rf[sizeof(image->rf)];
+
+   if (LORA_OK != ret)
+   {
+      return ret;
+   }
+
+   /* Header mode, symbol timeout and TX continuous mode are not part of the profile. */
+   uint8_t modem[sizeof(image->modem)] = {
+       (dev->shadow[REG_MODEM_CONFIG_1] & 0x01) | image->modem[0],
+       (dev->shadow[REG_MODEM_CONFIG_2] & 0x0b) | image->modem[1],
+       dev->shadow[REG_SYMB_TIMEOUT_LSB],
+       image->modem[3],
+       image->modem[4],
+   };
+
+   /* The burst writes take a mutable buffer. */
+   memcpy(rf, image->rf, sizeof(rf));
+
+   ret = lora_write_range_cached(dev, REG_FRF_MSB, rf, sizeof(rf));
+   if (LORA_OK != ret)
+   {
+      return ret;
+   }
+   dev->frequency = image->frequency;
+   dev->rssi_offset = image->rssi_offset;
+
+   if ((ret = lora_write_range_cached(dev, REG_MODEM_CONFIG_1, modem, sizeof(modem))) != LORA_OK ||
+       (ret = lora_update_reg_cached(dev, REG_MODEM_CONFIG_3, 0x08, image->modem_config_3)) != LORA_OK ||
+       (ret = lora_write_reg_cached(dev, REG_DETECTION_OPTIMIZE, image->detection_optimize)) != LORA_OK ||
+       (ret = lora_write_reg_cached(dev, REG_DETECTION_THRESHOLD, image->detection_threshold)) != LORA_OK)
+   {
+      return ret;
+   }
+
+   return lora_write_reg_cached(dev, REG_SYNC_WORD, image->sync_word);
+}
+
+static lora_status_t lora_apply_profile_locked(lora_dev_t *dev, const lora_radio_profile_t *profile)
+{
+   lora_profile_image_t image;
+   lora_status_t ret = lora_profile_image(profile, &image);
+
+   if (LORA_OK != ret)
+   {
+      return ret;
+   }
+
+   return lora_apply_image_locked(dev, &image);
+}
+
+lora_status_t lora_apply_profile(lora_dev_t *dev, const lora_radio_profile_t *profile)
+{
+   LORA_LOCK(dev);
+   lora_status_t ret = lora_apply_profile_locked(dev, profile);
+   LORA_UNLOCK(dev);
+
+   return ret;
+}
+
+lora_status_t lora_apply_profile_image(lora_dev_t *dev, const lora_profile_image_t *image)
+{
+   LORA_LOCK(dev);
+   lora_status_t ret = lora_apply_image_locked(dev, image);
+   LORA_UNLOCK(dev);
+
+   return ret;
+}
+
+#if LORA_CONFIG_CHANNEL_PLAN
+lora_status_t lora_channel_plan_init(lora_channel_plan_t *plan, const long *frequencies, uint8_t n, uint32_t seed)
+{
+   if (0 == n || n > LORA_MAX_CHANNELS)
+   {
+      return LORA_FAIL;
+   }
+
+   plan->n_channels = n;
+   for (uint8_t i = 0; i < n; i++)
+   {
+      uint64_t frf = ((uint64_t)frequencies[i] << 19) / 32000000;
+
+      plan->frequency[i] = frequencies[i];
+      plan->frf[i][0] = (uint8_t)(frf >> 16);
+      plan->frf[i][1] = (uint8_t)(frf >> 8);
+      plan->frf[i][2] = (uint8_t)(frf >> 0);
+      plan->order[i] = i;
+   }
+
+   /* Fisher-Yates shuffle driven by xorshift32, so every platform derives the same order. */
+   for (uint8_t i = n - 1; seed && i > 0; i--)
+   {
+      seed ^= seed << 13;
+      seed ^= seed >> 17;
+      seed ^= seed << 5;
+
+      uint8_t j = (uint8_t)(seed % (i + 1u));
+      uint8_t tmp = plan->order[i];
+      plan->order[i] = plan->order[j];
+      plan->order[j] = tmp;
+   }
+
+   return LORA_OK;
+}
+
+lora_status_t lora_set_channel(lora_dev_t *dev, const lora_channel_plan_t *plan, uint8_t channel)
+{
+   lora_status_t ret;
+
+   if (channel >= plan->n_channels)
+   {
+      return LORA_FAIL;
+   }
+
+   LORA_LOCK(dev);
+   dev->frequency = plan->frequency[channel];
+   dev->rssi_offset = lora_rssi_offset(dev->frequency);
+   ret = lora_write_range_cached(dev, REG_FRF_MSB, (uint8_t *)plan->frf[channel], sizeof(plan->frf[channel]));
+   LORA_UNLOCK(dev);
+
+   return ret;
+}
+
+/*
+ * Stage the retune to a channel of a plan: the FRF bytes as one burst, left
+ * out when the radio is already there.
+ */
+static void lora_stage_channel(lora_dev_t *dev, const lora_channel_plan_t *plan, uint8_t channel)
+{
+   if (!dev->shadow_valid || 0 != memcmp(&dev->shadow[REG_FRF_MSB], plan->frf[channel], sizeof(plan->frf[channel])))
+   {
+      lora_stage(dev, REG_FRF_MSB, true, (uint8_t *)plan->frf[channel], sizeof(plan->frf[channel]));
+   }
+   dev->frequency = plan->frequency[channel];
+   dev->rssi_offset = lora_rssi_offset(dev->frequency);
+}
+#endif
+
+#if LORA_CONFIG_HOPPING
+lora_status_t lora_set_hopping(lora_dev_t *dev, const lora_channel_plan_t *plan, uint8_t hop_period)
+{
+   lora_status_t ret;
+
+   if (NULL == plan)
+   {
+      hop_period = 0;
+   }
+   else if (hop_period && !dev->dio1_irq)
+   {
+      return LORA_FAIL;
+   }
+
+   LORA_LOCK(dev);
+   dev->hop_plan = plan;
+   dev->hop_period = hop_period;
+   dev->hop_pos = 0;
+   ret = lora_write_reg_cached(dev, REG_HOP_PERIOD, hop_period);
+   LORA_UNLOCK(dev);
+
+   return ret;
+}
+
+/*
+ * Channel the next frame goes out on: the next one of the hop order, or the
+ * first one with FHSS.
+ */
+static uint8_t lora_hop_channel(const lora_dev_t *dev)
+{
+   return dev->hop_plan->order[dev->hop_period ? 0 : dev->hop_pos];
+}
+
+/*
+ * FhssChangeChannel: move on to the next channel of the order before the hop
+ * period of the current one runs out.
+ */
+static lora_status_t lora_hop_next(lora_dev_t *dev)
+{
+   const lora_channel_plan_t *plan = dev->hop_plan;
+
+   dev->hop_pos = (uint8_t)((dev->hop_pos + 1) % plan->n_channels);
+   lora_stage_channel(dev, plan, plan->order[dev->hop_pos]);
+   lora_stage_write(dev, REG_IRQ_FLAGS, IRQ_FHSS_CHANGE_CHANNEL_MASK);
+
+   return lora_flush(dev);
+}
+#endif
+
+#if LORA_CONFIG_SCAN
+/*
+ * Add one flush worth of RegRssiValue samples to the histogram of a channel.
+ */
+static void lora_scan_count(const lora_dev_t *dev, const lora_scan_t *scan, uint32_t *counts, const uint8_t *rssi, uint8_t n)
+{
+   for (uint8_t i = 0; i < n; i++)
+   {
+      int16_t level = (int16_t)rssi[i] - dev->rssi_offset - scan->floor_dbm;
+      uint8_t bucket = 0;
+
+      if (level > 0)
+      {
+         bucket = (level / scan->bucket_db >= scan->n_buckets) ? scan->n_buckets - 1 : level / scan->bucket_db;
+      }
+      counts[bucket]++;
+   }
+}
+
+lora_status_t lora_scan_sweep(lora_dev_t *dev, const lora_channel_plan_t *plan, lora_scan_t *scan)
+{
+   uint8_t rssi[LORA_SCAN_BATCH];
+   uint8_t wideband;
+   uint8_t home_frf[3];
+   lora_status_t ret = LORA_OK;
+
+   if (NULL == scan->counts || 0 == scan->n_buckets || 0 == scan->bucket_db || 0 == scan->samples)
+   {
+      return LORA_FAIL;
+   }
+
+   LORA_LOCK(dev);
+   lora_state_t state = dev->state;
+   if (LORA_STATE_SLEEP != state && LORA_STATE_STANDBY != state && LORA_STATE_RX != state)
+   {
+      LORA_UNLOCK(dev);
+      return LORA_FAIL;
+   }
+
+   ret = lora_shadow_load(dev);
+   if (LORA_OK != ret)
+   {
+      LORA_UNLOCK(dev);
+      return ret;
+   }
+
+   long frequency = dev->frequency;
+   int16_t rssi_offset = dev->rssi_offset;
+   memcpy(home_frf, &dev->shadow[REG_FRF_MSB], sizeof(home_frf));
+
+   for (uint8_t ch = 0; ch < plan->n_channels && LORA_OK == ret; ch++)
+   {
+      uint32_t *counts = &scan->counts[(size_t)ch * scan->n_buckets];
+      unsigned int left = scan->samples;
+
+      /* FRF is only applied outside RX: retune in standby, then let the PLL lock and the RSSI settle. */
+      lora_stage_write(dev, REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_STDBY);
+      lora_stage_channel(dev, plan, ch);
+      lora_stage_write(dev, REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_RX_CONTINUOUS);
+      ret = lora_flush(dev);
+      if (LORA_OK != ret)
+      {
+         break;
+      }
+      lora_set_state(dev, LORA_STATE_RX);
+
+      uint64_t settled_us = lora_time_us() + LORA_SCAN_SETTLE_US;
+      while (LORA_OK == ret && lora_time_us() < settled_us)
+      {
+         ret = lora_read_reg(dev, REG_RSSI_VALUE, &rssi[0]);
+      }
+
+      while (left > 0 && LORA_OK == ret)
+      {
+         uint8_t n = (left > LORA_SCAN_BATCH) ? LORA_SCAN_BATCH : (uint8_t)left;
+
+         for (uint8_t i = 0; i < n; i++)
+         {
+            lora_stage(dev, REG_RSSI_VALUE, false, &rssi[i], 1);
+         }
+         lora_stage(dev, REG_RSSI_WIDEBAND, false, &wideband, 1);
+         ret = lora_flush(dev);
+         if (LORA_OK != ret)
+         {
+            break;
+         }
+
+         /* The wideband reading is mostly noise in its low bits: stir it into the backoff PRNG. */
+         dev->prng = ((dev->prng << 3) | (dev->prng >> 29)) ^ wideband;
+
+         lora_scan_count(dev, scan, counts, rssi, n);
+         left -= n;
+      }
+   }
+
+   /* Back on the home channel; frames caught on the others are dropped with their flags. */
+   lora_stage_write(dev, REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_STDBY);
+   if (!dev->shadow_valid || 0 != memcmp(&dev->shadow[REG_FRF_MSB], home_frf, sizeof(home_frf)))
+   {
+      lora_stage(dev, REG_FRF_MSB, true, home_frf, sizeof(home_frf));
+   }
+   dev->frequency = frequency;
+   dev->rssi_offset = rssi_offset;
+   lora_stage_write(dev, REG_IRQ_FLAGS, IRQ_RX_DONE_MASK | IRQ_PAYLOAD_CRC_ERROR_MASK | IRQ_VALID_HEADER_MASK);
+   lora_stage_write(dev, REG_OP_MODE,
+                    MODE_LONG_RANGE_MODE |
+                       (LORA_STATE_RX == state ? MODE_RX_CONTINUOUS
+                                               : (LORA_STATE_SLEEP == state ? MODE_SLEEP : MODE_STDBY)));
+   ret += lora_flush(dev);
+   lora_set_state(dev, state);
+   if (!dev->fifo_split)
+   {
+      /* Frames received during the sweep may have overwritten a preloaded one. */
+      dev->tx_staged_dirty = true;
+   }
+
+   if (LORA_OK == ret)
+   {
+      scan->sweeps++;
+   }
+   LORA_UNLOCK(dev);
+
+   return ret;
+}
+
+lora_status_t lora_scan_quietest(const lora_scan_t *scan, uint8_t n_channels, uint8_t *channel)
+{
+   uint64_t best_sum = 0;
+   uint64_t best_total = 0;
+
+   for (uint8_t ch = 0; ch < n_channels; ch++)
+   {
+      const uint32_t *counts = &scan->counts[(size_t)ch * scan->n_buckets];
+      uint64_t sum = 0;
+      uint64_t total = 0;
+
+      for (uint8_t b = 0; b < scan->n_buckets; b++)
+      {
+         sum += (uint64_t)b * counts[b];
+         total += counts[b];
+      }
+
+      /* Compare the mean buckets sum / total without dividing. */
+      if (total > 0 && (0 == best_total || sum * best_total < best_sum * total))
+      {
+         best_sum = sum;
+         best_total = total;
+         *channel = ch;
+      }
+   }
+
+   return (best_total > 0) ? LORA_OK : LORA_FAIL;
+}
+#endif
+
+lora_status_t lora_snapshot(lora_dev_t *dev, lora_snapshot_t *snap)
+{
+   uint8_t *r = snap->regs;
+
+   /* One burst over 0x01..REG_VERSION; 0x00 is the FIFO and is not touched. */
+   r[REG_FIFO] = 0;
+   lora_status_t ret = lora_read_reg_buffer(dev, REG_OP_MODE, &r[REG_OP_MODE], REG_VERSION);
+   if (LORA_OK != ret)
+   {
+      return ret;
+   }
+
+   uint32_t frf = ((uint32_t)r[REG_FRF_MSB] << 16) | ((uint32_t)r[REG_FRF_MID] << 8) | r[REG_FRF_LSB];
+
+   snap->long_range_mode = r[REG_OP_MODE] & MODE_LONG_RANGE_MODE;
+   snap->mode = r[REG_OP_MODE] & 0x07;
+   /* Fstep = 32 MHz / 2^19 = 15625 / 256 Hz. */
+   snap->frequency = (long)(((uint64_t)frf * 15625) >> 8);
+   snap->pa_config = r[REG_PA_CONFIG];
+   snap->bandwidth = r[REG_MODEM_CONFIG_1] >> 4;
+   snap->coding_rate = ((r[REG_MODEM_CONFIG_1] >> 1) & 0x07) + 4;
+   snap->implicit_header = r[REG_MODEM_CONFIG_1] & 0x01;
+   snap->spreading_factor = r[REG_MODEM_CONFIG_2] >> 4;
+   snap->crc = r[REG_MODEM_CONFIG_2] & 0x04;
+   snap->symb_timeout = ((r[REG_MODEM_CONFIG_2] & 0x03) << 8) | r[REG_SYMB_TIMEOUT_LSB];
+   snap->preamble_length = (r[REG_PREAMBLE_MSB] << 8) | r[REG_PREAMBLE_LSB];
+   snap->payload_length = r[REG_PAYLOAD_LENGTH];
+   snap->low_data_rate = r[REG_MODEM_CONFIG_3] & 0x08;
+   snap->agc_auto = r[REG_MODEM_CONFIG_3] & 0x04;
+   snap->sync_word = r[REG_SYNC_WORD];
+   snap->irq_flags = r[REG_IRQ_FLAGS];
+   snap->dio_mapping[0] = r[REG_DIO_MAPPING_1];
+   snap->dio_mapping[1] = r[REG_DIO_MAPPING_2];
+   snap->version = r[REG_VERSION];
+
+   return LORA_OK;
+}
+
+lora_status_t lora_dump_registers(lora_dev_t *dev)
+{
+   lora_snapshot_t snap;
+   uint8_t i;
+
+   if (LORA_OK != lora_snapshot(dev, &snap))
+   {
+      return LORA_FAIL;
+   }
+
+   /* Printed after the burst so the output does not stretch the SPI access. */
+   printf("00 01 02 03 04 05 06 07 08 09 0A 0B 0C 0D 0E 0F\n");
+   printf("-- ");
+   for (i = 1; i < 0x40; i++)
+   {
+      printf("%02X ", snap.regs[i]);
+      if ((i & 0x0f) == 0x0f)
+         printf("\n");
+   }
+   printf("\n");
+
+   return LORA_OK;
+}
+
+/*
+ * Configuration registers restored from the shadow copy after a reset, as
+ * {first, count} runs so each goes out as one burst.
+ */
+static const uint8_t __replay_ranges[][2] = {
+    {REG_FRF_MSB, REG_FIFO_RX_BASE_ADDR - REG_FRF_MSB + 1},
+    {REG_IRQ_FLAGS_MASK, 1},
+    {REG_MODEM_CONFIG_1, REG_PAYLOAD_LENGTH - REG_MODEM_CONFIG_1 + 1},
+    {REG_HOP_PERIOD, 1},
+    {REG_MODEM_CONFIG_3, 1},
+    {REG_DETECTION_OPTIMIZE, 1},
+    {REG_DETECTION_THRESHOLD, 1},
+    {REG_SYNC_WORD, 1},
+    {REG_DIO_MAPPING_1, 2},
+};
+
+/*
+ * Attach the DIO interrupts, on which the event-driven paths depend.
+ */
+static void lora_attach_irqs(lora_dev_t *dev)
+{
+   dev->dio0_irq = (API_OK == lora_dio_attach_isr(&dev->io, 0, lora_dio0_isr, dev));
+   /* DIO1 only carries RxTimeout and FhssChangeChannel, which need no timestamp. */
+   dev->dio1_irq = dev->dio0_irq && (API_OK == lora_dio_attach_isr(&dev->io, 1, lora_dio1_isr, dev));
+}
+
+/*
+ * Wait for the radio to answer and write the driver defaults over its
+ * power-on configuration.
+ */
+static lora_status_t lora_init_cold(lora_dev_t *dev)
+{
+   lora_status_t ret;
+   uint8_t version;
+   uint8_t i = 0;
+   while (i++ < TIMEOUT_RESET)
+   {
+      lora_read_reg(dev, REG_VERSION, &version);
+      if (0x12 == version)
+         break;
+      lora_delay(LORA_DELAY_20MS);
+   }
+
+   if (TIMEOUT_RESET + 1 == i)
+      return LORA_FAILED_INIT;
+
+   LORA_LOCK(dev);
+   ret = lora_sleep_mode(dev);
+   ret += lora_cache_resync(dev);
+   ret += lora_write_reg(dev, REG_FIFO_RX_BASE_ADDR, 0);
+   ret += lora_write_reg(dev, REG_FIFO_TX_BASE_ADDR, 0);
+   ret += lora_write_reg(dev, REG_LNA, dev->shadow[REG_LNA] | 0x03);
+   ret += lora_write_reg(dev, REG_MODEM_CONFIG_3, 0x04);
+
+   ret += lora_idle_mode(dev);
+
+   lora_attach_irqs(dev);
+   LORA_UNLOCK(dev);
+
+   return ret;
+}
+
+lora_status_t lora_driver_init(lora_dev_t *dev)
+{
+   if (API_OK != lora_platform_init(&dev->io) || API_OK != dev->io.ops->init(&dev->io))
+   {
+      return LORA_FAILED_INIT;
+   }
+
+   return lora_init_cold(dev);
+}
+
+#if LORA_CONFIG_WARM
+/*
+ * FNV-1a over the configuration kept across deep sleep, so a zeroed or stale
+ * RTC block is never mistaken for a saved state.
+ */
+static uint32_t lora_warm_signature(const lora_warm_state_t *state)
+{
+   uint32_t hash = 2166136261u;
+
+   for (uint8_t i = 0; i < sizeof(__replay_ranges) / sizeof(__replay_ranges[0]); i++)
+   {
+      for (uint8_t j = 0; j < __replay_ranges[i][1]; j++)
+      {
+         hash = (hash ^ state->regs[__replay_ranges[i][0] + j]) * 16777619u;
+      }
+   }
+   for (uint8_t i = 0; i < sizeof(state->frequency); i++)
+   {
+      hash = (hash ^ (uint8_t)((unsigned long)state->frequency >> (8 * i))) * 16777619u;
+   }
+   hash = (hash ^ state->fifo_split) * 16777619u;
+
+   return hash;
+}
+
+lora_status_t lora_warm_save(lora_dev_t *dev, lora_warm_state_t *state)
+{
+   lora_status_t ret;
+
+   LORA_LOCK(dev);
+   ret = lora_sleep_mode(dev);
+   if (LORA_OK == ret && dev->shadow_valid)
+   {
+      memcpy(state->regs, dev->shadow, sizeof(state->regs));
+      state->frequency = dev->frequency;
+      state->fifo_split = dev->fifo_split;
+      state->signature = lora_warm_signature(state);
+   }
+   else
+   {
+      state->signature = 0;
+      ret = LORA_FAIL;
+   }
+   LORA_UNLOCK(dev);
+
+   return ret;
+}
+
+lora_status_t lora_driver_init_warm(lora_dev_t *dev, const lora_warm_state_t *state)
+{
+   uint8_t image[REG_VERSION + 1];
+   lora_status_t ret;
+
+   if (API_OK != lora_platform_init(&dev->io) || API_OK != dev->io.ops->init(&dev->io))
+   {
+      return LORA_FAILED_INIT;
+   }
+   if (NULL == state || lora_warm_signature(state) != state->signature)
+   {
+      return lora_init_cold(dev);
+   }
+
+   LORA_LOCK(dev);
+   /* One burst read shows whether the radio is up and what it still holds. */
+   ret = lora_cache_resync(dev);
+   if (LORA_OK != ret || 0x12 != dev->shadow[REG_VERSION])
+   {
+      LORA_UNLOCK(dev);
+      return lora_init_cold(dev);
+   }
+
+   if (!(dev->shadow[REG_OP_MODE] & MODE_LONG_RANGE_MODE))
+   {
+      /* The radio lost power: switch it back to LoRa and read the LoRa page. */
+      ret = lora_write_reg(dev, REG_OP_MODE, MODE_SLEEP);
+      ret += lora_sleep_mode(dev);
+      ret += lora_cache_resync(dev);
+   }
+   else if (MODE_SLEEP != (dev->shadow[REG_OP_MODE] & 0x07))
+   {
+      ret = lora_sleep_mode(dev);
+   }
+   lora_set_state(dev, LORA_STATE_SLEEP);
+
+   memcpy(image, state->regs, sizeof(image));
+   /* The FIFO pointer moves with every FIFO access and is set before each use. */
+   image[REG_FIFO_ADDR_PTR] = dev->shadow[REG_FIFO_ADDR_PTR];
+   for (uint8_t i = 0; i < sizeof(__replay_ranges) / sizeof(__replay_ranges[0]); i++)
+   {
+      uint8_t reg = __replay_ranges[i][0];
+      ret += lora_write_range_cached(dev, reg, &image[reg], __replay_ranges[i][1]);
+   }
+
+   dev->frequency = state->frequency;
+   dev->rssi_offset = lora_rssi_offset(state->frequency);
+   dev->implicit = image[REG_MODEM_CONFIG_1] & 0x01;
+   dev->fifo_split = state->fifo_split;
+
+   ret += lora_idle_mode(dev);
+
+   lora_attach_irqs(dev);
+   LORA_UNLOCK(dev);
+
+   return ret;
+}
+#endif
+
+/*
+ * Account the end of a transmission that started at tx_start_us.
+ */
+static void lora_stats_tx_done(lora_dev_t *dev, lora_status_t status, uint64_t timestamp_us)
+{
+   if (LORA_OK == status)
+   {
+      lora_stats_add(dev, &dev->stats.tx_frames, 1);
+      LORA_STATS_HIST(dev, tx_airtime_hist, timestamp_us - dev->tx_start_us);
+      if (dev->dio0_irq)
+      {
+         LORA_STATS_HIST(dev, tx_done_latency_hist, lora_time_us() - timestamp_us);
+      }
+   }
+   else if (LORA_TX_TIMEOUT == status)
+   {
+      lora_stats_add(dev, &dev->stats.tx_timeouts, 1);
+   }
+}
+
+static lora_status_t lora_wait_tx_done(lora_dev_t *dev, uint64_t deadline_us)
+{
+   uint8_t irq = 0;
+   uint64_t start_us = lora_time_us();
+   uint64_t now;
+
+   while ((now = lora_time_us()) < deadline_us)
+   {
+      uint32_t left_ms = (uint32_t)((deadline_us - now + 999) / 1000);
+
+      if (dev->dio0_irq)
+      {
+         if (API_OK != lora_event_wait(&dev->io, left_ms))
+         {
+            break;
+         }
+      }
+      else
+      {
+         lora_delay(left_ms < LORA_DELAY_10MS ? left_ms : LORA_DELAY_10MS);
+      }
+
+      if (LORA_OK != lora_read_reg(dev, REG_IRQ_FLAGS, &irq))
+      {
+         continue;
+      }
+      if ((irq & IRQ_TX_DONE_MASK) == IRQ_TX_DONE_MASK)
+      {
+         dev->tx_done_us = lora_event_time(dev);
+         LORA_TRACE_DEBUG(LORA_TRACE_TX_DONE, (dev->tx_done_us - start_us) / 1000);
+         return LORA_OK;
+      }
+#if LORA_CONFIG_HOPPING
+      if (dev->hop_period && (irq & IRQ_FHSS_CHANGE_CHANNEL_MASK))
+      {
+         LORA_LOCK(dev);
+         lora_hop_next(dev);
+         LORA_UNLOCK(dev);
+      }
+#endif
+   }
+
+   return LORA_TX_TIMEOUT;
+}
+
+/*
+ * Total length of a scatter/gather list, or -1 when it exceeds the FIFO.
+ */
+static int lora_iov_size(const struct iovec *iov, uint8_t iovcnt)
+{
+   size_t size = 0;
+
+   for (uint8_t i = 0; i < iovcnt; i++)
+   {
+      size += iov[i].iov_len;
+   }
+
+   return (size > LORA_MAX_PAYLOAD) ? -1 : (int)size;
+}
+
+/*
+ * Latest time TxDone can be expected for a frame of the given size that is
+ * started now.
+ */
+static uint64_t lora_tx_deadline(lora_dev_t *dev, uint8_t size)
+{
+   uint32_t airtime = lora_time_on_air_us(dev, size);
+
+   return lora_time_us() + airtime + airtime / 16 + TIMEOUT_TX_MARGIN_US;
+}
+
+/*
+ * Recover a radio that stopped responding: pulse its reset line and write the
+ * configuration back from the shadow copy. The radio is left asleep.
+ */
+static lora_status_t lora_recover(lora_dev_t *dev)
+{
+   uint8_t image[REG_VERSION + 1];
+   lora_status_t ret;
+
+   /* Set first, so the next operation wakes the radio up even when the reset fails. */
+   lora_set_state(dev, LORA_STATE_SLEEP);
+   dev->tx_done_pending = false;
+   if (API_OK != lora_reset(&dev->io))
+   {
+      return LORA_FAILED_INIT;
+   }
+   if (!dev->shadow_valid)
+   {
+      /* Nothing trustworthy to replay; fall back to the power-on values. */
+      ret = lora_cache_resync(dev);
+      ret += lora_sleep_mode(dev);
+      return ret;
+   }
+
+   /* LongRangeMode can only be set while the modem is asleep. */
+   memcpy(image, dev->shadow, sizeof(image));
+   lora_stage_write(dev, REG_OP_MODE, MODE_SLEEP);
+   lora_stage_write(dev, REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_SLEEP);
+   for (uint8_t i = 0; i < sizeof(__replay_ranges) / sizeof(__replay_ranges[0]); i++)
+   {
+      uint8_t reg = __replay_ranges[i][0];
+      lora_stage(dev, reg, true, &image[reg], __replay_ranges[i][1]);
+   }
+
+   ret = lora_flush(dev);
+   if (LORA_OK != ret)
+   {
+      lora_cache_resync(dev);
+   }
+   return ret;
+}
+
+/*
+ * Stage the channel of the frame when hopping, the DIO mappings when needed
+ * and the switch to MODE_TX.
+ */
+static void lora_stage_tx_trigger(lora_dev_t *dev)
+{
+   uint8_t mapping = dev->shadow[REG_DIO_MAPPING_1];
+
+#if LORA_CONFIG_HOPPING
+   const lora_channel_plan_t *plan = dev->hop_plan;
+   if (NULL != plan)
+   {
+      lora_stage_channel(dev, plan, lora_hop_channel(dev));
+      if (dev->hop_period)
+      {
+         /* A hop flag left over from the previous frame would keep DIO1 from rising. */
+         lora_stage_write(dev, REG_IRQ_FLAGS, IRQ_FHSS_CHANGE_CHANNEL_MASK);
+         mapping = (mapping & 0xcf) | (DIO1_FHSS_CHANGE_CHANNEL << 4);
+         dev->hop_pos = 0;
+      }
+      else
+      {
+         dev->hop_pos = (uint8_t)((dev->hop_pos + 1) % plan->n_channels);
+      }
+   }
+#endif
+
+   if (dev->dio0_irq)
+   {
+      mapping = (mapping & 0x3f) | (DIO0_TX_DONE << 6);
+   }
+   if (!dev->shadow_valid || mapping != dev->shadow[REG_DIO_MAPPING_1])
+   {
+      lora_stage_write(dev, REG_DIO_MAPPING_1, mapping);
+   }
+
+   lora_stage_write(dev, REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_TX);
+}
+
+/*
+ * Stage the switch to standby before a frame is loaded. Between the frames of
+ * a batch the radio is already there and only the previous TxDone is cleared.
+ */
+static void lora_stage_tx_standby(lora_dev_t *dev)
+{
+   if (!dev->tx_done_pending || LORA_STATE_STANDBY != dev->state)
+   {
+      lora_stage_write(dev, REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_STDBY);
+   }
+   if (dev->tx_done_pending)
+   {
+      lora_stage_write(dev, REG_IRQ_FLAGS, IRQ_TX_DONE_MASK);
+      dev->tx_done_pending = false;
+   }
+}
+
+static lora_status_t lora_start_tx(lora_dev_t *dev, const struct iovec *iov, uint8_t iovcnt)
+{
+   int size = lora_iov_size(iov, iovcnt);
+
+   if (size < 0)
+   {
+      return LORA_FAILED_SEND_PACKET;
+   }
+
+   lora_status_t ret = lora_shadow_load(dev);
+   if (LORA_OK != ret)
+   {
+      return ret;
+   }
+
+   if (dev->dio0_irq)
+   {
+      /* Drop a signal left over from a previous RxDone so it is not taken for TxDone. */
+      lora_event_wait(&dev->io, 0);
+   }
+
+   LORA_TRACE_INFO(LORA_TRACE_TX_START, size);
+   lora_fifo_claim(dev, dev->fifo_split, size);
+   dev->tx_fifo_base = dev->fifo_split;
+   dev->tx_fifo_len = (uint8_t)size;
+
+   /* Standby, FIFO load, length, DIO0 mapping and TX go out as one staged sequence. */
+   lora_stage_tx_standby(dev);
+   if (!dev->shadow_valid || dev->fifo_split != dev->shadow[REG_FIFO_TX_BASE_ADDR])
+   {
+      lora_stage_write(dev, REG_FIFO_TX_BASE_ADDR, dev->fifo_split);
+   }
+   lora_stage_write(dev, REG_FIFO_ADDR_PTR, dev->fifo_split);
+   /* The FIFO pointer auto-increments, so each segment is gathered straight in. */
+   for (uint8_t i = 0; i < iovcnt; i++)
+   {
+      if (iov[i].iov_len > 0)
+      {
+         lora_stage(dev, REG_FIFO, true, iov[i].iov_base, (uint8_t)iov[i].iov_len);
+      }
+   }
+   lora_stage_write(dev, REG_PAYLOAD_LENGTH, (uint8_t)size);
+   lora_stage_tx_trigger(dev);
+
+   ret = lora_flush(dev);
+   dev->tx_start_us = lora_time_us();
+   return ret;
+}
+
+/*
+ * Second half of a blocking send: wait for TxDone without the lock, then put
+ * the radio to sleep, or in standby when a preloaded frame has to survive.
+ * With standby set the radio is left where TxDone put it, for the next frame
+ * of a batch, and TxDone is cleared by that frame's staged sequence.
+ */
+static lora_status_t lora_finish_tx(lora_dev_t *dev, uint8_t size, bool standby)
+{
+   lora_status_t ret;
+
+   LORA_LOCK(dev);
+   lora_set_state(dev, LORA_STATE_TX);
+   dev->tx_from_queue = false;
+   uint64_t deadline_us = lora_tx_deadline(dev, size);
+   LORA_UNLOCK(dev);
+
+   /* The lock is not held while the packet is on air. */
+   if (LORA_OK != lora_wait_tx_done(dev, deadline_us))
+   {
+      atomic_fetch_add_explicit(&dev->send_packet_lost, 1, memory_order_relaxed);
+      LORA_TRACE_WARN(LORA_TRACE_TX_TIMEOUT, 0);
+
+      LORA_LOCK(dev);
+      lora_stats_tx_done(dev, LORA_TX_TIMEOUT, 0);
+      lora_recover(dev);
+      LORA_UNLOCK(dev);
+      return LORA_TX_TIMEOUT;
+   }
+
+   LORA_LOCK(dev);
+   lora_stats_tx_done(dev, LORA_OK, dev->tx_done_us);
+   if (standby)
+   {
+      lora_set_state(dev, LORA_STATE_STANDBY);
+      dev->tx_done_pending = true;
+      LORA_UNLOCK(dev);
+      return LORA_OK;
+   }
+   if (dev->tx_staged)
+   {
+      lora_idle_mode(dev);
+   }
+   else
+   {
+      lora_sleep_mode(dev);
+   }
+   ret = lora_write_reg(dev, REG_IRQ_FLAGS, IRQ_TX_DONE_MASK);
+   LORA_UNLOCK(dev);
+
+   return ret;
+}
+
+lora_status_t lora_send_packet_iov(lora_dev_t *dev, const struct iovec *iov, uint8_t iovcnt)
+{
+   lora_status_t ret;
+
+   LORA_LOCK(dev);
+   ret = lora_start_tx(dev, iov, iovcnt);
+   LORA_UNLOCK(dev);
+
+   if (LORA_OK != ret)
+   {
+      LORA_TRACE_ERROR(LORA_TRACE_TX_FAIL, ret);
+      return LORA_FAILED_SEND_PACKET;
+   }
+
+   return lora_finish_tx(dev, (uint8_t)lora_iov_size(iov, iovcnt), false);
+}
+
+lora_status_t lora_set_fifo_split(lora_dev_t *dev, uint8_t tx_base)
+{
+   lora_status_t ret;
+
+   LORA_LOCK(dev);
+   ret = lora_write_reg_cached(dev, REG_FIFO_RX_BASE_ADDR, 0);
+   ret += lora_write_reg_cached(dev, REG_FIFO_TX_BASE_ADDR, tx_base);
+   dev->fifo_split = tx_base;
+   dev->tx_staged = false;
+   LORA_UNLOCK(dev);
+
+   return ret;
+}
+
+/*
+ * Write the preloaded frame into the FIFO.
+ */
+static void lora_stage_tx_load(lora_dev_t *dev)
+{
+   lora_stage_write(dev, REG_FIFO_ADDR_PTR, dev->tx_staged_base);
+   if (dev->tx_staged_len > 0)
+   {
+      lora_stage(dev, REG_FIFO, true, dev->tx_staged_buf, dev->tx_staged_len);
+   }
+   if (!dev->implicit)
+   {
+      /* Only implicit header mode uses PayloadLength while receiving. */
+      lora_stage_write(dev, REG_PAYLOAD_LENGTH, dev->tx_staged_len);
+   }
+   dev->tx_staged_dirty = false;
+}
+
+lora_status_t lora_stage_tx(lora_dev_t *dev, uint8_t *buf, uint8_t size)
+{
+   LORA_LOCK(dev);
+   unsigned int split = dev->fifo_split;
+   unsigned int base = split;
+
+   if (0 == split || size > 256 - split)
+   {
+      LORA_UNLOCK(dev);
+      return LORA_FAILED_SEND_PACKET;
+   }
+
+   if (LORA_STATE_TX == dev->state)
+   {
+      /* Do not touch the frame on air: go after it, or before it if it does not fit. */
+      base = dev->tx_fifo_base + dev->tx_fifo_len;
+      if (base + size > 256)
+      {
+         base = split;
+         if (base + size > dev->tx_fifo_base)
+         {
+            LORA_UNLOCK(dev);
+            return LORA_QUEUE_FULL;
+         }
+      }
+   }
+
+   dev->tx_staged = true;
+   dev->tx_staged_buf = buf;
+   dev->tx_staged_base = (uint8_t)base;
+   dev->tx_staged_len = size;
+
+   lora_status_t ret = LORA_OK;
+   if (LORA_STATE_SLEEP != dev->state)
+   {
+      lora_stage_tx_load(dev);
+      ret = lora_flush(dev);
+   }
+   else
+   {
+      dev->tx_staged_dirty = true;
+   }
+   LORA_UNLOCK(dev);
+
+   return ret;
+}
+
+lora_status_t lora_send_staged(lora_dev_t *dev)
+{
+   lora_status_t ret;
+
+   LORA_LOCK(dev);
+   if (!dev->tx_staged || LORA_STATE_TX == dev->state)
+   {
+      LORA_UNLOCK(dev);
+      return LORA_FAILED_SEND_PACKET;
+   }
+
+   ret = lora_shadow_load(dev);
+   if (LORA_OK != ret)
+   {
+      LORA_UNLOCK(dev);
+      return ret;
+   }
+
+   if (dev->dio0_irq)
+   {
+      lora_event_wait(&dev->io, 0);
+   }
+
+   if (LORA_STATE_SLEEP == dev->state)
+   {
+      lora_stage_write(dev, REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_STDBY);
+   }
+   if (dev->tx_done_pending)
+   {
+      lora_stage_write(dev, REG_IRQ_FLAGS, IRQ_TX_DONE_MASK);
+      dev->tx_done_pending = false;
+   }
+   if (dev->tx_staged_dirty)
+   {
+      lora_stage_tx_load(dev);
+   }
+   if (!dev->shadow_valid || dev->tx_staged_base != dev->shadow[REG_FIFO_TX_BASE_ADDR])
+   {
+      lora_stage_write(dev, REG_FIFO_TX_BASE_ADDR, dev->tx_staged_base);
+   }
+   if (!dev->shadow_valid || dev->tx_staged_len != dev->shadow[REG_PAYLOAD_LENGTH])
+   {
+      lora_stage_write(dev, REG_PAYLOAD_LENGTH, dev->tx_staged_len);
+   }
+   /* In the common case only REG_OP_MODE is written here. */
+   lora_stage_tx_trigger(dev);
+
+   dev->tx_staged = false;
+   dev->tx_fifo_base = dev->tx_staged_base;
+   dev->tx_fifo_len = dev->tx_staged_len;
+   ret = lora_flush(dev);
+   dev->tx_start_us = lora_time_us();
+   LORA_UNLOCK(dev);
+
+   if (LORA_OK != ret)
+   {
+      return LORA_FAILED_SEND_PACKET;
+   }
+
+   return lora_finish_tx(dev, dev->tx_fifo_len, false);
+}
+
+lora_status_t lora_send_packet(lora_dev_t *dev, uint8_t *buf, uint8_t size)
+{
+   struct iovec iov = {.iov_base = buf, .iov_len = size};
+
+   return lora_send_packet_iov(dev, &iov, 1);
+}
+
+#if LORA_CONFIG_BATCH
+lora_status_t lora_send_batch(lora_dev_t *dev, const struct iovec *frames, uint8_t n, uint8_t *sent)
+{
+   lora_status_t ret = LORA_OK;
+   uint8_t done = 0;
+
+   while (done < n)
+   {
+      LORA_LOCK(dev);
+      ret = lora_start_tx(dev, &frames[done], 1);
+      LORA_UNLOCK(dev);
+
+      if (LORA_OK != ret)
+      {
+         LORA_TRACE_ERROR(LORA_TRACE_TX_FAIL, ret);
+         ret = LORA_FAILED_SEND_PACKET;
+         break;
+      }
+
+      ret = lora_finish_tx(dev, (uint8_t)frames[done].iov_len, done + 1 < n);
+      if (LORA_OK != ret)
+      {
+         break;
+      }
+      done++;
+   }
+
+   LORA_LOCK(dev);
+   if (dev->tx_done_pending)
+   {
+      /* The batch stopped early: finish it as the last frame would have. */
+      dev->tx_done_pending = false;
+      ret += lora_sleep_mode(dev);
+      ret += lora_write_reg(dev, REG_IRQ_FLAGS, IRQ_TX_DONE_MASK);
+   }
+   LORA_UNLOCK(dev);
+
+   if (NULL != sent)
+   {
+      *sent = done;
+   }
+   return ret;
+}
+#endif
+
+#if LORA_CONFIG_LBT || LORA_CONFIG_ACK
+/*
+ * xorshift32, good enough to spread backoff times between nodes.
+ */
+static uint32_t lora_random(lora_dev_t *dev)
+{
+   uint32_t x = dev->prng;
+
+   if (0 == x)
+   {
+      x = (uint32_t)lora_time_us() ^ (uint32_t)(uintptr_t)dev ^ 0x9e3779b9u;
+   }
+   x ^= x << 13;
+   x ^= x >> 17;
+   x ^= x << 5;
+   dev->prng = x;
+
+   return x;
+}
+#endif
+
+#if LORA_CONFIG_LBT
+lora_status_t lora_cad(lora_dev_t *dev, bool *busy)
+{
+   uint8_t irq = 0;
+
+   LORA_LOCK(dev);
+   lora_status_t ret = lora_shadow_load(dev);
+   if (LORA_OK != ret)
+   {
+      LORA_UNLOCK(dev);
+      return ret;
+   }
+
+   if (dev->dio0_irq)
+   {
+      lora_event_wait(&dev->io, 0);
+   }
+
+   uint64_t deadline_us = lora_time_us() + TIMEOUT_CAD_MARGIN_US +
+                          (uint64_t)TIMEOUT_CAD_SYMBOLS * lora_symbol_time_us(dev->shadow[REG_MODEM_CONFIG_2] >> 4,
+                                                                              dev->shadow[REG_MODEM_CONFIG_1] >> 4);
+
+   lora_stage_write(dev, REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_STDBY);
+   lora_stage_write(dev, REG_IRQ_FLAGS, IRQ_CAD_DONE_MASK | IRQ_CAD_DETECTED_MASK);
+   if (dev->dio0_irq)
+   {
+      uint8_t mapping = (dev->shadow[REG_DIO_MAPPING_1] & 0x3f) | (DIO0_CAD_DONE << 6);
+      if (!dev->shadow_valid || mapping != dev->shadow[REG_DIO_MAPPING_1])
+      {
+         lora_stage_write(dev, REG_DIO_MAPPING_1, mapping);
+      }
+   }
+   lora_stage_write(dev, REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_CAD);
+   ret = lora_flush(dev);
+   if (LORA_OK == ret)
+   {
+      lora_set_state(dev, LORA_STATE_CAD);
+      dev->cad_count++;
+   }
+   LORA_UNLOCK(dev);
+
+   if (LORA_OK != ret)
+   {
+      return ret;
+   }
+
+   /* The lock is not held while the detection runs. */
+   ret = LORA_FAIL;
+   uint64_t now;
+   while ((now = lora_time_us()) < deadline_us)
+   {
+      uint32_t left_ms = (uint32_t)((deadline_us - now + 999) / 1000);
+
+      if (dev->dio0_irq)
+      {
+         if (API_OK != lora_event_wait(&dev->io, left_ms))
+         {
+            break;
+         }
+      }
+      else
+      {
+         lora_delay(1);
+      }
+
+      if (LORA_OK == lora_read_reg(dev, REG_IRQ_FLAGS, &irq) && (irq & IRQ_CAD_DONE_MASK))
+      {
+         *busy = irq & IRQ_CAD_DETECTED_MASK;
+         LORA_TRACE_DEBUG(LORA_TRACE_CAD_DONE, *busy);
+         ret = LORA_OK;
+         break;
+      }
+   }
+
+   LORA_LOCK(dev);
+   lora_stage_write(dev, REG_IRQ_FLAGS, IRQ_CAD_DONE_MASK | IRQ_CAD_DETECTED_MASK);
+   lora_stage_write(dev, REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_STDBY);
+   lora_status_t clear = lora_flush(dev);
+   lora_set_state(dev, LORA_STATE_STANDBY);
+   if (LORA_OK == ret && *busy)
+   {
+      dev->cad_detected++;
+   }
+   LORA_UNLOCK(dev);
+
+   if (LORA_OK == ret)
+   {
+      ret = clear;
+   }
+
+   return ret;
+}
+
+lora_status_t lora_send_packet_lbt(lora_dev_t *dev, uint8_t *buf, uint8_t size, uint8_t max_attempts)
+{
+   uint32_t window_us = lora_time_on_air_us(dev, size);
+
+   for (uint8_t attempt = 0; attempt < max_attempts; attempt++)
+   {
+      bool busy = true;
+      lora_status_t ret = lora_cad(dev, &busy);
+
+      if (LORA_OK != ret)
+      {
+         return ret;
+      }
+      if (!busy)
+      {
+         return lora_send_packet(dev, buf, size);
+      }
+
+      lora_delay(1 + lora_random(dev) % (window_us / 1000 + 1));
+      if (window_us < UINT32_MAX / 2)
+      {
+         window_us *= 2;
+      }
+   }
+
+   return LORA_CHANNEL_BUSY;
+}
+#endif
+
+#if LORA_CONFIG_ACK || LORA_CONFIG_RX_RING
+/*
+ * FHSS in use: the receiver is restarted after every frame anyway.
+ */
+static bool lora_fhss(const lora_dev_t *dev)
+{
+#if LORA_CONFIG_HOPPING
+   return dev->hop_period > 0;
+#else
+   (void)dev;
+   return false;
+#endif
+}
+#endif
+
+static lora_status_t lora_tx_enqueue(lora_dev_t *dev, const struct iovec *iov, uint8_t iovcnt,
+                                     const lora_confirm_t *confirm, lora_tx_cb_t cb, void *ctx)
+{
+   if (iovcnt > LORA_TX_IOV_MAX || lora_iov_size(iov, iovcnt) < 0)
+   {
+      return LORA_FAILED_SEND_PACKET;
+   }
+
+   /* Serializes producers; the service task only moves the tail. */
+   LORA_LOCK(dev);
+   unsigned int head = atomic_load_explicit(&dev->tx_head, memory_order_relaxed);
+   unsigned int tail = atomic_load_explicit(&dev->tx_tail, memory_order_acquire);
+
+   if (head - tail >= LORA_TX_QUEUE_LEN)
+   {
+      LORA_UNLOCK(dev);
+      return LORA_QUEUE_FULL;
+   }
+
+   lora_tx_frame_t *frame = &dev->tx_queue[head % LORA_TX_QUEUE_LEN];
+   memcpy(frame->iov, iov, iovcnt * sizeof(*iov));
+   frame->iovcnt = iovcnt;
+#if LORA_CONFIG_ACK
+   frame->confirm = confirm;
+#else
+   (void)confirm;
+#endif
+   frame->cb = cb;
+   frame->ctx = ctx;
+
+   atomic_store_explicit(&dev->tx_head, head + 1, memory_order_release);
+   LORA_UNLOCK(dev);
+
+   /* Wake up lora_service() so an idle radio starts sending right away. */
+   lora_event_signal(&dev->io);
+   return LORA_OK;
+}
+
+lora_status_t lora_send_packet_iov_async(lora_dev_t *dev, const struct iovec *iov, uint8_t iovcnt,
+                                         lora_tx_cb_t cb, void *ctx)
+{
+   return lora_tx_enqueue(dev, iov, iovcnt, NULL, cb, ctx);
+}
+
+#if LORA_CONFIG_ACK
+lora_status_t lora_send_confirmed_async(lora_dev_t *dev, const struct iovec *iov, uint8_t iovcnt,
+                                        const lora_confirm_t *confirm, lora_tx_cb_t cb, void *ctx)
+{
+   /* With FHSS, DIO1 is taken by FhssChangeChannel and the reply would hop. */
+   if (confirm->ack_len > LORA_ACK_MAX_LEN || lora_fhss(dev))
+   {
+      return LORA_FAIL;
+   }
+
+   return lora_tx_enqueue(dev, iov, iovcnt, confirm, cb, ctx);
+}
+#endif
+
+lora_status_t lora_send_packet_async(lora_dev_t *dev, uint8_t *buf, uint8_t size, lora_tx_cb_t cb, void *ctx)
+{
+   struct iovec iov = {.iov_base = buf, .iov_len = size};
+
+   return lora_send_packet_iov_async(dev, &iov, 1, cb, ctx);
+}
+
+static void lora_tx_complete(lora_dev_t *dev, lora_status_t status, uint64_t timestamp_us)
+{
+   unsigned int tail = atomic_load_explicit(&dev->tx_tail, memory_order_relaxed);
+   lora_tx_frame_t frame = dev->tx_queue[tail % LORA_TX_QUEUE_LEN];
+
+   atomic_store_explicit(&dev->tx_tail, tail + 1, memory_order_release);
+   if (LORA_STATE_SLEEP != dev->state)
+   {
+      /* TxDone and the end of an ACK window leave the radio in standby, lora_recover() leaves it asleep. */
+      lora_set_state(dev, LORA_STATE_STANDBY);
+   }
+#if LORA_CONFIG_ACK
+   dev->ack_attempts = 0;
+   dev->ack_wait = false;
+   dev->ack_retry_us = 0;
+#endif
+
+   if (LORA_TX_TIMEOUT == status)
+   {
+      atomic_fetch_add_explicit(&dev->send_packet_lost, 1, memory_order_relaxed);
+      LORA_TRACE_WARN(LORA_TRACE_TX_TIMEOUT, 0);
+   }
+   else if (LORA_OK != status)
+   {
+      LORA_TRACE_ERROR(LORA_TRACE_TX_FAIL, status);
+   }
+
+   if (LORA_OK == status)
+   {
+      dev->tx_done_us = timestamp_us;
+   }
+#if LORA_CONFIG_ACK
+   /* Every attempt of a confirmed send is counted at its own TxDone. */
+   if (LORA_OK != status || NULL == frame.confirm)
+#endif
+   {
+      lora_stats_tx_done(dev, status, timestamp_us);
+   }
+
+   if (frame.cb)
+   {
+      frame.cb(status, timestamp_us, frame.ctx);
+   }
+}
+
+/*
+ * Frequency the next queued frame goes out on, whose sub-band pays its
+ * duty cycle.
+ */
+static long lora_tx_frequency(const lora_dev_t *dev)
+{
+#if LORA_CONFIG_HOPPING
+   if (dev->hop_plan)
+   {
+      return dev->hop_plan->frequency[lora_hop_channel(dev)];
+   }
+#endif
+   return dev->frequency;
+}
+
+static void lora_tx_kick(lora_dev_t *dev)
+{
+   while (LORA_STATE_TX != dev->state)
+   {
+      unsigned int tail = atomic_load_explicit(&dev->tx_tail, memory_order_relaxed);
+      unsigned int head = atomic_load_explicit(&dev->tx_head, memory_order_acquire);
+
+      if (head == tail)
+      {
+         return;
+      }
+
+      lora_tx_frame_t *frame = &dev->tx_queue[tail % LORA_TX_QUEUE_LEN];
+      uint32_t airtime = 0;
+      uint64_t now = lora_time_us();
+
+#if LORA_CONFIG_ACK
+      if (now < dev->ack_retry_us)
+      {
+         /* Backing off before the next attempt of a confirmed send. */
+         return;
+      }
+#endif
+
+      /* Taken before lora_start_tx(), which may move the hop order on. */
+      long frequency = lora_tx_frequency(dev);
+      if (dev->duty_cycle)
+      {
+         airtime = lora_time_on_air_us(dev, (uint8_t)lora_iov_size(frame->iov, frame->iovcnt));
+
+         uint64_t wait = lora_duty_cycle_wait_us(dev->duty_cycle, frequency, 0, now);
+         if (wait)
+         {
+            dev->tx_hold_us = now + wait;
+            return;
+         }
+      }
+
+      lora_status_t ret = lora_start_tx(dev, frame->iov, frame->iovcnt);
+      if (LORA_OK != ret)
+      {
+         lora_tx_complete(dev, ret, lora_time_us());
+         continue;
+      }
+
+      if (dev->duty_cycle)
+      {
+         lora_duty_cycle_consume(dev->duty_cycle, frequency, airtime, now);
+      }
+
+      dev->tx_hold_us = 0;
+      lora_set_state(dev, LORA_STATE_TX);
+      dev->tx_from_queue = true;
+      dev->tx_deadline_us = lora_tx_deadline(dev, (uint8_t)lora_iov_size(frame->iov, frame->iovcnt));
+   }
+}
+
+#if LORA_CONFIG_RX_RING
+static lora_status_t lora_rx_listen(lora_dev_t *dev)
+{
+   lora_status_t ret = LORA_OK;
+
+   if (dev->dio0_irq)
+   {
+      ret = lora_set_dio_mapping(dev, 0, DIO0_RX_DONE);
+   }
+#if LORA_CONFIG_HOPPING
+   if (dev->hop_period)
+   {
+      ret += lora_set_dio_mapping(dev, 1, DIO1_FHSS_CHANGE_CHANNEL);
+      dev->hop_pos = 0;
+      lora_stage_channel(dev, dev->hop_plan, dev->hop_plan->order[0]);
+      lora_stage_write(dev, REG_IRQ_FLAGS, IRQ_FHSS_CHANGE_CHANNEL_MASK);
+      ret += lora_flush(dev);
+   }
+#endif
+   ret += lora_receive_mode(dev);
+
+   return ret;
+}
+
+#if LORA_CONFIG_HOPPING
+/*
+ * With FHSS the receiver has followed the hops of the last frame; bring it
+ * back to the first channel for the next one.
+ */
+static void lora_hop_rx_restart(lora_dev_t *dev)
+{
+   dev->hop_pos = 0;
+   lora_stage_write(dev, REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_STDBY);
+   lora_stage_channel(dev, dev->hop_plan, dev->hop_plan->order[0]);
+   lora_stage_write(dev, REG_IRQ_FLAGS, IRQ_FHSS_CHANGE_CHANNEL_MASK);
+   lora_stage_write(dev, REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_RX_CONTINUOUS);
+   lora_flush(dev);
+}
+#endif
+#endif
+
+/*
+ * Copy the frame described by a RxCurrentAddr..RxNbBytes burst out of the
+ * FIFO. Flag clear, FIFO read and packet SNR/RSSI go out as one staged
+ * sequence.
+ */
+static lora_status_t lora_rx_fetch(lora_dev_t *dev, const uint8_t *hdr, lora_rx_packet_t *pkt)
+{
+   uint8_t flags = hdr[REG_IRQ_FLAGS - REG_FIFO_RX_CURRENT_ADDR];
+   uint8_t len = hdr[REG_RX_NB_BYTES - REG_FIFO_RX_CURRENT_ADDR];
+   uint64_t now = lora_event_time(dev);
+   uint8_t quality[2];
+
+   if (dev->implicit)
+   {
+      len = dev->shadow[REG_PAYLOAD_LENGTH];
+   }
+
+#if LORA_MAX_PAYLOAD < 255
+   if (len > LORA_MAX_PAYLOAD)
+   {
+      /* Too long for the buffers of this build: dropped like a frame that found the ring full. */
+      atomic_fetch_add_explicit(&dev->rx_overruns, 1, memory_order_relaxed);
+      LORA_TRACE_WARN(LORA_TRACE_RX_OVERRUN, len);
+      lora_write_reg(dev, REG_IRQ_FLAGS, flags & (IRQ_RX_DONE_MASK | IRQ_PAYLOAD_CRC_ERROR_MASK));
+      return LORA_FAILED_RECEIVE_PACKET;
+   }
+#endif
+
+   /* The modem already wrote the frame; a preloaded TX frame under it is gone. */
+   lora_fifo_claim(dev, hdr[0], len);
+
+   lora_stage_write(dev, REG_IRQ_FLAGS, flags & (IRQ_RX_DONE_MASK | IRQ_PAYLOAD_CRC_ERROR_MASK));
+   lora_stage_write(dev, REG_FIFO_ADDR_PTR, hdr[0]);
+   lora_stage(dev, REG_FIFO, false, pkt->payload, len);
+   lora_stage(dev, REG_PKT_SNR_VALUE, false, quality, sizeof(quality));
+
+   lora_status_t ret = lora_flush(dev);
+   if (LORA_OK != ret)
+   {
+      return ret;
+   }
+
+   LORA_TRACE_INFO(LORA_TRACE_RX_DONE, len);
+   lora_stats_add(dev, &dev->stats.rx_frames, 1);
+   LORA_STATS_HIST(dev, rx_read_latency_hist, lora_time_us() - now);
+   pkt->len = len;
+   pkt->snr = ((int8_t)quality[0]) / 4;
+   pkt->rssi = (int16_t)quality[1] - dev->rssi_offset;
+   pkt->timestamp_us = now;
+
+   atomic_store_explicit(&dev->last_rssi, quality[1] - dev->rssi_offset, memory_order_relaxed);
+   atomic_store_explicit(&dev->last_snr, (int8_t)quality[0], memory_order_relaxed);
+   return LORA_OK;
+}
+
+#if LORA_CONFIG_RX_RING
+/*
+ * Move a received frame from the FIFO into the RX ring. The radio keeps
+ * listening: in MODE_RX_CONTINUOUS the modem advances its own write pointer,
+ * so reading the FIFO does not require leaving RX.
+ */
+static void lora_rx_read(lora_dev_t *dev, const uint8_t *hdr)
+{
+   uint8_t flags = hdr[REG_IRQ_FLAGS - REG_FIFO_RX_CURRENT_ADDR];
+   uint8_t clear = flags & (IRQ_RX_DONE_MASK | IRQ_PAYLOAD_CRC_ERROR_MASK);
+
+   if (flags & IRQ_PAYLOAD_CRC_ERROR_MASK)
+   {
+      LORA_TRACE_WARN(LORA_TRACE_RX_CRC_ERROR, 0);
+      lora_stats_add(dev, &dev->stats.crc_errors, 1);
+      lora_write_reg(dev, REG_IRQ_FLAGS, clear);
+      return;
+   }
+
+   unsigned int head = atomic_load_explicit(&dev->rx_head, memory_order_relaxed);
+   unsigned int tail = atomic_load_explicit(&dev->rx_tail, memory_order_acquire);
+   if (head - tail >= LORA_RX_RING_LEN)
+   {
+      atomic_fetch_add_explicit(&dev->rx_overruns, 1, memory_order_relaxed);
+      LORA_TRACE_WARN(LORA_TRACE_RX_OVERRUN, 0);
+      lora_write_reg(dev, REG_IRQ_FLAGS, clear);
+      return;
+   }
+
+   if (LORA_OK == lora_rx_fetch(dev, hdr, &dev->rx_ring[head % LORA_RX_RING_LEN]))
+   {
+      atomic_store_explicit(&dev->rx_head, head + 1, memory_order_release);
+   }
+
+   if (dev->tx_staged && dev->fifo_split && !lora_fhss(dev))
+   {
+      /* Restart RX so the next frame lands at the RX base again, below the preloaded one. */
+      lora_stage_write(dev, REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_STDBY);
+      lora_stage_write(dev, REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_RX_CONTINUOUS);
+      lora_flush(dev);
+   }
+}
+#endif
+
+#if LORA_CONFIG_ACK || LORA_CONFIG_SNIFF
+static uint32_t lora_dev_symbol_us(const lora_dev_t *dev)
+{
+   return lora_symbol_time_us(dev->shadow[REG_MODEM_CONFIG_2] >> 4, dev->shadow[REG_MODEM_CONFIG_1] >> 4);
+}
+#endif
+
+/*
+ * Stage the RX_SINGLE symbol timeout, clamped to the 4 to 1023 symbols the
+ * modem takes. Registers that already hold it are skipped.
+ */
+static void lora_stage_symb_timeout(lora_dev_t *dev, uint32_t symbols)
+{
+   symbols = symbols < 4 ? 4 : (symbols > 0x3ff ? 0x3ff : symbols);
+
+   uint8_t config_2 = (dev->shadow[REG_MODEM_CONFIG_2] & 0xfc) | (uint8_t)(symbols >> 8);
+   uint8_t timeout_lsb = symbols & 0xff;
+
+   if (!dev->shadow_valid || config_2 != dev->shadow[REG_MODEM_CONFIG_2])
+   {
+      lora_stage_write(dev, REG_MODEM_CONFIG_2, config_2);
+   }
+   if (!dev->shadow_valid || timeout_lsb != dev->shadow[REG_SYMB_TIMEOUT_LSB])
+   {
+      lora_stage_write(dev, REG_SYMB_TIMEOUT_LSB, timeout_lsb);
+   }
+}
+
+/*
+ * Stage the DIO mappings for an RX_SINGLE window: RxDone on DIO0 and, when
+ * DIO1 is wired, RxTimeout on DIO1.
+ */
+static void lora_stage_rx_single_mapping(lora_dev_t *dev)
+{
+   uint8_t mapping = dev->shadow[REG_DIO_MAPPING_1];
+
+   if (dev->dio0_irq)
+   {
+      mapping = (mapping & 0x3f) | (DIO0_RX_DONE << 6);
+   }
+   if (dev->dio1_irq)
+   {
+      mapping = (mapping & 0xcf) | (DIO1_RX_TIMEOUT << 4);
+   }
+   if (!dev->shadow_valid || mapping != dev->shadow[REG_DIO_MAPPING_1])
+   {
+      lora_stage_write(dev, REG_DIO_MAPPING_1, mapping);
+   }
+}
+
+lora_status_t lora_receive_single(lora_dev_t *dev, uint16_t timeout_symbols, uint64_t deadline_us,
+                                  lora_rx_packet_t *pkt)
+{
+   uint8_t hdr[REG_RX_NB_BYTES - REG_FIFO_RX_CURRENT_ADDR + 1];
+   lora_status_t ret;
+
+   LORA_LOCK(dev);
+   ret = lora_shadow_load(dev);
+   if (LORA_OK != ret)
+   {
+      LORA_UNLOCK(dev);
+      return ret;
+   }
+
+   if (dev->dio0_irq || dev->dio1_irq)
+   {
+      lora_event_wait(&dev->io, 0);
+   }
+
+   lora_stage_write(dev, REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_STDBY);
+   lora_stage_symb_timeout(dev, timeout_symbols);
+   lora_stage_write(dev, REG_IRQ_FLAGS, 0xff);
+   lora_stage_rx_single_mapping(dev);
+   lora_stage_write(dev, REG_FIFO_ADDR_PTR, dev->shadow[REG_FIFO_RX_BASE_ADDR]);
+   lora_stage_write(dev, REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_RX_SINGLE);
+
+   ret = lora_flush(dev);
+   if (LORA_OK == ret)
+   {
+      lora_set_state(dev, LORA_STATE_RX_SINGLE);
+   }
+   LORA_UNLOCK(dev);
+
+   if (LORA_OK != ret)
+   {
+      return ret;
+   }
+
+   /* The lock is not held during the window; the MCU sleeps on the event. */
+   ret = LORA_RX_TIMEOUT;
+   uint64_t now;
+   while ((now = lora_time_us()) < deadline_us)
+   {
+      uint32_t left_ms = (uint32_t)((deadline_us - now + 999) / 1000);
+
+      if (dev->dio0_irq)
+      {
+         /* Without DIO1 the RxTimeout is only seen at the deadline. */
+         lora_event_wait(&dev->io, left_ms);
+      }
+      else
+      {
+         lora_delay(left_ms < LORA_DELAY_10MS ? left_ms : LORA_DELAY_10MS);
+      }
+
+      if (LORA_OK != lora_read_reg_buffer(dev, REG_FIFO_RX_CURRENT_ADDR, hdr, sizeof(hdr)))
+      {
+         continue;
+      }
+
+      uint8_t flags = hdr[REG_IRQ_FLAGS - REG_FIFO_RX_CURRENT_ADDR];
+      if (flags & IRQ_RX_DONE_MASK)
+      {
+         ret = (flags & IRQ_PAYLOAD_CRC_ERROR_MASK) ? LORA_CRC_ERROR : LORA_OK;
+         if (LORA_CRC_ERROR == ret)
+         {
+            lora_stats_add(dev, &dev->stats.crc_errors, 1);
+         }
+         break;
+      }
+      if (flags & IRQ_RX_TIMEOUT_MASK)
+      {
+         break;
+      }
+   }
+
+   LORA_LOCK(dev);
+   if (LORA_OK == ret)
+   {
+      ret = lora_rx_fetch(dev, hdr, pkt);
+   }
+   else if (LORA_RX_TIMEOUT == ret)
+   {
+      lora_stats_add(dev, &dev->stats.rx_timeouts, 1);
+   }
+   /* The modem returns to standby by itself after RxDone or RxTimeout. */
+   lora_stage_write(dev, REG_IRQ_FLAGS, 0xff);
+   lora_stage_write(dev, REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_STDBY);
+   lora_flush(dev);
+   lora_set_state(dev, LORA_STATE_STANDBY);
+   LORA_UNLOCK(dev);
+
+   return ret;
+}
+
+#if LORA_CONFIG_ACK
+/*
+ * Confirmed sends. TxDone leaves the modem in standby, so the ACK window is
+ * opened with one staged sequence and no oscillator restart; the window,
+ * the match and the retries all run from lora_process_events().
+ */
+static const lora_confirm_t *lora_tx_confirm(const lora_dev_t *dev)
+{
+   unsigned int tail = atomic_load_explicit(&dev->tx_tail, memory_order_relaxed);
+
+   return dev->tx_queue[tail % LORA_TX_QUEUE_LEN].confirm;
+}
+
+/*
+ * Close the ACK window. The modem is back in standby by itself after RxDone
+ * or RxTimeout; only a window that ran past its deadline has to be stopped.
+ */
+static void lora_ack_finish(lora_dev_t *dev, bool running)
+{
+   lora_stage_write(dev, REG_IRQ_FLAGS, 0xff);
+   if (running)
+   {
+      lora_stage_write(dev, REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_STDBY);
+   }
+   lora_flush(dev);
+   dev->ack_wait = false;
+   lora_set_state(dev, LORA_STATE_STANDBY);
+}
+
+/*
+ * The attempt went unanswered: back off before sending again, with a random
+ * part so that two nodes that collided do not pick the same slot again.
+ */
+static void lora_ack_retry(lora_dev_t *dev, bool running)
+{
+   const lora_confirm_t *confirm = lora_tx_confirm(dev);
+
+   lora_ack_finish(dev, running);
+   LORA_TRACE_WARN(LORA_TRACE_ACK_TIMEOUT, dev->ack_attempts + 1);
+
+   if (dev->ack_attempts >= confirm->retries)
+   {
+      lora_stats_add(dev, &dev->stats.ack_failures, 1);
+      lora_tx_complete(dev, LORA_NO_ACK, lora_time_us());
+      return;
+   }
+
+   uint8_t shift = dev->ack_attempts < LORA_ACK_MAX_BACKOFF_SHIFT ? dev->ack_attempts : LORA_ACK_MAX_BACKOFF_SHIFT;
+   uint64_t backoff = ((uint64_t)confirm->backoff_ms * 1000) << shift;
+
+   if (backoff)
+   {
+      backoff += lora_random(dev) % backoff;
+   }
+   dev->ack_attempts++;
+   dev->ack_retry_us = lora_time_us() + backoff;
+   lora_stats_add(dev, &dev->stats.tx_retries, 1);
+}
+
+static void lora_ack_listen(lora_dev_t *dev, uint64_t done_us)
+{
+   const lora_confirm_t *confirm = lora_tx_confirm(dev);
+   uint32_t symbol_us = lora_dev_symbol_us(dev);
+   uint32_t preamble = (dev->shadow[REG_PREAMBLE_MSB] << 8) | dev->shadow[REG_PREAMBLE_LSB];
+
+   /* The preamble of the reply has to show up within the turnaround, with the guard of a sniff window. */
+   uint32_t timeout = (confirm->turnaround_us + symbol_us - 1) / symbol_us + preamble + LORA_SNIFF_GUARD_SYMBOLS;
+   if (timeout > 0x3ff)
+   {
+      timeout = 0x3ff;
+   }
+
+   dev->tx_done_us = done_us;
+   lora_stats_tx_done(dev, LORA_OK, done_us);
+
+   /* Clears TxDone along with whatever the last window left behind. */
+   lora_stage_write(dev, REG_IRQ_FLAGS, 0xff);
+   lora_stage_symb_timeout(dev, timeout);
+   lora_stage_rx_single_mapping(dev);
+   lora_stage_write(dev, REG_FIFO_ADDR_PTR, dev->shadow[REG_FIFO_RX_BASE_ADDR]);
+   lora_stage_write(dev, REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_RX_SINGLE);
+
+   if (LORA_OK != lora_flush(dev))
+   {
+      lora_ack_retry(dev, true);
+      return;
+   }
+
+   lora_set_state(dev, LORA_STATE_RX_SINGLE);
+   dev->ack_wait = true;
+   dev->ack_step = 0;
+   dev->ack_deadline_us = lora_time_us() + (uint64_t)(timeout + 2) * symbol_us;
+}
+
+/*
+ * Read the start of the received frame and compare it with the expected
+ * acknowledgement; the flag clear and packet SNR and RSSI go out in the same
+ * sequence.
+ */
+static bool lora_ack_match(lora_dev_t *dev, const uint8_t *hdr)
+{
+   const lora_confirm_t *confirm = lora_tx_confirm(dev);
+   uint8_t len = dev->implicit ? dev->shadow[REG_PAYLOAD_LENGTH] : hdr[REG_RX_NB_BYTES - REG_FIFO_RX_CURRENT_ADDR];
+   uint8_t ack[LORA_ACK_MAX_LEN];
+   uint8_t quality[2];
+
+   if (len < confirm->ack_len)
+   {
+      return false;
+   }
+
+   lora_fifo_claim(dev, hdr[0], len);
+   lora_stage_write(dev, REG_IRQ_FLAGS, 0xff);
+   lora_stage_write(dev, REG_FIFO_ADDR_PTR, hdr[0]);
+   if (confirm->ack_len)
+   {
+      lora_stage(dev, REG_FIFO, false, ack, confirm->ack_len);
+   }
+   lora_stage(dev, REG_PKT_SNR_VALUE, false, quality, sizeof(quality));
+
+   if (LORA_OK != lora_flush(dev))
+   {
+      return false;
+   }
 
-lora_status_t lora_dump_registers(void)
+   lora_stats_add(dev, &dev->stats.rx_frames, 1);
+   atomic_store_explicit(&dev->last_rssi, quality[1] - dev->rssi_offset, memory_order_relaxed);
+   atomic_store_explicit(&dev->last_snr, (int8_t)quality[0], memory_order_relaxed);
+
+   return 0 == memcmp(ack, confirm->ack, confirm->ack_len);
+}
+
+static void lora_ack_rx_done(lora_dev_t *dev, lora_status_t ret, const uint8_t *hdr)
 {
-   uint8_t i;
-   printf("00 01 02 03 04 05 06 07 08 09 0A 0B 0C 0D 0E 0F\n");
-   for (i = 0; i < 0x40; i++)
+   uint8_t flags = hdr[REG_IRQ_FLAGS - REG_FIFO_RX_CURRENT_ADDR];
+
+   if (LORA_OK == ret && (flags & IRQ_RX_DONE_MASK))
    {
-      uint8_t reg_val;
-      if (lora_read_reg(i, &reg_val) != LORA_OK)
+      if (flags & IRQ_PAYLOAD_CRC_ERROR_MASK)
       {
-         return LORA_FAIL;
+         LORA_TRACE_WARN(LORA_TRACE_RX_CRC_ERROR, 0);
+         lora_stats_add(dev, &dev->stats.crc_errors, 1);
+      }
+      else if (lora_ack_match(dev, hdr))
+      {
+         dev->ack_wait = false;
+         lora_tx_complete(dev, LORA_OK, dev->tx_done_us);
+         return;
       }
-      printf("%02X ", reg_val);
-      if ((i & 0x0f) == 0x0f)
-         printf("\n");
    }
-   printf("\n");
-   return LORA_OK;
+   else if (LORA_OK != ret || !(flags & IRQ_RX_TIMEOUT_MASK))
+   {
+      if (lora_time_us() < dev->ack_deadline_us)
+      {
+         return;
+      }
+      if (LORA_OK == ret && 0 == dev->ack_step)
+      {
+         /* No RxTimeout by now: a preamble locked and the reply is still coming in. */
+         dev->ack_step = 1;
+         dev->ack_deadline_us = lora_time_us() + TIMEOUT_TX_MARGIN_US + lora_time_on_air_us(dev, LORA_MAX_PAYLOAD);
+         return;
+      }
+      lora_ack_retry(dev, true);
+      return;
+   }
+
+   lora_ack_retry(dev, false);
 }
+#endif
 
-lora_status_t lora_driver_init(void)
+uint32_t lora_time_on_air_us(lora_dev_t *dev, uint8_t size)
 {
-   lora_status_t ret;
+   LORA_LOCK(dev);
+   lora_modem_params_t params = {
+       .spreading_factor = dev->shadow[REG_MODEM_CONFIG_2] >> 4,
+       .bandwidth = dev->shadow[REG_MODEM_CONFIG_1] >> 4,
+       .coding_rate = (dev->shadow[REG_MODEM_CONFIG_1] >> 1) & 0x07,
+       .preamble_length = (uint16_t)((dev->shadow[REG_PREAMBLE_MSB] << 8) | dev->shadow[REG_PREAMBLE_LSB]),
+       .implicit_header = dev->shadow[REG_MODEM_CONFIG_1] & 0x01,
+       .crc = dev->shadow[REG_MODEM_CONFIG_2] & 0x04,
+       .low_data_rate = dev->shadow[REG_MODEM_CONFIG_3] & 0x08,
+   };
+   LORA_UNLOCK(dev);
+
+   return lora_airtime_us(&params, size);
+}
 
-   spi_init();
+void lora_set_duty_cycle(lora_dev_t *dev, lora_duty_cycle_t *dc)
+{
+   LORA_LOCK(dev);
+   dev->duty_cycle = dc;
+   dev->tx_hold_us = 0;
+   LORA_UNLOCK(dev);
 
-   uint8_t version;
-   uint8_t i = 0;
-   while (i++ < TIMEOUT_RESET)
+   lora_event_signal(&dev->io);
+}
+
+uint64_t lora_tx_wait_us(lora_dev_t *dev)
+{
+   LORA_LOCK(dev);
+   unsigned int tail = atomic_load_explicit(&dev->tx_tail, memory_order_relaxed);
+   unsigned int head = atomic_load_explicit(&dev->tx_head, memory_order_acquire);
+   uint64_t now = lora_time_us();
+   uint64_t wait = 0;
+
+   if (head - tail >= LORA_TX_QUEUE_LEN)
    {
-      lora_read_reg(REG_VERSION, &version);
-      if (0x12 == version)
-         break;
-      lora_delay(LORA_DELAY_20MS);
+      LORA_UNLOCK(dev);
+      return UINT64_MAX;
    }
 
-   if (TIMEOUT_RESET + 1 == i)
-      return LORA_FAILED_INIT;
+   if (LORA_STATE_TX == dev->state)
+   {
+      /* The rest of the frame on air; it only leaves the queue if it came from there. */
+      uint64_t end = dev->tx_start_us + lora_time_on_air_us(dev, dev->tx_fifo_len);
+      wait = (end > now) ? end - now : 0;
+      if (dev->tx_from_queue && head != tail)
+      {
+         tail++;
+      }
+   }
+#if LORA_CONFIG_ACK
+   else if (dev->ack_wait && head != tail)
+   {
+      /* The confirmed frame at the tail is done once its ACK window is. */
+      wait = (dev->ack_deadline_us > now) ? dev->ack_deadline_us - now : 0;
+      tail++;
+   }
+   else if (now < dev->ack_retry_us)
+   {
+      /* Backing off before the next attempt of the tail frame, counted below. */
+      wait = dev->ack_retry_us - now;
+   }
+#endif
+
+   uint64_t ahead = 0;
+   for (; tail != head; tail++)
+   {
+      const lora_tx_frame_t *frame = &dev->tx_queue[tail % LORA_TX_QUEUE_LEN];
+      ahead += lora_time_on_air_us(dev, (uint8_t)lora_iov_size(frame->iov, frame->iovcnt));
+   }
+   wait += ahead;
+
+   if (dev->duty_cycle)
+   {
+      /* The off-time owed now and the one each frame ahead adds. */
+      uint64_t hold = lora_duty_cycle_wait_us(dev->duty_cycle, lora_tx_frequency(dev),
+                                              ahead > UINT32_MAX ? UINT32_MAX : (uint32_t)ahead, now);
+      wait = (hold > wait) ? hold : wait;
+   }
+   LORA_UNLOCK(dev);
+
+   return wait;
+}
+
+#if LORA_CONFIG_SNIFF
+/*
+ * Sniff mode: sleep, wake up for a CAD every sniff_interval_us and only open
+ * an RX_SINGLE window when the CAD saw a preamble. The interval is shorter
+ * than the preamble, so any frame sent to us is caught by at least one CAD.
+ */
+static lora_status_t lora_sniff_sleep(lora_dev_t *dev)
+{
+   /* Drops CadDone/CadDetected, RxTimeout and ValidHeader in one go. */
+   lora_stage_write(dev, REG_IRQ_FLAGS, 0xff);
+   lora_stage_write(dev, REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_SLEEP);
+   lora_set_state(dev, LORA_STATE_SLEEP);
+
+   return lora_flush(dev);
+}
+
+static lora_status_t lora_sniff_cad(lora_dev_t *dev)
+{
+   uint64_t now = lora_time_us();
+
+   /* Keep a fixed cadence unless we fell behind by a whole interval. */
+   dev->sniff_next_us += dev->sniff_interval_us;
+   if (dev->sniff_next_us <= now)
+   {
+      dev->sniff_next_us = now + dev->sniff_interval_us;
+   }
+   dev->sniff_deadline_us = now + TIMEOUT_CAD_MARGIN_US + (uint64_t)TIMEOUT_CAD_SYMBOLS * lora_dev_symbol_us(dev);
+
+   lora_stage_write(dev, REG_IRQ_FLAGS, IRQ_CAD_DONE_MASK | IRQ_CAD_DETECTED_MASK);
+   if (dev->dio0_irq)
+   {
+      uint8_t mapping = (dev->shadow[REG_DIO_MAPPING_1] & 0x3f) | (DIO0_CAD_DONE << 6);
+      if (!dev->shadow_valid || mapping != dev->shadow[REG_DIO_MAPPING_1])
+      {
+         lora_stage_write(dev, REG_DIO_MAPPING_1, mapping);
+      }
+   }
+   lora_stage_write(dev, REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_CAD);
+
+   lora_status_t ret = lora_flush(dev);
+   if (LORA_OK == ret)
+   {
+      lora_set_state(dev, LORA_STATE_CAD);
+      dev->cad_count++;
+   }
+   return ret;
+}
+
+static lora_status_t lora_sniff_rx(lora_dev_t *dev)
+{
+   /* First check right after the modem's own RxTimeout would have fired. */
+   dev->sniff_step = 0;
+   dev->sniff_deadline_us = lora_time_us() + (uint64_t)(dev->sniff_timeout + 2) * lora_dev_symbol_us(dev);
+
+   /* CAD leaves the modem in standby, RX_SINGLE can be entered directly. */
+   lora_stage_symb_timeout(dev, dev->sniff_timeout);
+   lora_stage_write(dev, REG_IRQ_FLAGS, 0xff);
+   lora_stage_rx_single_mapping(dev);
+   lora_stage_write(dev, REG_FIFO_ADDR_PTR, dev->shadow[REG_FIFO_RX_BASE_ADDR]);
+   lora_stage_write(dev, REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_RX_SINGLE);
+
+   lora_status_t ret = lora_flush(dev);
+   if (LORA_OK == ret)
+   {
+      lora_set_state(dev, LORA_STATE_RX_SINGLE);
+   }
+   return ret;
+}
+
+static lora_status_t lora_sniff_cad_done(lora_dev_t *dev, lora_status_t ret, uint8_t flags)
+{
+   if (LORA_OK == ret && (flags & IRQ_CAD_DONE_MASK))
+   {
+      LORA_TRACE_DEBUG(LORA_TRACE_CAD_DONE, (flags & IRQ_CAD_DETECTED_MASK) != 0);
+      if (flags & IRQ_CAD_DETECTED_MASK)
+      {
+         dev->cad_detected++;
+         return lora_sniff_rx(dev);
+      }
+   }
+   else if (lora_time_us() < dev->sniff_deadline_us)
+   {
+      return ret;
+   }
+
+   return lora_sniff_sleep(dev);
+}
+
+static lora_status_t lora_sniff_rx_done(lora_dev_t *dev, lora_status_t ret, const uint8_t *hdr)
+{
+   uint8_t flags = hdr[REG_IRQ_FLAGS - REG_FIFO_RX_CURRENT_ADDR];
+
+   if (LORA_OK == ret && (flags & IRQ_RX_DONE_MASK))
+   {
+      lora_rx_read(dev, hdr);
+   }
+   else if (LORA_OK != ret || !(flags & IRQ_RX_TIMEOUT_MASK))
+   {
+      if (lora_time_us() < dev->sniff_deadline_us)
+      {
+         return ret;
+      }
+      if (LORA_OK == ret && (flags & IRQ_VALID_HEADER_MASK) && dev->sniff_step < 2)
+      {
+         /* A frame is coming in: give it the airtime of the longest payload. */
+         dev->sniff_step = 2;
+         dev->sniff_deadline_us = lora_time_us() + TIMEOUT_TX_MARGIN_US + lora_time_on_air_us(dev, LORA_MAX_PAYLOAD);
+         return LORA_OK;
+      }
+      if (LORA_OK == ret && 0 == dev->sniff_step)
+      {
+         /* Preamble locked late: the header is still on its way. */
+         dev->sniff_step = 1;
+         dev->sniff_deadline_us = lora_time_us() + (uint64_t)LORA_SNIFF_HEADER_SYMBOLS * lora_dev_symbol_us(dev);
+         return LORA_OK;
+      }
+   }
+
+   return lora_sniff_sleep(dev);
+}
+
+lora_status_t lora_sniff_start(lora_dev_t *dev, uint32_t interval_ms)
+{
+   lora_status_t ret = LORA_OK;
+
+   LORA_LOCK(dev);
+   long preamble = (dev->shadow[REG_PREAMBLE_MSB] << 8) | dev->shadow[REG_PREAMBLE_LSB];
+   uint32_t interval_us = interval_ms * 1000;
+
+   if (0 == interval_ms)
+   {
+      if (preamble <= LORA_SNIFF_GUARD_SYMBOLS)
+      {
+         LORA_UNLOCK(dev);
+         return LORA_FAIL;
+      }
+      interval_us = (uint32_t)(preamble - LORA_SNIFF_GUARD_SYMBOLS) * lora_dev_symbol_us(dev);
+   }
 
-   ret = lora_sleep_mode();
-   ret += lora_write_reg(REG_FIFO_RX_BASE_ADDR, 0);
-   ret += lora_write_reg(REG_FIFO_TX_BASE_ADDR, 0);
-   uint8_t lna_val;
-   lora_read_reg(REG_LNA, &lna_val);
-   ret += lora_write_reg(REG_LNA, lna_val | 0x03);
-   ret += lora_write_reg(REG_MODEM_CONFIG_3, 0x04);
+   /* RX_SINGLE gives up when no preamble shows up within the remaining preamble time. */
+   long timeout = preamble + LORA_SNIFF_GUARD_SYMBOLS;
+   if (timeout > 0x3ff)
+   {
+      timeout = 0x3ff;
+   }
+   ret += lora_update_reg_cached(dev, REG_MODEM_CONFIG_2, 0x03, (uint8_t)(timeout >> 8));
+   ret += lora_write_reg_cached(dev, REG_SYMB_TIMEOUT_LSB, (uint8_t)timeout);
 
-   ret += lora_idle_mode();
+   dev->sniff_timeout = (uint16_t)timeout;
+   dev->sniff_interval_us = interval_us;
+   dev->sniff_next_us = lora_time_us();
+   atomic_store(&dev->sniff_active, true);
+   LORA_UNLOCK(dev);
 
+   lora_event_signal(&dev->io);
    return ret;
 }
 
-lora_status_t lora_send_packet(uint8_t *buf, uint8_t size)
+lora_status_t lora_sniff_stop(lora_dev_t *dev)
 {
-   lora_status_t ret;
+   atomic_store(&dev->sniff_active, false);
+   lora_event_signal(&dev->io);
 
-   ret = lora_idle_mode();
-   ret += lora_write_reg(REG_FIFO_ADDR_PTR, 0);
+   return LORA_OK;
+}
+#endif
 
-   ret += lora_write_reg_buffer(REG_FIFO, buf, size);
+void lora_get_state_times(lora_dev_t *dev, lora_state_times_t *times)
+{
+   uint64_t t[LORA_STATE_COUNT];
+
+   LORA_LOCK(dev);
+   memcpy(t, dev->state_time_us, sizeof(t));
+   t[dev->state] += lora_time_us() - dev->state_since_us;
+   times->cad_count = dev->cad_count;
+   times->cad_detected = dev->cad_detected;
+   LORA_UNLOCK(dev);
+
+   times->sleep_us = t[LORA_STATE_SLEEP];
+   times->standby_us = t[LORA_STATE_STANDBY];
+   times->tx_us = t[LORA_STATE_TX];
+   times->rx_us = t[LORA_STATE_RX] + t[LORA_STATE_RX_SINGLE];
+   times->cad_us = t[LORA_STATE_CAD];
+}
 
-   ret += lora_write_reg(REG_PAYLOAD_LENGTH, size);
+static bool lora_radio_busy(const lora_dev_t *dev)
+{
+   return LORA_STATE_TX == dev->state || LORA_STATE_RX == dev->state || LORA_STATE_CAD == dev->state ||
+          LORA_STATE_RX_SINGLE == dev->state;
+}
 
-   ret += lora_write_reg(REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_TX);
+/*
+ * Absolute time at which lora_service() has to look at the radio again even
+ * without an interrupt, UINT64_MAX if there is none.
+ */
+static uint64_t lora_next_wakeup(const lora_dev_t *dev)
+{
+   uint64_t wake = UINT64_MAX;
 
-   if (LORA_OK != ret)
+   if (LORA_STATE_TX == dev->state)
    {
-      printf("LORA_FAILED_SEND_PACKET");
-      return LORA_FAILED_SEND_PACKET;
+      return dev->tx_deadline_us;
+   }
+#if LORA_CONFIG_ACK
+   if (dev->ack_wait)
+   {
+      return dev->ack_deadline_us;
+   }
+#endif
+#if LORA_CONFIG_SNIFF
+   if (LORA_STATE_CAD == dev->state || LORA_STATE_RX_SINGLE == dev->state)
+   {
+      return dev->sniff_deadline_us;
    }
+#endif
 
-   uint16_t loop = 0;
-   uint8_t tmp = 0;
+   if (dev->tx_hold_us)
+   {
+      /* Wake up when the duty-cycle budget allows the next frame. */
+      wake = dev->tx_hold_us;
+   }
+#if LORA_CONFIG_ACK
+   if (dev->ack_retry_us && dev->ack_retry_us < wake)
+   {
+      wake = dev->ack_retry_us;
+   }
+#endif
+#if LORA_CONFIG_SNIFF
+   if (atomic_load(&dev->sniff_active) && dev->sniff_next_us < wake)
+   {
+      wake = dev->sniff_next_us;
+   }
+#endif
+   return wake;
+}
+
+static lora_status_t lora_process_events(lora_dev_t *dev, bool event);
+
+lora_status_t lora_service(lora_dev_t *dev, uint32_t timeout_ms)
+{
+   bool event = true;
+   uint64_t wake = lora_next_wakeup(dev);
+
+   if (UINT64_MAX != wake)
+   {
+      uint64_t now = lora_time_us();
+      uint64_t left_ms = (wake > now) ? (wake - now + 999) / 1000 : 0;
+      if (left_ms < timeout_ms)
+      {
+         timeout_ms = (uint32_t)left_ms;
+      }
+   }
+
+   if (dev->dio0_irq || !lora_radio_busy(dev))
+   {
+      /* Without DIO0 only a new frame or an RX start/stop can wake us up here. */
+      event = (API_OK == lora_event_wait(&dev->io, timeout_ms));
+   }
+   else
+   {
+      lora_delay(timeout_ms < LORA_DELAY_10MS ? timeout_ms : LORA_DELAY_10MS);
+   }
+
+   LORA_LOCK(dev);
+   /* The staged sequences below merge bits into the shadow copy; retried on the next call. */
+   lora_status_t ret = lora_shadow_load(dev);
+   if (LORA_OK == ret)
+   {
+      ret = lora_process_events(dev, event);
+   }
+   LORA_UNLOCK(dev);
 
-   irq = &tmp;
+   return ret;
+}
 
-   while (1)
+static lora_status_t lora_process_events(lora_dev_t *dev, bool event)
+{
+#if LORA_CONFIG_SNIFF
+#if LORA_CONFIG_ACK
+   bool sniffing = !dev->ack_wait && (LORA_STATE_CAD == dev->state || LORA_STATE_RX_SINGLE == dev->state);
+#else
+   bool sniffing = LORA_STATE_CAD == dev->state || LORA_STATE_RX_SINGLE == dev->state;
+#endif
+
+   if (sniffing && lora_time_us() >= dev->sniff_deadline_us)
+   {
+      /* RxTimeout is not routed to DIO0, so the flags are checked at the deadline. */
+      event = true;
+   }
+#endif
+#if LORA_CONFIG_ACK
+   if (dev->ack_wait && lora_time_us() >= dev->ack_deadline_us)
    {
-      ret = lora_read_reg(REG_IRQ_FLAGS, irq);
+      event = true;
+   }
+#endif
 
-      if ((*irq & IRQ_TX_DONE_MASK) == IRQ_TX_DONE_MASK)
+   if (event && lora_radio_busy(dev))
+   {
+      /* RxCurrentAddr, IrqFlags and RxNbBytes in one burst. */
+      uint8_t hdr[REG_RX_NB_BYTES - REG_FIFO_RX_CURRENT_ADDR + 1];
+      lora_status_t ret = lora_read_reg_buffer(dev, REG_FIFO_RX_CURRENT_ADDR, hdr, sizeof(hdr));
+      uint8_t flags = hdr[REG_IRQ_FLAGS - REG_FIFO_RX_CURRENT_ADDR];
+
+#if LORA_CONFIG_HOPPING
+      if (LORA_OK == ret && dev->hop_period && (flags & IRQ_FHSS_CHANGE_CHANNEL_MASK) &&
+          (LORA_STATE_TX == dev->state || LORA_STATE_RX == dev->state))
       {
-         printf("Time taken(ms): %d\n", loop * 10);
-         break;
+         lora_hop_next(dev);
       }
-      loop++;
-      if (65535 == loop)
-         break;
-      lora_delay(LORA_DELAY_10MS);
+#endif
+
+      if (LORA_STATE_TX == dev->state)
+      {
+         if (LORA_OK != ret)
+         {
+            lora_tx_complete(dev, ret, lora_time_us());
+         }
+#if LORA_CONFIG_ACK
+         else if ((flags & IRQ_TX_DONE_MASK) && lora_tx_confirm(dev))
+         {
+            lora_ack_listen(dev, lora_event_time(dev));
+         }
+#endif
+         else if (flags & IRQ_TX_DONE_MASK)
+         {
+            lora_tx_complete(dev, lora_write_reg(dev, REG_IRQ_FLAGS, IRQ_TX_DONE_MASK), lora_event_time(dev));
+         }
+      }
+#if LORA_CONFIG_ACK
+      else if (dev->ack_wait)
+      {
+         lora_ack_rx_done(dev, ret, hdr);
+      }
+#endif
+#if LORA_CONFIG_SNIFF
+      else if (LORA_STATE_CAD == dev->state)
+      {
+         lora_sniff_cad_done(dev, ret, flags);
+      }
+      else if (LORA_STATE_RX_SINGLE == dev->state)
+      {
+         lora_sniff_rx_done(dev, ret, hdr);
+      }
+#endif
+#if LORA_CONFIG_RX_RING
+      else if (LORA_STATE_RX == dev->state && LORA_OK == ret && (flags & IRQ_RX_DONE_MASK))
+      {
+         lora_rx_read(dev, hdr);
+#if LORA_CONFIG_HOPPING
+         if (dev->hop_period)
+         {
+            lora_hop_rx_restart(dev);
+         }
+#endif
+      }
+#endif
+   }
+
+   if (LORA_STATE_TX == dev->state && lora_time_us() >= dev->tx_deadline_us)
+   {
+      lora_recover(dev);
+      lora_tx_complete(dev, LORA_TX_TIMEOUT, lora_time_us());
+   }
+
+   if (LORA_STATE_CAD == dev->state || LORA_STATE_RX_SINGLE == dev->state)
+   {
+      /* Let the sniff step or the ACK window finish before transmitting. */
+      return LORA_OK;
+   }
+
+   lora_tx_kick(dev);
+
+   if (LORA_STATE_TX != dev->state)
+   {
+#if LORA_CONFIG_SNIFF
+      if (atomic_load(&dev->sniff_active))
+      {
+         if (lora_time_us() >= dev->sniff_next_us)
+         {
+            return lora_sniff_cad(dev);
+         }
+         return (LORA_STATE_SLEEP != dev->state) ? lora_sleep_mode(dev) : LORA_OK;
+      }
+#endif
+
+#if LORA_CONFIG_RX_RING
+      bool rx = atomic_load(&dev->rx_active);
+
+      if (rx && LORA_STATE_RX != dev->state)
+      {
+         return lora_rx_listen(dev);
+      }
+#else
+      bool rx = false;
+#endif
+      if (!rx && (LORA_STATE_STANDBY == dev->state || LORA_STATE_RX == dev->state))
+      {
+         return lora_sleep_mode(dev);
+      }
+   }
+
+   return LORA_OK;
+}
+
+#if LORA_CONFIG_RX_RING
+lora_status_t lora_rx_start(lora_dev_t *dev)
+{
+   atomic_store(&dev->rx_active, true);
+   lora_event_signal(&dev->io);
+   return LORA_OK;
+}
+
+lora_status_t lora_rx_stop(lora_dev_t *dev)
+{
+   atomic_store(&dev->rx_active, false);
+   lora_event_signal(&dev->io);
+   return LORA_OK;
+}
+
+size_t lora_rx_pop_many(lora_dev_t *dev, lora_rx_packet_t *pkts, size_t max)
+{
+   unsigned int tail = atomic_load_explicit(&dev->rx_tail, memory_order_relaxed);
+   unsigned int head = atomic_load_explicit(&dev->rx_head, memory_order_acquire);
+   size_t n = 0;
+
+   while (n < max && tail != head)
+   {
+      const lora_rx_packet_t *pkt = &dev->rx_ring[tail % LORA_RX_RING_LEN];
+
+      memcpy(pkts[n].payload, pkt->payload, pkt->len);
+      pkts[n].len = pkt->len;
+      pkts[n].rssi = pkt->rssi;
+      pkts[n].snr = pkt->snr;
+      pkts[n].timestamp_us = pkt->timestamp_us;
+      n++;
+      tail++;
    }
-   if (65535 == loop)
+
+   atomic_store_explicit(&dev->rx_tail, tail, memory_order_release);
+   return n;
+}
+
+const lora_rx_packet_t *lora_rx_loan(lora_dev_t *dev)
+{
+   unsigned int tail = atomic_load_explicit(&dev->rx_tail, memory_order_relaxed);
+   unsigned int head = atomic_load_explicit(&dev->rx_head, memory_order_acquire);
+
+   if (tail == head)
    {
-      __send_packet_lost++;
-      printf("lora_send_packet Fail\n");
+      return NULL;
    }
 
-   lora_sleep_mode();
+   return &dev->rx_ring[tail % LORA_RX_RING_LEN];
+}
+
+void lora_rx_return(lora_dev_t *dev)
+{
+   unsigned int tail = atomic_load_explicit(&dev->rx_tail, memory_order_relaxed);
+
+   atomic_store_explicit(&dev->rx_tail, tail + 1, memory_order_release);
+}
+#endif
+
+void lora_get_stats(lora_dev_t *dev, lora_stats_t *stats)
+{
+   unsigned int seq;
+   uint8_t tries = 0;
+
+   do
+   {
+      if (++tries > LORA_STATS_READ_TRIES)
+      {
+         /* The writer may be preempted by us: wait for it on the lock instead of spinning. */
+         LORA_LOCK(dev);
+         memcpy(stats, &dev->stats, sizeof(*stats));
+         LORA_UNLOCK(dev);
+         break;
+      }
+      seq = atomic_load_explicit(&dev->stats_seq, memory_order_acquire);
+      memcpy(stats, &dev->stats, sizeof(*stats));
+      atomic_thread_fence(memory_order_acquire);
+   } while ((seq & 1) || seq != atomic_load_explicit(&dev->stats_seq, memory_order_relaxed));
+
+   stats->rx_overruns = atomic_load_explicit(&dev->rx_overruns, memory_order_relaxed);
+}
+
+void lora_reset_stats(lora_dev_t *dev)
+{
+   lora_stats_begin(dev);
+   memset(&dev->stats, 0, sizeof(dev->stats));
+   lora_stats_end(dev);
+}
+
+uint32_t lora_rx_overruns(lora_dev_t *dev)
+{
+   return atomic_load_explicit(&dev->rx_overruns, memory_order_relaxed);
+}
 
-   return lora_write_reg(REG_IRQ_FLAGS, IRQ_TX_DONE_MASK);
+void lora_get_footprint(lora_footprint_t *footprint)
+{
+   footprint->device = sizeof(lora_dev_t);
+#if LORA_CONFIG_RX_RING
+   footprint->rx_ring = sizeof(__devices[0].rx_ring);
+#else
+   footprint->rx_ring = 0;
+#endif
+   footprint->tx_queue = sizeof(__devices[0].tx_queue);
+   footprint->stats = sizeof(__devices[0].stats);
+   footprint->pool = sizeof(__devices);
 }
 
-lora_status_t lora_receive_packet(uint8_t *buf, uint8_t *return_len, uint8_t size)
+static lora_status_t lora_receive_packet_locked(lora_dev_t *dev, uint8_t *buf, uint8_t *return_len, uint8_t size)
 {
    uint8_t irq;
    uint8_t len = 0;
    lora_status_t ret;
 
-   ret = lora_read_reg(REG_IRQ_FLAGS, &irq);
-   ret += lora_write_reg(REG_IRQ_FLAGS, irq);
+   ret = lora_read_reg(dev, REG_IRQ_FLAGS, &irq);
+   ret += lora_write_reg(dev, REG_IRQ_FLAGS, irq);
 
    if (0 == (irq & IRQ_RX_DONE_MASK))
       return LORA_FAIL;
    if (irq & IRQ_PAYLOAD_CRC_ERROR_MASK)
+   {
+      lora_stats_add(dev, &dev->stats.crc_errors, 1);
       return LORA_FAIL;
+   }
 
-   if (__implicit)
-      lora_read_reg(REG_PAYLOAD_LENGTH, &len);
+   if (dev->implicit)
+      lora_read_reg(dev, REG_PAYLOAD_LENGTH, &len);
    else
-      lora_read_reg(REG_RX_NB_BYTES, &len);
+      lora_read_reg(dev, REG_RX_NB_BYTES, &len);
 
-   lora_idle_mode();
+   lora_idle_mode(dev);
 
    uint8_t reg_val;
 
-   lora_read_reg(REG_FIFO_RX_CURRENT_ADDR, &reg_val);
-   lora_write_reg(REG_FIFO_ADDR_PTR, reg_val);
+   lora_read_reg(dev, REG_FIFO_RX_CURRENT_ADDR, &reg_val);
+   lora_write_reg(dev, REG_FIFO_ADDR_PTR, reg_val);
 
    if (len > size)
       len = size;
 
-   lora_read_reg_buffer(REG_FIFO, buf, len);
+   lora_read_reg_buffer(dev, REG_FIFO, buf, len);
 
    *return_len = len;
+   lora_stats_add(dev, &dev->stats.rx_frames, 1);
+
+   uint8_t quality[2];
+   if (LORA_OK == lora_read_reg_buffer(dev, REG_PKT_SNR_VALUE, quality, sizeof(quality)))
+   {
+      atomic_store_explicit(&dev->last_rssi, quality[1] - dev->rssi_offset, memory_order_relaxed);
+      atomic_store_explicit(&dev->last_snr, (int8_t)quality[0], memory_order_relaxed);
+   }
 
    return LORA_OK;
 }
 
-lora_status_t lora_received(bool *received, bool *crc_error)
+lora_status_t lora_receive_packet(lora_dev_t *dev, uint8_t *buf, uint8_t *return_len, uint8_t size)
+{
+   LORA_LOCK(dev);
+   lora_status_t ret = lora_receive_packet_locked(dev, buf, return_len, size);
+   LORA_UNLOCK(dev);
+
+   return ret;
+}
+
+lora_status_t lora_received(lora_dev_t *dev, bool *received, bool *crc_error)
 {
    uint8_t reg_val;
-   if (lora_read_reg(REG_IRQ_FLAGS, &reg_val) != LORA_OK)
+
+   LORA_LOCK(dev);
+   if (lora_read_reg(dev, REG_IRQ_FLAGS, &reg_val) != LORA_OK)
    {
+      LORA_UNLOCK(dev);
       return LORA_FAIL;
    }
 
@@ -557,7 +3451,8 @@ lora_status_t lora_received(bool *received, bool *crc_error)
       if (reg_val & IRQ_PAYLOAD_CRC_ERROR)
       {
          *crc_error = true;
-         lora_write_reg(REG_IRQ_FLAGS, IRQ_PAYLOAD_CRC_ERROR_MASK);
+         lora_stats_add(dev, &dev->stats.crc_errors, 1);
+         lora_write_reg(dev, REG_IRQ_FLAGS, IRQ_PAYLOAD_CRC_ERROR_MASK);
       }
       else
       {
@@ -568,14 +3463,15 @@ lora_status_t lora_received(bool *received, bool *crc_error)
    {
       *received = false;
    }
+   LORA_UNLOCK(dev);
 
    return LORA_OK;
 }
 
-lora_status_t lora_get_irq(uint8_t *irq_flags)
+lora_status_t lora_get_irq(lora_dev_t *dev, uint8_t *irq_flags)
 {
    uint8_t reg_val;
-   if (lora_read_reg(REG_IRQ_FLAGS, &reg_val) != LORA_OK)
+   if (lora_read_reg(dev, REG_IRQ_FLAGS, &reg_val) != LORA_OK)
    {
       return LORA_FAIL;
    }
@@ -584,38 +3480,47 @@ lora_status_t lora_get_irq(uint8_t *irq_flags)
    return LORA_OK;
 }
 
-uint8_t lora_packet_lost(void)
+uint64_t lora_tx_timestamp(lora_dev_t *dev)
 {
-   return (__send_packet_lost);
+   return dev->tx_done_us;
 }
 
-lora_status_t lora_packet_rssi(uint8_t *rssi)
+uint8_t lora_packet_lost(lora_dev_t *dev)
 {
-   uint8_t reg_val;
-   if (lora_read_reg(REG_PKT_RSSI_VALUE, &reg_val) != LORA_OK)
-   {
-      return LORA_FAIL;
-   }
+   return (uint8_t)atomic_load_explicit(&dev->send_packet_lost, memory_order_relaxed);
+}
 
-   *rssi = reg_val - (__frequency < 868E6 ? 164 : 157);
+lora_status_t lora_packet_rssi(lora_dev_t *dev, int16_t *rssi)
+{
+   *rssi = (int16_t)atomic_load_explicit(&dev->last_rssi, memory_order_relaxed);
    return LORA_OK;
 }
 
-lora_status_t lora_packet_snr(uint8_t *snr)
+lora_status_t lora_current_rssi(lora_dev_t *dev, int16_t *rssi)
 {
    uint8_t reg_val;
-   if (lora_read_reg(REG_PKT_SNR_VALUE, &reg_val) != LORA_OK)
+
+   if (LORA_OK != lora_read_reg(dev, REG_RSSI_VALUE, &reg_val))
    {
       return LORA_FAIL;
    }
 
-   *snr = ((uint8_t)reg_val) * 0.25;
+   *rssi = (int16_t)reg_val - dev->rssi_offset;
+   return LORA_OK;
+}
+
+lora_status_t lora_packet_snr(lora_dev_t *dev, int8_t *snr)
+{
+   /* The register holds the SNR in quarter dB, two's complement. */
+   int8_t reg_val = (int8_t)atomic_load_explicit(&dev->last_snr, memory_order_relaxed);
+
+   *snr = reg_val / 4;
    return LORA_OK;
 }
 
-void lora_close(void)
+void lora_close(lora_dev_t *dev)
 {
-   lora_sleep_mode();
+   lora_sleep_mode(dev);
    //   close(__spi);  FIXME: end hardware features after lora_close
    //   close(__cs);
    //   close(__rst);
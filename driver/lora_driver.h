@@ -11,258 +11,1068 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <sys/uio.h>
 #include "lora_driver_defs.h"
+#include "lora_airtime.h"
+#include "api/driver_api.h"
 
 #ifdef __cplusplus
 extern "C"
 {
 #endif
 
-    /** @brief Implicit header mode indicator. */
-    extern uint8_t __implicit;
-    /** @brief Frequency of the LoRa module. */
-    extern long __frequency;
-    /** @brief Counter for lost packets during send operation. */
-    extern uint8_t __send_packet_lost;
+    /**
+     * @brief Driver state of one radio, allocated by lora_dev_create().
+     */
+    typedef struct lora_dev lora_dev_t;
+
+    /**
+     * @brief Completion callback of an asynchronous send.
+     * @param status LORA_OK when TxDone was raised (and, for a confirmed send, the
+     *               acknowledgement received), LORA_TX_TIMEOUT when it was not raised
+     *               in time, LORA_NO_ACK when no attempt of a confirmed send was
+     *               acknowledged, or the SPI error that prevented the transmission.
+     * @param timestamp_us lora_time_us() captured by the DIO0 interrupt when TxDone
+     *                     was raised, or when the failure was detected.
+     * @param ctx User context passed to lora_send_packet_async().
+     */
+    typedef void (*lora_tx_cb_t)(lora_status_t status, uint64_t timestamp_us, void *ctx);
+
+    /**
+     * @brief Packet record stored by the streaming receive engine.
+     */
+    typedef struct
+    {
+        uint8_t payload[LORA_MAX_PAYLOAD]; /**< Packet data. */
+        uint8_t len;                       /**< Number of valid bytes in payload. */
+        int16_t rssi;                      /**< Packet RSSI in dBm. */
+        int8_t snr;                        /**< Packet SNR in dB. */
+        uint64_t timestamp_us;             /**< lora_time_us() captured by the DIO0 interrupt on RxDone. */
+    } lora_rx_packet_t;
+
+    /**
+     * @brief Acknowledgement expected by lora_send_confirmed_async().
+     */
+    typedef struct
+    {
+        const uint8_t *ack;     /**< Bytes the reply has to start with, e.g. an ACK type and sequence number. */
+        uint8_t ack_len;        /**< Length of ack, at most LORA_ACK_MAX_LEN. */
+        uint8_t retries;        /**< Retransmissions after the first attempt. */
+        uint32_t turnaround_us; /**< Longest delay from our TxDone to the start of the reply. */
+        uint32_t backoff_ms;    /**< Wait before the first retransmission, doubled for each further one. */
+    } lora_confirm_t;
+
+    /**
+     * @brief Complete radio configuration applied by lora_apply_profile().
+     */
+    typedef struct
+    {
+        long frequency;           /**< Carrier frequency in Hz. */
+        uint8_t spreading_factor; /**< Spreading factor (6-12). */
+        uint8_t bandwidth;        /**< Signal bandwidth (0 to 9). */
+        uint8_t coding_rate;      /**< Denominator for the coding rate 4/x (5-8). */
+        long preamble_length;     /**< Preamble length in symbols. */
+        uint8_t sync_word;        /**< Sync word. */
+        bool crc;                 /**< Append/verify packet CRC. */
+        uint8_t tx_power;         /**< Power level (2-17). */
+    } lora_radio_profile_t;
+
+    /**
+     * @brief Register values of a profile, ready to be written.
+     *
+     * Built by lora_profile_image() at run time, or at compile time by
+     * lora::fixed_profile in lora_driver.hpp. Only the bits owned by the profile
+     * are set; lora_apply_profile_image() keeps the header mode, symbol timeout
+     * and AGC bits of the radio.
+     */
+    typedef struct
+    {
+        long frequency;                                          /**< Carrier frequency in Hz. */
+        uint8_t rf[REG_PA_CONFIG - REG_FRF_MSB + 1];             /**< REG_FRF_MSB..REG_PA_CONFIG. */
+        uint8_t modem[REG_PREAMBLE_LSB - REG_MODEM_CONFIG_1 + 1]; /**< REG_MODEM_CONFIG_1..REG_PREAMBLE_LSB. */
+        uint8_t modem_config_3;                                  /**< Low data rate optimization bit of REG_MODEM_CONFIG_3. */
+        uint8_t detection_optimize;                              /**< REG_DETECTION_OPTIMIZE. */
+        uint8_t detection_threshold;                             /**< REG_DETECTION_THRESHOLD. */
+        uint8_t sync_word;                                       /**< REG_SYNC_WORD. */
+        int16_t rssi_offset;                                     /**< Subtracted from REG_PKT_RSSI_VALUE to get dBm. */
+    } lora_profile_image_t;
+
+#if LORA_CONFIG_CHANNEL_PLAN
+    /**
+     * @brief Channels for retuning, hopping and scanning, built once by lora_channel_plan_init().
+     *
+     * The FRF value of each channel is precomputed, so switching channels is a
+     * single 3-byte burst without arithmetic. Both ends of a link that build
+     * the plan from the same frequencies and seed share the hop order.
+     */
+    typedef struct
+    {
+        uint8_t n_channels;                    /**< Channels in the plan. */
+        long frequency[LORA_MAX_CHANNELS];     /**< Carrier frequency in Hz. */
+        uint8_t frf[LORA_MAX_CHANNELS][3];     /**< REG_FRF_MSB..REG_FRF_LSB of each channel. */
+        uint8_t order[LORA_MAX_CHANNELS];      /**< Pseudorandom hop order, a permutation of the channels. */
+    } lora_channel_plan_t;
+#endif
+
+#if LORA_CONFIG_SCAN
+    /**
+     * @brief RSSI histograms of the channels of a plan, filled by lora_scan_sweep().
+     *
+     * Bucket b of a channel counts the samples from floor_dbm + b * bucket_db
+     * up to the next bucket; the first one also takes everything below, the
+     * last one everything above. Counts add up over sweeps until the caller
+     * clears them.
+     */
+    typedef struct
+    {
+        uint32_t *counts;  /**< n_channels * n_buckets counters, channel after channel, supplied by the caller. */
+        uint8_t n_buckets; /**< Buckets per channel. */
+        uint8_t bucket_db; /**< Width of a bucket in dB. */
+        int16_t floor_dbm; /**< Lower edge of the first bucket in dBm. */
+        uint8_t samples;   /**< RSSI samples per channel and sweep. */
+        uint32_t sweeps;   /**< Sweeps completed. */
+    } lora_scan_t;
+#endif
+
+#if LORA_CONFIG_WARM
+    /**
+     * @brief Configuration kept across MCU deep sleep, for lora_driver_init_warm().
+     *
+     * Meant to live in memory that survives deep sleep (e.g. ESP32 RTC memory).
+     * Filled by lora_warm_save(); a block that was never saved or is corrupted
+     * fails the signature check and leads to a cold initialization.
+     */
+    typedef struct
+    {
+        uint32_t signature;              /**< Checksum of the fields below. */
+        long frequency;                  /**< Carrier frequency in Hz. */
+        uint8_t fifo_split;              /**< FIFO split set by lora_set_fifo_split(). */
+        uint8_t regs[REG_VERSION + 1];   /**< Register image of the radio. */
+    } lora_warm_state_t;
+#endif
+
+    /**
+     * @brief Time the radio spent in each state since the device was created.
+     */
+    typedef struct
+    {
+        uint64_t sleep_us;     /**< Time in sleep. */
+        uint64_t standby_us;   /**< Time in standby. */
+        uint64_t cad_us;       /**< Time running Channel Activity Detection. */
+        uint64_t rx_us;        /**< Time in continuous or single RX. */
+        uint64_t tx_us;        /**< Time transmitting. */
+        uint32_t cad_count;    /**< Number of CAD runs. */
+        uint32_t cad_detected; /**< Number of CAD runs that detected a preamble. */
+    } lora_state_times_t;
+
+    /**
+     * @brief Driver counters and latency histograms, see lora_get_stats().
+     *
+     * Histogram bucket i counts samples from 2^i to 2^(i+1) - 1 us; bucket 0
+     * also counts 0 and the last bucket everything above. The histograms are
+     * only present with LORA_CONFIG_STATS_HIST.
+     */
+    typedef struct
+    {
+        uint32_t tx_frames;            /**< Frames sent, blocking and queued. */
+        uint32_t rx_frames;            /**< Frames read out of the FIFO. */
+        uint32_t crc_errors;           /**< Frames with a bad CRC, including those seen by lora_received(). */
+        uint32_t tx_timeouts;          /**< Transmissions that missed TxDone. */
+        uint32_t tx_retries;           /**< Retransmissions of confirmed sends. */
+        uint32_t ack_failures;         /**< Confirmed sends given up without an acknowledgement. */
+        uint32_t rx_timeouts;          /**< lora_receive_single() windows without a frame. */
+        uint32_t rx_overruns;          /**< Frames dropped: RX ring full or longer than LORA_MAX_PAYLOAD. */
+        uint32_t spi_write_errors;     /**< Failed single register writes. */
+        uint32_t spi_write_buf_errors; /**< Failed burst or staged writes. */
+        uint32_t spi_read_errors;      /**< Failed single register reads. */
+        uint32_t spi_read_buf_errors;  /**< Failed burst or staged reads. */
+        uint32_t spi_bytes;            /**< Bytes moved over SPI, address bytes included. */
+#if LORA_CONFIG_STATS_HIST
+        uint32_t tx_airtime_hist[LORA_STATS_HIST_BUCKETS];      /**< TX start to TxDone. */
+        uint32_t tx_done_latency_hist[LORA_STATS_HIST_BUCKETS]; /**< TxDone interrupt to completion by the driver. */
+        uint32_t rx_read_latency_hist[LORA_STATS_HIST_BUCKETS]; /**< RxDone interrupt to the frame read out of the FIFO. */
+#endif
+    } lora_stats_t;
+
+    /**
+     * @brief Static memory of the driver in the current build configuration, see lora_config.h.
+     */
+    typedef struct
+    {
+        size_t device;   /**< One device, everything below included. */
+        size_t rx_ring;  /**< Receive ring of one device. */
+        size_t tx_queue; /**< Transmit queue of one device. */
+        size_t stats;    /**< Counters and histograms of one device. */
+        size_t pool;     /**< The whole device pool, LORA_MAX_DEVICES devices. */
+    } lora_footprint_t;
+
+    /**
+     * @brief Register file captured by lora_snapshot() with the modem settings decoded.
+     */
+    typedef struct
+    {
+        uint8_t regs[REG_VERSION + 1]; /**< Raw registers 0x01 to REG_VERSION; regs[0] (FIFO) is not read. */
+        bool long_range_mode;          /**< LoRa mode selected. */
+        uint8_t mode;                  /**< Operating mode (MODE_SLEEP to MODE_CAD). */
+        long frequency;                /**< Carrier frequency in Hz. */
+        uint8_t pa_config;             /**< Raw PA configuration. */
+        uint8_t bandwidth;             /**< Signal bandwidth (0 to 9). */
+        uint8_t coding_rate;           /**< Denominator for the coding rate 4/x (5-8). */
+        bool implicit_header;          /**< Implicit header mode. */
+        uint8_t spreading_factor;      /**< Spreading factor (6-12). */
+        bool crc;                      /**< Payload CRC enabled. */
+        uint16_t symb_timeout;         /**< RX_SINGLE timeout in symbols. */
+        uint16_t preamble_length;      /**< Preamble length in symbols. */
+        uint8_t payload_length;        /**< Payload length register. */
+        bool low_data_rate;            /**< Low data rate optimization enabled. */
+        bool agc_auto;                 /**< Automatic gain control enabled. */
+        uint8_t sync_word;             /**< Sync word. */
+        uint8_t irq_flags;             /**< Pending IRQ flags. */
+        uint8_t dio_mapping[2];        /**< DIO mapping registers 1 and 2. */
+        uint8_t version;               /**< Chip version, 0x12 for SX1276/77/78/79. */
+    } lora_snapshot_t;
 
     /**
      * @brief Write a value to a register.
+     * @param dev Device handle.
      * @param reg Register index.
      * @param val Value to write.
      * @return lora_status_t Result of the SPI write operation.
      */
-    lora_status_t lora_write_reg(uint8_t reg, uint8_t val);
+    lora_status_t lora_write_reg(lora_dev_t *dev, uint8_t reg, uint8_t val);
 
     /**
      * @brief Write a buffer to a register.
+     * @param dev Device handle.
      * @param reg Register index.
      * @param val Pointer to the buffer to write.
      * @param len Byte length to write.
      * @return lora_status_t Result of the SPI write operation.
      */
-    lora_status_t lora_write_reg_buffer(uint8_t reg, uint8_t *val, uint8_t len);
+    lora_status_t lora_write_reg_buffer(lora_dev_t *dev, uint8_t reg, uint8_t *val, uint8_t len);
 
     /**
      * @brief Read the current value of a register.
+     * @param dev Device handle.
      * @param reg Register index.
      * @param val Pointer to store the read value.
      * @return lora_status_t Result of the SPI read operation.
      */
-    lora_status_t lora_read_reg(uint8_t reg, uint8_t *val);
+    lora_status_t lora_read_reg(lora_dev_t *dev, uint8_t reg, uint8_t *val);
 
     /**
      * @brief Read the current value of a register into a buffer.
+     * @param dev Device handle.
      * @param reg Register index.
      * @param val Buffer to store the read value(s).
      * @param len Byte length to read.
      * @return lora_status_t Result of the SPI read operation.
      */
-    lora_status_t lora_read_reg_buffer(uint8_t reg, uint8_t *val, uint8_t len);
+    lora_status_t lora_read_reg_buffer(lora_dev_t *dev, uint8_t reg, uint8_t *val, uint8_t len);
+
+    /**
+     * @brief Reload the driver's shadow copy of the register file from the radio.
+     *
+     * The configuration setters and getters work from this copy, which is filled
+     * by lora_driver_init() and reloaded by the next operation after a failed
+     * SPI batch. Call this after the radio was reset or written behind the
+     * driver's back.
+     *
+     * @param dev Device handle.
+     * @return lora_status_t Result of the SPI read operation.
+     */
+    lora_status_t lora_cache_resync(lora_dev_t *dev);
 
     /**
      * @brief Configure explicit header mode.
+     * @param dev Device handle.
      * @return lora_status_t Result of operation.
      */
-    lora_status_t lora_explicit_header_mode(void);
+    lora_status_t lora_explicit_header_mode(lora_dev_t *dev);
 
     /**
      * @brief Configure implicit header mode.
+     * @param dev Device handle.
      * @param size Size of the packets.
      * @return lora_status_t Result of operation.
      */
-    lora_status_t lora_implicit_header_mode(uint8_t size);
+    lora_status_t lora_implicit_header_mode(lora_dev_t *dev, uint8_t size);
 
     /**
      * @brief Sets the radio transceiver in idle mode.
+     * @param dev Device handle.
      * @return lora_status_t Result of operation.
      */
-    lora_status_t lora_idle_mode(void);
+    lora_status_t lora_idle_mode(lora_dev_t *dev);
 
     /**
      * @brief Sets the radio transceiver in sleep mode.
+     * @param dev Device handle.
      * @return lora_status_t Result of operation.
      */
-    lora_status_t lora_sleep_mode(void);
+    lora_status_t lora_sleep_mode(lora_dev_t *dev);
 
     /**
      * @brief Sets the radio transceiver in receive mode.
+     * @param dev Device handle.
      * @return lora_status_t Result of operation.
      */
-    lora_status_t lora_receive_mode(void);
+    lora_status_t lora_receive_mode(lora_dev_t *dev);
 
     /**
      * @brief Configure power level for transmission.
+     * @param dev Device handle.
      * @param level Power level (2-17, from least to most power).
      * @return lora_status_t Result of operation.
      */
-    lora_status_t lora_set_tx_power(uint8_t level);
+    lora_status_t lora_set_tx_power(lora_dev_t *dev, uint8_t level);
 
     /**
      * @brief Set carrier frequency.
+     * @param dev Device handle.
      * @param frequency Frequency in Hz.
      * @return lora_status_t Result of operation.
      */
-    lora_status_t lora_set_frequency(long frequency);
+    lora_status_t lora_set_frequency(lora_dev_t *dev, long frequency);
 
     /**
      * @brief Set spreading factor.
+     * @param dev Device handle.
      * @param sf Spreading factor (6-12).
      * @return lora_status_t Result of operation.
      */
-    lora_status_t lora_set_spreading_factor(uint8_t sf);
+    lora_status_t lora_set_spreading_factor(lora_dev_t *dev, uint8_t sf);
 
     /**
      * @brief Get spreading factor.
+     * @param dev Device handle.
      * @param sf Pointer to store the spreading factor.
      * @return lora_status_t Result of operation.
      */
-    lora_status_t lora_get_spreading_factor(uint8_t *sf);
+    lora_status_t lora_get_spreading_factor(lora_dev_t *dev, uint8_t *sf);
 
     /**
      * @brief Set mapping of pins DIO0 to DIO5.
+     * @param dev Device handle.
      * @param dio Number of DIO (0 to 5).
      * @param mode Mode of DIO (0 to 3).
      * @return lora_status_t Result of operation.
      */
-    lora_status_t lora_set_dio_mapping(uint8_t dio, uint8_t mode);
+    lora_status_t lora_set_dio_mapping(lora_dev_t *dev, uint8_t dio, uint8_t mode);
 
     /**
      * @brief Get mapping of pins DIO0 to DIO5.
+     * @param dev Device handle.
      * @param dio Number of DIO (0 to 5).
      * @param mapping Pointer to store mapping mode.
      * @return lora_status_t Result of operation.
      */
-    lora_status_t lora_get_dio_mapping(uint8_t dio, uint8_t *mapping);
+    lora_status_t lora_get_dio_mapping(lora_dev_t *dev, uint8_t dio, uint8_t *mapping);
 
     /**
      * @brief Set bandwidth (bit rate).
+     * @param dev Device handle.
      * @param sbw Signal bandwidth (0 to 9).
      * @return lora_status_t Result of operation.
      */
-    lora_status_t lora_set_bandwidth(uint8_t sbw);
+    lora_status_t lora_set_bandwidth(lora_dev_t *dev, uint8_t sbw);
 
     /**
      * @brief Get bandwidth (bit rate).
+     * @param dev Device handle.
      * @param sbw Pointer to store the signal bandwidth.
      * @return lora_status_t Result of operation.
      */
-    lora_status_t lora_get_bandwidth(uint8_t *sbw);
+    lora_status_t lora_get_bandwidth(lora_dev_t *dev, uint8_t *sbw);
 
     /**
      * @brief Set coding rate.
+     * @param dev Device handle.
      * @param denominator Denominator for the coding rate 4/x.
      * @return lora_status_t Result of operation.
      */
-    lora_status_t lora_set_coding_rate(uint8_t denominator);
+    lora_status_t lora_set_coding_rate(lora_dev_t *dev, uint8_t denominator);
 
     /**
      * @brief Get coding rate.
+     * @param dev Device handle.
      * @param cr Pointer to store coding rate.
      * @return lora_status_t Result of operation.
      */
-    lora_status_t lora_get_coding_rate(uint8_t *cr);
+    lora_status_t lora_get_coding_rate(lora_dev_t *dev, uint8_t *cr);
 
     /**
      * @brief Set the size of preamble.
+     * @param dev Device handle.
      * @param length Preamble length in symbols.
      * @return lora_status_t Result of operation.
      */
-    lora_status_t lora_set_preamble_length(long length);
+    lora_status_t lora_set_preamble_length(lora_dev_t *dev, long length);
 
     /**
      * @brief Get the size of preamble.
+     * @param dev Device handle.
      * @param preamble Pointer to store preamble length.
      * @return lora_status_t Result of operation.
      */
-    lora_status_t lora_get_preamble_length(long *preamble);
+    lora_status_t lora_get_preamble_length(lora_dev_t *dev, long *preamble);
 
     /**
      * @brief Change radio sync word.
+     * @param dev Device handle.
      * @param sw New sync word to use.
      * @return lora_status_t Result of operation.
      */
-    lora_status_t lora_set_sync_word(uint8_t sw);
+    lora_status_t lora_set_sync_word(lora_dev_t *dev, uint8_t sw);
+
+    /**
+     * @brief Apply a complete radio configuration.
+     *
+     * All register values are computed up front and only the ones that differ
+     * from the current configuration are written, using burst writes over
+     * REG_FRF_MSB..REG_PA_CONFIG and REG_MODEM_CONFIG_1..REG_PREAMBLE_LSB.
+     * The radio should be in sleep or standby mode.
+     *
+     * @param dev Device handle.
+     * @param profile Configuration to apply.
+     * @return lora_status_t Result of operation.
+     */
+    lora_status_t lora_apply_profile(lora_dev_t *dev, const lora_radio_profile_t *profile);
+
+    /**
+     * @brief Compute the register image of a profile.
+     *
+     * Out of range values are clamped as by the individual setters. Low data
+     * rate optimization is enabled when a symbol lasts longer than
+     * LORA_LDRO_SYMBOL_US.
+     *
+     * @param profile Configuration to convert.
+     * @param image Filled with the register values.
+     * @return lora_status_t LORA_OK, or LORA_FAIL for an invalid bandwidth.
+     */
+    lora_status_t lora_profile_image(const lora_radio_profile_t *profile, lora_profile_image_t *image);
+
+    /**
+     * @brief Apply a precomputed register image.
+     *
+     * Writes only the registers that differ from the current configuration,
+     * like lora_apply_profile(), without any per-call conversion.
+     *
+     * @param dev Device handle.
+     * @param image Register image from lora_profile_image() or lora::fixed_profile.
+     * @return lora_status_t Result of operation.
+     */
+    lora_status_t lora_apply_profile_image(lora_dev_t *dev, const lora_profile_image_t *image);
 
     /**
      * @brief Enable appending/verifying packet CRC.
+     * @param dev Device handle.
      * @return lora_status_t Result of operation.
      */
-    lora_status_t lora_enable_crc(void);
+    lora_status_t lora_enable_crc(lora_dev_t *dev);
 
     /**
      * @brief Disable appending/verifying packet CRC.
+     * @param dev Device handle.
      * @return lora_status_t Result of operation.
      */
-    lora_status_t lora_disable_crc(void);
+    lora_status_t lora_disable_crc(lora_dev_t *dev);
+
+    /**
+     * @brief Allocate the driver state for a radio.
+     *
+     * Devices come from a static pool of LORA_MAX_DEVICES entries. Every lora_*
+     * call takes the returned handle, so independent radios can be driven from
+     * different tasks.
+     *
+     * @param io SPI, reset and DIO resources of the radio, copied into the device.
+     * @return Device handle, or NULL when the pool is exhausted.
+     */
+    lora_dev_t *lora_dev_create(const api_handle_t *io);
+
+    /**
+     * @brief Return a device to the pool.
+     * @param dev Device handle.
+     */
+    void lora_dev_destroy(lora_dev_t *dev);
 
     /**
      * @brief Perform hardware initialization.
+     * @param dev Device handle.
      * @return lora_status_t Result of initialization.
      */
-    lora_status_t lora_driver_init(void);
+    lora_status_t lora_driver_init(lora_dev_t *dev);
+
+#if LORA_CONFIG_WARM
+    /**
+     * @brief Put the radio to sleep and save its configuration for a warm start.
+     *
+     * The radio keeps its registers in sleep mode, so an MCU waking from deep
+     * sleep can resume with lora_driver_init_warm() instead of
+     * lora_driver_init(). The FIFO content is lost.
+     *
+     * @param dev Device handle.
+     * @param state Filled with the configuration.
+     * @return lora_status_t Result of operation; on failure the state is marked invalid.
+     */
+    lora_status_t lora_warm_save(lora_dev_t *dev, lora_warm_state_t *state);
+
+    /**
+     * @brief Initialize a device from a configuration saved by lora_warm_save().
+     *
+     * One burst read of the register file checks that the radio answers and
+     * what it kept; only the configuration registers that differ from the
+     * saved state are written back, and the reset and version polling of
+     * lora_driver_init() are skipped. Falls back to lora_driver_init() when the
+     * state is invalid or the radio does not answer. The radio is left in
+     * standby mode, as by lora_driver_init().
+     *
+     * @param dev Device handle.
+     * @param state Saved configuration, or NULL for a cold start.
+     * @return lora_status_t Result of initialization.
+     */
+    lora_status_t lora_driver_init_warm(lora_dev_t *dev, const lora_warm_state_t *state);
+#endif
 
     /**
      * @brief Send a packet.
+     *
+     * Waits for TxDone at most the frame's time on air plus a small margin. When
+     * the deadline passes the radio is reset and its configuration restored from
+     * the register cache.
+     *
+     * @param dev Device handle.
      * @param buf Data to be sent.
      * @param size Size of data.
+     * @return lora_status_t Result of send operation, LORA_TX_TIMEOUT when TxDone never came.
+     */
+    lora_status_t lora_send_packet(lora_dev_t *dev, uint8_t *buf, uint8_t size);
+
+    /**
+     * @brief Send a packet gathered from several buffers.
+     *
+     * Each segment is written straight into the FIFO, so header, payload and
+     * MIC do not have to be copied into one contiguous buffer first.
+     *
+     * @param dev Device handle.
+     * @param iov Segments of the packet, at most LORA_MAX_PAYLOAD bytes in total.
+     * @param iovcnt Number of segments.
      * @return lora_status_t Result of send operation.
      */
-    lora_status_t lora_send_packet(uint8_t *buf, uint8_t size);
+    lora_status_t lora_send_packet_iov(lora_dev_t *dev, const struct iovec *iov, uint8_t iovcnt);
+
+#if LORA_CONFIG_BATCH
+    /**
+     * @brief Send several packets back to back.
+     *
+     * The radio stays in standby between the frames instead of going through
+     * sleep, and each frame after the first is loaded and started with one
+     * staged sequence that also clears the previous TxDone. The radio sleeps
+     * after the last frame, or after the first failure.
+     *
+     * @param dev Device handle.
+     * @param frames One buffer per packet, each at most LORA_MAX_PAYLOAD bytes.
+     * @param n Number of packets.
+     * @param sent Set to the number of packets sent, may be NULL.
+     * @return lora_status_t Result of the first failed send, or LORA_OK.
+     */
+    lora_status_t lora_send_batch(lora_dev_t *dev, const struct iovec *frames, uint8_t n, uint8_t *sent);
+#endif
+
+    /**
+     * @brief Split the FIFO between RX and TX.
+     *
+     * Received frames are written from address 0, transmitted frames from
+     * tx_base, so a frame can be preloaded with lora_stage_tx() while receiving.
+     *
+     * @param dev Device handle.
+     * @param tx_base First FIFO address of the TX part, 0 to share the whole FIFO.
+     * @return lora_status_t Result of operation.
+     */
+    lora_status_t lora_set_fifo_split(lora_dev_t *dev, uint8_t tx_base);
+
+    /**
+     * @brief Preload the next frame into the TX part of the FIFO.
+     *
+     * Can be called while receiving or while the previous frame is on air, so
+     * that lora_send_staged() only has to switch the radio to TX. The buffer is
+     * not copied: it must stay valid until lora_send_staged(), since the frame is
+     * written again when a received frame or sleep overwrote the FIFO.
+     *
+     * @param dev Device handle.
+     * @param buf Data to be sent.
+     * @param size Size of data, at most 256 minus the split.
+     * @return lora_status_t Result of operation, LORA_FAILED_SEND_PACKET without a FIFO split,
+     *         LORA_QUEUE_FULL when it does not fit next to the frame on air.
+     */
+    lora_status_t lora_stage_tx(lora_dev_t *dev, uint8_t *buf, uint8_t size);
+
+    /**
+     * @brief Transmit the frame preloaded by lora_stage_tx() and wait for TxDone.
+     * @param dev Device handle.
+     * @return lora_status_t Result of send operation, see lora_send_packet().
+     */
+    lora_status_t lora_send_staged(lora_dev_t *dev);
+
+#if LORA_CONFIG_LBT
+    /**
+     * @brief Run one Channel Activity Detection.
+     *
+     * Puts the radio in MODE_CAD, waits for CadDone and leaves the radio in
+     * standby. Must not be mixed with lora_service().
+     *
+     * @param dev Device handle.
+     * @param busy Set to true when a LoRa preamble was detected on the channel.
+     * @return lora_status_t Result of operation.
+     */
+    lora_status_t lora_cad(lora_dev_t *dev, bool *busy);
+
+    /**
+     * @brief Send a packet once the channel is clear (listen before talk).
+     *
+     * Runs CAD before transmitting. While the channel is busy it backs off for
+     * a random time in a window that starts at the frame's time on air and
+     * doubles on every attempt, then checks again.
+     *
+     * @param dev Device handle.
+     * @param buf Data to be sent.
+     * @param size Size of data.
+     * @param max_attempts Number of CAD attempts, LORA_LBT_DEFAULT_ATTEMPTS is a sensible value.
+     * @return lora_status_t Result of send operation, LORA_CHANNEL_BUSY when every CAD saw activity.
+     */
+    lora_status_t lora_send_packet_lbt(lora_dev_t *dev, uint8_t *buf, uint8_t size, uint8_t max_attempts);
+#endif
+
+    /**
+     * @brief Queue a packet for transmission without waiting for it to be sent.
+     *
+     * Frames are transmitted one after another in queue order by lora_service().
+     * The buffer is not copied and must stay valid until the callback is called.
+     * Must not be mixed with lora_send_packet().
+     *
+     * @param dev Device handle.
+     * @param buf Data to be sent.
+     * @param size Size of data.
+     * @param cb Callback called from lora_service() once the frame is done, may be NULL.
+     * @param ctx User context passed to the callback.
+     * @return lora_status_t LORA_OK when queued, LORA_QUEUE_FULL when all
+     *         LORA_TX_QUEUE_LEN slots are taken.
+     */
+    lora_status_t lora_send_packet_async(lora_dev_t *dev, uint8_t *buf, uint8_t size, lora_tx_cb_t cb, void *ctx);
+
+    /**
+     * @brief Queue a packet gathered from several buffers, see lora_send_packet_async().
+     *
+     * The segment descriptors are copied, the data they point to is not.
+     *
+     * @param dev Device handle.
+     * @param iov Segments of the packet, at most LORA_MAX_PAYLOAD bytes in total.
+     * @param iovcnt Number of segments, at most LORA_TX_IOV_MAX.
+     * @param cb Callback called from lora_service() once the frame is done, may be NULL.
+     * @param ctx User context passed to the callback.
+     * @return lora_status_t LORA_OK when queued, LORA_QUEUE_FULL when all
+     *         LORA_TX_QUEUE_LEN slots are taken.
+     */
+    lora_status_t lora_send_packet_iov_async(lora_dev_t *dev, const struct iovec *iov, uint8_t iovcnt,
+                                             lora_tx_cb_t cb, void *ctx);
+
+#if LORA_CONFIG_ACK
+    /**
+     * @brief Queue a packet that the peer has to acknowledge.
+     *
+     * Runs entirely in lora_service(): once TxDone is raised the radio goes
+     * from standby straight to RX_SINGLE, with a symbol timeout covering the
+     * turnaround of the peer and the preamble of its reply. A reply starting
+     * with the ack bytes completes the send with LORA_OK; it is not put in the
+     * receive ring. Without one the frame is sent again after the backoff,
+     * plus a random part of up to as much again, until the retries are used
+     * up and the callback gets LORA_NO_ACK. Frames behind it in the queue
+     * wait for the outcome.
+     *
+     * @param dev Device handle.
+     * @param iov Segments of the packet, see lora_send_packet_iov_async(); sent again on every retry.
+     * @param iovcnt Number of segments, at most LORA_TX_IOV_MAX.
+     * @param confirm Expected acknowledgement; must stay valid until the callback is called.
+     * @param cb Callback called from lora_service() once the send is acknowledged or given up, may be NULL.
+     * @param ctx User context passed to the callback.
+     * @return lora_status_t LORA_OK when queued, LORA_QUEUE_FULL when all slots are taken,
+     *         LORA_FAIL when ack_len is too long or FHSS is enabled.
+     */
+    lora_status_t lora_send_confirmed_async(lora_dev_t *dev, const struct iovec *iov, uint8_t iovcnt,
+                                            const lora_confirm_t *confirm, lora_tx_cb_t cb, void *ctx);
+#endif
+
+    /**
+     * @brief Compute the time on air of a frame with the current modem settings.
+     * @param dev Device handle.
+     * @param size Payload size in bytes.
+     * @return Time on air in microseconds.
+     */
+    uint32_t lora_time_on_air_us(lora_dev_t *dev, uint8_t size);
+
+    /**
+     * @brief Make the transmit queue respect a duty-cycle budget.
+     *
+     * Before lora_service() starts a queued frame it checks the budget of the
+     * sub-band the frame goes out on and holds the queue until the off-time
+     * left by the previous frames has passed. Blocking lora_send_packet()
+     * calls are not limited.
+     *
+     * @param dev Device handle.
+     * @param dc Budget initialized with lora_duty_cycle_init(), or NULL to disable.
+     */
+    void lora_set_duty_cycle(lora_dev_t *dev, lora_duty_cycle_t *dc);
+
+    /**
+     * @brief Estimate how long a frame queued now would wait before it is sent.
+     *
+     * Adds up the rest of the frame on air and the airtime of the frames ahead
+     * in the transmit queue, and takes the duty-cycle off-time the sub-band of
+     * the next transmit frequency imposes before the frame if that is longer.
+     * The frame's own airtime only delays the frames after it. Meant for
+     * choosing among several radios.
+     *
+     * @param dev Device handle.
+     * @return Wait in microseconds, 0 when the frame would start right away,
+     *         UINT64_MAX when the queue is full or the sub-band is closed.
+     */
+    uint64_t lora_tx_wait_us(lora_dev_t *dev);
+
+#if LORA_CONFIG_CHANNEL_PLAN
+    /**
+     * @brief Build a channel plan.
+     * @param plan Plan to fill.
+     * @param frequencies Channel frequencies in Hz.
+     * @param n Number of channels, 1 to LORA_MAX_CHANNELS.
+     * @param seed Seed of the hop order; 0 keeps the channels in the given order.
+     * @return lora_status_t LORA_OK, or LORA_FAIL for an invalid channel count.
+     */
+    lora_status_t lora_channel_plan_init(lora_channel_plan_t *plan, const long *frequencies, uint8_t n,
+                                         uint32_t seed);
+
+    /**
+     * @brief Tune to a channel of a plan.
+     *
+     * Only the FRF bytes that differ from the current frequency are written,
+     * in one burst.
+     *
+     * @param dev Device handle.
+     * @param plan Channel plan.
+     * @param channel Channel index in the plan.
+     * @return lora_status_t Result of operation.
+     */
+    lora_status_t lora_set_channel(lora_dev_t *dev, const lora_channel_plan_t *plan, uint8_t channel);
+#endif
+
+#if LORA_CONFIG_HOPPING
+    /**
+     * @brief Hop across the channels of a plan.
+     *
+     * With hop_period 0, frames of the transmit queue and blocking sends take
+     * the channels in the hop order, one frame per channel; the duty-cycle
+     * budget is checked against the channel the frame goes out on.
+     *
+     * With hop_period > 0 the modem hops within each frame (FHSS) every
+     * hop_period symbols: FhssChangeChannel on DIO1 moves the radio to the
+     * next channel of the order, from lora_service(). Every frame starts on
+     * the first channel of the order, which also carries the header, and so
+     * does the receiver of the streaming engine after each frame. This needs
+     * DIO1 and is not available to lora_receive_single() or sniff mode.
+     *
+     * The plan is not copied and must stay valid while hopping is enabled.
+     * Call with the radio idle.
+     *
+     * @param dev Device handle.
+     * @param plan Channel plan, or NULL to stop hopping.
+     * @param hop_period Symbols per hop, or 0 to hop per frame.
+     * @return lora_status_t LORA_OK, or LORA_FAIL when FHSS is requested without DIO1.
+     */
+    lora_status_t lora_set_hopping(lora_dev_t *dev, const lora_channel_plan_t *plan, uint8_t hop_period);
+#endif
+
+#if LORA_CONFIG_SCAN
+    /**
+     * @brief Sample the RSSI of every channel of a plan once.
+     *
+     * The radio listens on each channel in turn: it is retuned in standby
+     * with the precomputed FRF bytes, put back in RX and given
+     * LORA_SCAN_SETTLE_US to settle, then the samples of the channel are read
+     * back in bursts of staged reads, so a sweep over 8 channels takes a few
+     * milliseconds. Each
+     * burst also reads REG_RSSI_WIDEBAND, whose noisy low bits are mixed into
+     * the random backoff of lora_send_packet_lbt(). Afterwards the radio is
+     * back on its channel and in the mode it was in; frames arriving during
+     * the sweep are missed. Repeat it between frames to keep track of the
+     * least congested channels.
+     *
+     * @param dev Device handle, asleep, in standby or in the streaming receive engine.
+     * @param plan Channels to scan.
+     * @param scan Histograms to add the samples to.
+     * @return lora_status_t Result of operation, LORA_FAIL while the radio is busy
+     *         transmitting, in a receive window or in CAD.
+     */
+    lora_status_t lora_scan_sweep(lora_dev_t *dev, const lora_channel_plan_t *plan, lora_scan_t *scan);
+
+    /**
+     * @brief Find the channel with the lowest mean RSSI in the histograms.
+     * @param scan Histograms filled by lora_scan_sweep().
+     * @param n_channels Channels of the plan that was scanned.
+     * @param channel Set to the index of the quietest channel.
+     * @return lora_status_t LORA_OK, or LORA_FAIL when there are no samples.
+     */
+    lora_status_t lora_scan_quietest(const lora_scan_t *scan, uint8_t n_channels, uint8_t *channel);
+#endif
+
+    /**
+     * @brief Process radio events and drive the transmit queue.
+     *
+     * Waits up to timeout_ms for a DIO interrupt (or polls the IRQ flags when DIO0
+     * is not wired), completes the frame on air, starts the next queued one and
+     * moves received frames into the receive ring. Meant to be called in a loop
+     * from a single radio task. Transmit callbacks run from here with the device
+     * lock held and should return quickly.
+     *
+     * @param dev Device handle.
+     * @param timeout_ms Maximum time to wait for an event in ms.
+     * @return lora_status_t Result of operation.
+     */
+    lora_status_t lora_service(lora_dev_t *dev, uint32_t timeout_ms);
+
+    /**
+     * @brief Open a single receive window (MODE_RX_SINGLE).
+     *
+     * The modem searches for a preamble for timeout_symbols symbols and then
+     * returns to standby by itself (RxTimeout); once a preamble is found it stays
+     * until the frame is complete. The caller blocks on the DIO interrupts, so
+     * the MCU can sleep through the window; open it just before the expected
+     * frame, e.g. for LoRaWAN RX1/RX2. RxTimeout is only signalled when DIO1
+     * is wired, otherwise it is noticed at deadline_us. Must not be mixed
+     * with lora_service().
+     *
+     * @param dev Device handle.
+     * @param timeout_symbols Preamble search time in symbols (4 to 1023).
+     * @param deadline_us lora_time_us() at which the window is abandoned in any case.
+     * @param pkt Filled with the received frame.
+     * @return lora_status_t LORA_OK, LORA_RX_TIMEOUT when nothing was received or LORA_CRC_ERROR.
+     */
+    lora_status_t lora_receive_single(lora_dev_t *dev, uint16_t timeout_symbols, uint64_t deadline_us,
+                                      lora_rx_packet_t *pkt);
+
+#if LORA_CONFIG_SNIFF
+    /**
+     * @brief Start duty-cycled reception (sniff mode).
+     *
+     * lora_service() keeps the radio asleep and wakes it up for a CAD every
+     * interval. Only when the CAD detects a preamble is an RX_SINGLE window
+     * opened; received frames go to the receive ring. The transmitter must use
+     * a preamble at least as long as the interval for its frames to be caught.
+     * Takes precedence over lora_rx_start() while active.
+     *
+     * @param dev Device handle.
+     * @param interval_ms CAD interval in ms, or 0 to derive it from the
+     *        preamble length set with lora_set_preamble_length().
+     * @return lora_status_t Result of operation, LORA_FAIL when the preamble is too short to sniff.
+     */
+    lora_status_t lora_sniff_start(lora_dev_t *dev, uint32_t interval_ms);
+
+    /**
+     * @brief Stop sniff mode; the radio goes back to sleep after the current step.
+     * @param dev Device handle.
+     * @return lora_status_t Result of operation.
+     */
+    lora_status_t lora_sniff_stop(lora_dev_t *dev);
+#endif
+
+    /**
+     * @brief Report the time spent in each radio state, e.g. to check an energy model.
+     * @param dev Device handle.
+     * @param times Filled with the accumulated times and CAD counters.
+     */
+    void lora_get_state_times(lora_dev_t *dev, lora_state_times_t *times);
+
+#if LORA_CONFIG_RX_RING
+    /**
+     * @brief Start the streaming receive engine.
+     *
+     * lora_service() keeps the radio in MODE_RX_CONTINUOUS with DIO0 mapped to
+     * RxDone and copies every valid frame into an LORA_RX_RING_LEN deep ring.
+     * RX is only left while a queued frame is transmitted.
+     *
+     * @param dev Device handle.
+     * @return lora_status_t Result of operation.
+     */
+    lora_status_t lora_rx_start(lora_dev_t *dev);
+
+    /**
+     * @brief Stop the streaming receive engine and put the radio to sleep.
+     * @param dev Device handle.
+     * @return lora_status_t Result of operation.
+     */
+    lora_status_t lora_rx_stop(lora_dev_t *dev);
+
+    /**
+     * @brief Take packets out of the receive ring.
+     *
+     * Lock-free with respect to lora_service(); must be called from a single
+     * consumer task.
+     *
+     * @param dev Device handle.
+     * @param pkts Array to copy the packets to.
+     * @param max Number of entries in pkts.
+     * @return Number of packets copied.
+     */
+    size_t lora_rx_pop_many(lora_dev_t *dev, lora_rx_packet_t *pkts, size_t max);
+
+    /**
+     * @brief Borrow the oldest packet of the receive ring without copying it.
+     *
+     * The record stays owned by the driver and must be handed back with
+     * lora_rx_return() before the next loan. Same single-consumer rule as
+     * lora_rx_pop_many().
+     *
+     * @param dev Device handle.
+     * @return The oldest packet, or NULL when the ring is empty.
+     */
+    const lora_rx_packet_t *lora_rx_loan(lora_dev_t *dev);
+
+    /**
+     * @brief Give the packet borrowed with lora_rx_loan() back to the receive ring.
+     * @param dev Device handle.
+     */
+    void lora_rx_return(lora_dev_t *dev);
+#endif
+
+    /**
+     * @brief Copy the driver statistics without taking the device lock.
+     * @param dev Device handle.
+     * @param stats Filled with a consistent copy of the counters and histograms.
+     */
+    void lora_get_stats(lora_dev_t *dev, lora_stats_t *stats);
+
+    /**
+     * @brief Clear the driver statistics (the RX overrun count is kept).
+     * @param dev Device handle.
+     */
+    void lora_reset_stats(lora_dev_t *dev);
+
+    /**
+     * @brief Return the number of frames dropped because the receive ring was full
+     *        or they were longer than LORA_MAX_PAYLOAD.
+     * @param dev Device handle.
+     * @return Number of dropped frames.
+     */
+    uint32_t lora_rx_overruns(lora_dev_t *dev);
+
+    /**
+     * @brief Report the static memory the driver uses in this build configuration.
+     * @param footprint Filled with the sizes in bytes.
+     */
+    void lora_get_footprint(lora_footprint_t *footprint);
 
     /**
      * @brief Read a received packet.
+     * @param dev Device handle.
      * @param buf Buffer for the data.
      * @param return_len Pointer to store the number of bytes received.
      * @param size Available size in buffer (bytes).
      * @return lora_status_t Result of receive operation.
      */
-    lora_status_t lora_receive_packet(uint8_t *buf, uint8_t *return_len, uint8_t size);
+    lora_status_t lora_receive_packet(lora_dev_t *dev, uint8_t *buf, uint8_t *return_len, uint8_t size);
 
     /**
      * @brief Check if there is data to read (packet received).
+     * @param dev Device handle.
      * @param received Pointer to store the received status.
      * @param crc_error Pointer to store the CRC error status.
      * @return lora_status_t Result of check.
      */
-    lora_status_t lora_received(bool *received, bool *crc_error);
+    lora_status_t lora_received(lora_dev_t *dev, bool *received, bool *crc_error);
 
     /**
      * @brief Returns RegIrqFlags.
+     * @param dev Device handle.
      * @param irq_flags Pointer to store IRQ flags.
      * @return lora_status_t Result of operation.
      */
-    lora_status_t lora_get_irq(uint8_t *irq_flags);
+    lora_status_t lora_get_irq(lora_dev_t *dev, uint8_t *irq_flags);
+
+    /**
+     * @brief Return the time of the last successful TxDone.
+     *
+     * Captured in the DIO0 interrupt, so its accuracy is the interrupt latency.
+     * Without DIO0 it is the time the flag was polled.
+     *
+     * @param dev Device handle.
+     * @return lora_time_us() value of the last TxDone.
+     */
+    uint64_t lora_tx_timestamp(lora_dev_t *dev);
 
     /**
      * @brief Return lost send packet count.
+     * @param dev Device handle.
      * @return Number of lost packets.
      */
-    uint8_t lora_packet_lost(void);
+    uint8_t lora_packet_lost(lora_dev_t *dev);
 
     /**
      * @brief Return last packet's RSSI.
-     * @param rssi Pointer to store RSSI value.
+     *
+     * Served lock-free from the value captured when the driver last read a
+     * packet (lora_receive_packet() or the receive engine); no SPI access.
+     *
+     * @param dev Device handle.
+     * @param rssi Pointer to store the RSSI in dBm.
      * @return lora_status_t Result of operation.
      */
-    lora_status_t lora_packet_rssi(uint8_t *rssi);
+    lora_status_t lora_packet_rssi(lora_dev_t *dev, int16_t *rssi);
 
     /**
      * @brief Return last packet's SNR (signal to noise ratio).
-     * @param snr Pointer to store SNR value.
+     *
+     * Served lock-free like lora_packet_rssi().
+     *
+     * @param dev Device handle.
+     * @param snr Pointer to store the SNR in dB, rounded toward zero.
+     * @return lora_status_t Result of operation.
+     */
+    lora_status_t lora_packet_snr(lora_dev_t *dev, int8_t *snr);
+
+    /**
+     * @brief Read the RSSI of the channel right now.
+     *
+     * Only meaningful while the radio receives, e.g. with lora_rx_start().
+     *
+     * @param dev Device handle.
+     * @param rssi Pointer to store the RSSI in dBm.
      * @return lora_status_t Result of operation.
      */
-    lora_status_t lora_packet_snr(uint8_t *snr);
+    lora_status_t lora_current_rssi(lora_dev_t *dev, int16_t *rssi);
 
     /**
      * @brief Shutdown hardware.
+     * @param dev Device handle.
+     */
+    void lora_close(lora_dev_t *dev);
+
+    /**
+     * @brief Capture all registers in one SPI burst and decode the modem settings.
+     *
+     * Costs a single transaction and does not touch the FIFO, so it is safe to
+     * call periodically while the radio is in use.
+     *
+     * @param dev Device handle.
+     * @param snap Filled with the raw registers and the decoded fields.
+     * @return lora_status_t Result of operation.
      */
-    void lora_close(void);
+    lora_status_t lora_snapshot(lora_dev_t *dev, lora_snapshot_t *snap);
 
     /**
      * @brief Dump LoRa registers for debugging.
+     * @param dev Device handle.
      * @return lora_status_t Result of dump operation.
      */
-    lora_status_t lora_dump_registers(void);
+    lora_status_t lora_dump_registers(lora_dev_t *dev);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,141 @@
+/**
+ * @file lora_driver.hpp
+ * @brief Compile-time radio profiles for C++ builds of the LoRa driver
+ *
+ * For deployments with fixed radio parameters, lora::fixed_profile computes
+ * the register image of lora_apply_profile() at compile time, validates the
+ * parameters and their combinations with static_assert and converts the packet quality registers
+ * with integer operations only. Header-only, C++11.
+ */
+
+#ifndef _LORA_DRIVER_HPP_
+#define _LORA_DRIVER_HPP_
+
+#include "lora_driver.h"
+
+namespace lora
+{
+    namespace detail
+    {
+        /** @brief Symbol time at SF 0 for each bandwidth, as in lora_airtime.c. */
+        constexpr uint32_t symbol_us_sf0(uint8_t bw)
+        {
+            return bw == 0 ? 128 : bw == 1 ? 96 : bw == 2 ? 64 : bw == 3 ? 48 : bw == 4 ? 32
+                 : bw == 5 ? 24 : bw == 6 ? 16 : bw == 7 ? 8 : bw == 8 ? 4 : 2;
+        }
+    }
+
+    /**
+     * @brief Radio profile fixed at compile time.
+     *
+     * @tparam Frequency Carrier frequency in Hz.
+     * @tparam SpreadingFactor Spreading factor (6-12).
+     * @tparam Bandwidth Signal bandwidth (0 to 9).
+     * @tparam CodingRate Denominator for the coding rate 4/x (5-8).
+     * @tparam PreambleLength Preamble length in symbols.
+     * @tparam SyncWord Sync word.
+     * @tparam Crc Append/verify packet CRC.
+     * @tparam TxPower Power level (2-17).
+     * @tparam ImplicitLength Payload length for implicit header mode, 0 for explicit headers.
+     */
+    template <long Frequency, uint8_t SpreadingFactor, uint8_t Bandwidth, uint8_t CodingRate,
+              uint16_t PreambleLength = 8, uint8_t SyncWord = 0x12, bool Crc = true, uint8_t TxPower = 14,
+              uint8_t ImplicitLength = 0>
+    struct fixed_profile
+    {
+        static_assert(Frequency >= 137000000 && Frequency <= 1020000000, "frequency outside the SX127x range");
+        static_assert(SpreadingFactor >= 6 && SpreadingFactor <= 12, "spreading factor must be 6 to 12");
+        static_assert(Bandwidth <= 9, "bandwidth must be 0 (7.8 kHz) to 9 (500 kHz)");
+        static_assert(CodingRate >= 5 && CodingRate <= 8, "coding rate must be 4/5 to 4/8");
+        static_assert(TxPower >= 2 && TxPower <= 17, "PA_BOOST power must be 2 to 17 dBm");
+        static_assert(PreambleLength >= 6, "the SX127x needs a preamble of at least 6 symbols");
+
+        /** @brief Value of REG_FRF_MSB..REG_FRF_LSB. */
+        static constexpr uint32_t frf = (uint32_t)(((uint64_t)Frequency << 19) / 32000000);
+
+        /** @brief Duration of one symbol in microseconds. */
+        static constexpr uint32_t symbol_time_us = detail::symbol_us_sf0(Bandwidth) << SpreadingFactor;
+
+        /** @brief Low data rate optimization, required above LORA_LDRO_SYMBOL_US per symbol. */
+        static constexpr bool low_data_rate = symbol_time_us > LORA_LDRO_SYMBOL_US;
+
+        /* Combinations the modem does not support. */
+        static_assert(SpreadingFactor != 6 || ImplicitLength > 0, "SF6 only works in implicit header mode");
+        static_assert(Frequency >= 175000000 || Bandwidth < 8, "250 and 500 kHz are not supported in the 169 MHz band");
+
+        /** @brief Subtracted from the RSSI registers to get dBm. */
+        static constexpr int16_t rssi_offset =
+            Frequency < LORA_RSSI_HF_MIN_FREQUENCY ? LORA_RSSI_OFFSET_LF : LORA_RSSI_OFFSET_HF;
+
+        /**
+         * @brief Register image, identical to what lora_profile_image() computes.
+         * @return Image for lora_apply_profile_image().
+         */
+        static constexpr lora_profile_image_t image()
+        {
+            return lora_profile_image_t{
+                Frequency,
+                {(uint8_t)(frf >> 16), (uint8_t)(frf >> 8), (uint8_t)frf, (uint8_t)(PA_BOOST | (TxPower - 2))},
+                {(uint8_t)((Bandwidth << 4) | ((CodingRate - 4) << 1)),
+                 (uint8_t)((SpreadingFactor << 4) | (Crc ? 0x04 : 0x00)),
+                 0,
+                 (uint8_t)(PreambleLength >> 8),
+                 (uint8_t)PreambleLength},
+                (uint8_t)(low_data_rate ? 0x08 : 0x00),
+                (uint8_t)(6 == SpreadingFactor ? 0xc5 : 0xc3),
+                (uint8_t)(6 == SpreadingFactor ? 0x0c : 0x0a),
+                SyncWord,
+                rssi_offset,
+            };
+        }
+
+        /**
+         * @brief Apply the profile with burst writes of the precomputed image.
+         *
+         * With ImplicitLength set the radio is also switched to implicit
+         * header mode; otherwise the header mode is left alone.
+         *
+         * @param dev Device handle.
+         * @return lora_status_t Result of operation.
+         */
+        static lora_status_t apply(lora_dev_t *dev)
+        {
+            static constexpr lora_profile_image_t img = image();
+            lora_status_t ret = lora_apply_profile_image(dev, &img);
+            return (LORA_OK == ret && ImplicitLength > 0) ? lora_implicit_header_mode(dev, ImplicitLength) : ret;
+        }
+
+        /**
+         * @brief Initialize the radio and apply the profile.
+         * @param dev Device handle.
+         * @return lora_status_t Result of operation.
+         */
+        static lora_status_t init(lora_dev_t *dev)
+        {
+            lora_status_t ret = lora_driver_init(dev);
+            return LORA_OK == ret ? apply(dev) : ret;
+        }
+
+        /**
+         * @brief Convert REG_PKT_RSSI_VALUE or REG_RSSI_VALUE to dBm.
+         * @param reg Register value.
+         * @return RSSI in dBm.
+         */
+        static constexpr int16_t rssi_dbm(uint8_t reg)
+        {
+            return (int16_t)(reg - rssi_offset);
+        }
+
+        /**
+         * @brief Convert REG_PKT_SNR_VALUE to dB.
+         * @param reg Register value, two's complement in quarter dB.
+         * @return SNR in dB, rounded toward zero.
+         */
+        static constexpr int8_t snr_db(uint8_t reg)
+        {
+            return (int8_t)((int8_t)reg / 4);
+        }
+    };
+}
+
+#endif // _LORA_DRIVER_HPP_
@@ -1,6 +1,8 @@
 #ifndef _LORA_DRIVER_DEFS_H_
 #define _LORA_DRIVER_DEFS_H_
 
+#include "lora_config.h"
+
 /**
  * @brief Enum for the status of the LoRa module.
  *
@@ -22,6 +24,11 @@ typedef enum
     LORA_FAILED_RECEIVE_PACKET,  /**< The packet receiving operation failed. */
     LORA_DELAY_FAIL,             /**< The delay operation failed. */
     LORA_CRC_ERROR,              /**< The CRC check failed. */
+    LORA_TX_TIMEOUT,             /**< TxDone was not raised before the transmit deadline. */
+    LORA_QUEUE_FULL,             /**< The transmit queue has no free slot. */
+    LORA_CHANNEL_BUSY,           /**< Channel activity was detected on every attempt. */
+    LORA_RX_TIMEOUT,             /**< No frame was received within the receive window. */
+    LORA_NO_ACK,                 /**< A confirmed send was not acknowledged after its last retry. */
 } lora_status_t;
 
 /*
@@ -38,15 +45,19 @@ typedef enum
 #define REG_FIFO_TX_BASE_ADDR 0x0e
 #define REG_FIFO_RX_BASE_ADDR 0x0f
 #define REG_FIFO_RX_CURRENT_ADDR 0x10
+#define REG_IRQ_FLAGS_MASK 0x11
 #define REG_IRQ_FLAGS 0x12
 #define REG_RX_NB_BYTES 0x13
 #define REG_PKT_SNR_VALUE 0x19
 #define REG_PKT_RSSI_VALUE 0x1a
+#define REG_RSSI_VALUE 0x1b
 #define REG_MODEM_CONFIG_1 0x1d
 #define REG_MODEM_CONFIG_2 0x1e
+#define REG_SYMB_TIMEOUT_LSB 0x1f
 #define REG_PREAMBLE_MSB 0x20
 #define REG_PREAMBLE_LSB 0x21
 #define REG_PAYLOAD_LENGTH 0x22
+#define REG_HOP_PERIOD 0x24
 #define REG_MODEM_CONFIG_3 0x26
 #define REG_RSSI_WIDEBAND 0x2c
 #define REG_DETECTION_OPTIMIZE 0x31
@@ -66,6 +77,7 @@ typedef enum
 #define MODE_TX 0x03
 #define MODE_RX_CONTINUOUS 0x05
 #define MODE_RX_SINGLE 0x06
+#define MODE_CAD 0x07
 
 /*
  * PA configuration
@@ -79,6 +91,25 @@ typedef enum
 #define IRQ_PAYLOAD_CRC_ERROR_MASK 0x20
 #define IRQ_RX_DONE_MASK 0x40
 #define IRQ_PAYLOAD_CRC_ERROR 0x20
+#define IRQ_CAD_DETECTED_MASK 0x01
+#define IRQ_CAD_DONE_MASK 0x04
+#define IRQ_VALID_HEADER_MASK 0x10
+#define IRQ_RX_TIMEOUT_MASK 0x80
+#define IRQ_FHSS_CHANGE_CHANNEL_MASK 0x02
+
+/*
+ * DIO0 mappings
+ */
+#define DIO0_RX_DONE 0x00
+#define DIO0_TX_DONE 0x01
+#define DIO0_CAD_DONE 0x02
+
+/*
+ * DIO1 mappings
+ */
+#define DIO1_RX_TIMEOUT 0x00
+#define DIO1_FHSS_CHANGE_CHANNEL 0x01
+
 #define PA_OUTPUT_RFO_PIN 0
 #define PA_OUTPUT_PA_BOOST_PIN 1
 
@@ -89,6 +120,57 @@ typedef enum
 #define LORA_DELAY_20MS 20
 
 #define TIMEOUT_RESET 100
+/* TxDone deadline: time on air plus 1/16 of it for clock tolerance plus a fixed margin. */
+#define TIMEOUT_TX_MARGIN_US 20000
+/* CadDone deadline: a CAD takes about two symbols, wait for four plus a margin. */
+#define TIMEOUT_CAD_SYMBOLS 4
+#define TIMEOUT_CAD_MARGIN_US 5000
+
+/*
+ * Listen before talk
+ */
+#define LORA_LBT_DEFAULT_ATTEMPTS 5
+
+/*
+ * Statistics: lock-free snapshot attempts before lora_get_stats() falls back to the lock.
+ */
+#define LORA_STATS_READ_TRIES 4
+
+/*
+ * Sniff mode: symbols of the preamble reserved for waking up and the CAD
+ * itself, and symbols the header may take to show up once the preamble locked.
+ */
+#define LORA_SNIFF_GUARD_SYMBOLS 4
+#define LORA_SNIFF_HEADER_SYMBOLS 16
+
+/*
+ * Confirmed send: longest acknowledgement prefix matched against the reply,
+ * and the cap on backoff doublings.
+ */
+#define LORA_ACK_MAX_LEN 16
+#define LORA_ACK_MAX_BACKOFF_SHIFT 8
+
+/*
+ * Transfers staged on the transport before a flush. Pool sizes are set in
+ * lora_config.h.
+ */
+#define LORA_MAX_STAGED (7 + LORA_TX_IOV_MAX)
+
+/*
+ * Scan: RSSI reads staged per flush next to the wideband sample, and the time
+ * from entering RX on a channel until its RSSI is valid: the PLL lock of
+ * 60 us plus the receiver start-up.
+ */
+#define LORA_SCAN_BATCH (LORA_MAX_STAGED - 1)
+#define LORA_SCAN_SETTLE_US 150
+
+/*
+ * Profile register image
+ */
+#define LORA_LDRO_SYMBOL_US 16000
+#define LORA_RSSI_OFFSET_LF 164
+#define LORA_RSSI_OFFSET_HF 157
+#define LORA_RSSI_HF_MIN_FREQUENCY 868000000
 
 #define LORA_TAG "LORA_DRIVER"
 
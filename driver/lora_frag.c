@@ -0,0 +1,268 @@
+#include <string.h>
+#include "lora_frag.h"
+
+static void lora_frag_tx_done(lora_status_t status, uint64_t timestamp_us, void *ctx);
+
+/*
+ * Queue fragments while the window has room. Fragments complete in queue
+ * order, so fragment i owns header slot i % LORA_FRAG_TX_WINDOW.
+ */
+static lora_status_t lora_frag_tx_fill(lora_frag_tx_t *tx)
+{
+   lora_status_t ret = LORA_OK;
+
+   while (LORA_OK == tx->status && tx->queued < tx->count && tx->queued - tx->completed < LORA_FRAG_TX_WINDOW)
+   {
+      uint8_t index = tx->queued;
+      uint8_t *header = tx->headers[index % LORA_FRAG_TX_WINDOW];
+      size_t offset = (size_t)index * tx->chunk;
+      size_t left = tx->len - offset;
+
+      header[0] = tx->id;
+      header[1] = index;
+      header[2] = tx->count;
+      header[3] = tx->chunk;
+
+      struct iovec iov[2] = {
+          {.iov_base = header, .iov_len = LORA_FRAG_HEADER_LEN},
+          {.iov_base = (void *)(tx->msg + offset), .iov_len = left < tx->chunk ? left : tx->chunk},
+      };
+
+      ret = lora_send_packet_iov_async(tx->dev, iov, 2, lora_frag_tx_done, tx);
+      if (LORA_OK != ret)
+      {
+         /* Retried when the next fragment of ours completes. */
+         break;
+      }
+      tx->queued++;
+   }
+
+   return ret;
+}
+
+static void lora_frag_tx_done(lora_status_t status, uint64_t timestamp_us, void *ctx)
+{
+   lora_frag_tx_t *tx = ctx;
+
+   (void)timestamp_us;
+   tx->completed++;
+   if (LORA_OK != status && LORA_OK == tx->status)
+   {
+      tx->status = status;
+   }
+
+   lora_frag_tx_fill(tx);
+   if (tx->completed == tx->queued)
+   {
+      if (LORA_OK == tx->status && tx->queued < tx->count)
+      {
+         /* Nothing of ours left in flight to retry from: other senders hold the queue. */
+         tx->status = LORA_QUEUE_FULL;
+      }
+      tx->busy = false;
+      if (tx->cb)
+      {
+         tx->cb(tx->status, tx->ctx);
+      }
+   }
+}
+
+lora_status_t lora_frag_tx_init(lora_frag_tx_t *tx, lora_dev_t *dev, uint8_t chunk)
+{
+   if (0 == chunk || chunk > LORA_FRAG_MAX_CHUNK)
+   {
+      return LORA_FAIL;
+   }
+
+   memset(tx, 0, sizeof(*tx));
+   tx->dev = dev;
+   tx->chunk = chunk;
+   tx->id = (uint8_t)lora_time_us();
+
+   return LORA_OK;
+}
+
+lora_status_t lora_frag_send(lora_frag_tx_t *tx, const uint8_t *msg, size_t len, lora_frag_done_cb_t cb, void *ctx)
+{
+   size_t count = (len + tx->chunk - 1) / tx->chunk;
+
+   if (tx->busy || 0 == count || count > UINT8_MAX)
+   {
+      return LORA_FAIL;
+   }
+
+   tx->msg = msg;
+   tx->len = len;
+   tx->id++;
+   tx->count = (uint8_t)count;
+   tx->queued = 0;
+   tx->completed = 0;
+   tx->status = LORA_OK;
+   tx->cb = cb;
+   tx->ctx = ctx;
+   tx->busy = true;
+
+   lora_status_t ret = lora_frag_tx_fill(tx);
+   if (0 == tx->queued)
+   {
+      tx->busy = false;
+      return ret;
+   }
+
+   return LORA_OK;
+}
+
+void lora_frag_rx_init(lora_frag_rx_t *rx, uint64_t timeout_us, lora_frag_msg_cb_t cb, void *ctx)
+{
+   for (uint8_t i = 0; i < LORA_FRAG_RX_SLOTS; i++)
+   {
+      rx->slots[i].in_use = false;
+   }
+   rx->timeout_us = timeout_us ? timeout_us : LORA_FRAG_RX_TIMEOUT_US;
+   rx->dropped = 0;
+   rx->cb = cb;
+   rx->ctx = ctx;
+}
+
+void lora_frag_rx_expire(lora_frag_rx_t *rx, uint64_t now_us)
+{
+   for (uint8_t i = 0; i < LORA_FRAG_RX_SLOTS; i++)
+   {
+      lora_frag_slot_t *slot = &rx->slots[i];
+
+      if (slot->in_use && now_us > slot->updated_us + rx->timeout_us)
+      {
+         slot->in_use = false;
+         rx->dropped++;
+      }
+   }
+}
+
+/*
+ * Slot of the message a fragment belongs to; a new message takes a free slot
+ * or evicts the one updated least recently.
+ */
+static lora_frag_slot_t *lora_frag_rx_slot(lora_frag_rx_t *rx, const uint8_t *header)
+{
+   lora_frag_slot_t *slot = NULL;
+
+   for (uint8_t i = 0; i < LORA_FRAG_RX_SLOTS; i++)
+   {
+      lora_frag_slot_t *s = &rx->slots[i];
+
+      if (s->in_use && s->id == header[0])
+      {
+         if (s->count == header[2] && s->chunk == header[3])
+         {
+            return s;
+         }
+         /* Same id, different shape: the sender moved on to a new message. */
+         rx->dropped++;
+         slot = s;
+         break;
+      }
+      if (NULL == slot || (slot->in_use && (!s->in_use || s->updated_us < slot->updated_us)))
+      {
+         slot = s;
+      }
+   }
+
+   if (slot->in_use && slot->id != header[0])
+   {
+      rx->dropped++;
+   }
+
+   memset(slot->seen, 0, sizeof(slot->seen));
+   slot->in_use = true;
+   slot->id = header[0];
+   slot->count = header[2];
+   slot->chunk = header[3];
+   slot->received = 0;
+   slot->len = 0;
+
+   return slot;
+}
+
+lora_status_t lora_frag_rx_feed(lora_frag_rx_t *rx, const uint8_t *frame, uint8_t len, uint64_t now_us)
+{
+   if (len <= LORA_FRAG_HEADER_LEN)
+   {
+      return LORA_FAIL;
+   }
+
+   uint8_t index = frame[1];
+   uint8_t count = frame[2];
+   uint8_t chunk = frame[3];
+   uint8_t size = len - LORA_FRAG_HEADER_LEN;
+   bool last = (index + 1 == count);
+
+   if (index >= count || size > chunk || (!last && size != chunk))
+   {
+      return LORA_FAIL;
+   }
+
+   lora_frag_rx_expire(rx, now_us);
+
+   if ((size_t)(count - 1) * chunk + 1 > LORA_FRAG_MAX_MESSAGE)
+   {
+      /* Counted once per message, on its first fragment. */
+      if (0 == index)
+      {
+         rx->dropped++;
+      }
+      return LORA_OK;
+   }
+
+   size_t offset = (size_t)index * chunk;
+   if (offset + size > LORA_FRAG_MAX_MESSAGE)
+   {
+      /* A last fragment running past the buffer: the message can never complete. */
+      rx->dropped++;
+      return LORA_OK;
+   }
+
+   lora_frag_slot_t *slot = lora_frag_rx_slot(rx, frame);
+   slot->updated_us = now_us;
+
+   uint32_t bit = 1u << (index & 31);
+   if (slot->seen[index >> 5] & bit)
+   {
+      return LORA_OK;
+   }
+   slot->seen[index >> 5] |= bit;
+   slot->received++;
+
+   memcpy(&slot->buf[offset], &frame[LORA_FRAG_HEADER_LEN], size);
+   if (last)
+   {
+      slot->len = offset + size;
+   }
+
+   if (slot->received == slot->count)
+   {
+      if (rx->cb)
+      {
+         rx->cb(slot->buf, slot->len, slot->id, rx->ctx);
+      }
+      slot->in_use = false;
+   }
+
+   return LORA_OK;
+}
+
+#if LORA_CONFIG_RX_RING
+size_t lora_frag_rx_drain(lora_frag_rx_t *rx, lora_dev_t *dev)
+{
+   const lora_rx_packet_t *pkt;
+   size_t n = 0;
+
+   while (NULL != (pkt = lora_rx_loan(dev)))
+   {
+      lora_frag_rx_feed(rx, pkt->payload, pkt->len, pkt->timestamp_us);
+      lora_rx_return(dev);
+      n++;
+   }
+
+   return n;
+}
+#endif
@@ -0,0 +1,192 @@
+/**
+ * @file lora_frag.h
+ * @brief Fragmentation and reassembly of messages larger than one LoRa frame
+ *
+ * Splits a message into frames that carry a 4-byte header (message id,
+ * fragment index, fragment count, fragment size) and streams them through
+ * the asynchronous transmit queue. The receiving side reassembles them from
+ * the receive ring into caller-provided buffers, without dynamic allocation,
+ * and drops messages whose fragments stop arriving.
+ *
+ * The header has no addressing: one sender per channel, or frames that are
+ * already filtered, are expected.
+ */
+
+#ifndef _LORA_FRAG_H_
+#define _LORA_FRAG_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "lora_driver.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#if LORA_TX_IOV_MAX < 2
+#error "lora_frag needs LORA_TX_IOV_MAX of at least 2"
+#endif
+
+    /** @brief Fragment header: id, index, count, fragment size. */
+#define LORA_FRAG_HEADER_LEN 4
+
+    /** @brief Largest fragment payload, so header and payload fit one frame. */
+#define LORA_FRAG_MAX_CHUNK (LORA_MAX_PAYLOAD - LORA_FRAG_HEADER_LEN)
+
+    /** @brief Largest message a reassembly slot holds. */
+#define LORA_FRAG_MAX_MESSAGE 4096
+
+    /** @brief Messages reassembled at the same time. */
+#define LORA_FRAG_RX_SLOTS 2
+
+    /** @brief Default time a message may go without a new fragment before it is dropped. */
+#define LORA_FRAG_RX_TIMEOUT_US 10000000ULL
+
+    /** @brief Fragments of one message in the transmit queue at a time. */
+#define LORA_FRAG_TX_WINDOW LORA_TX_QUEUE_LEN
+
+    /**
+     * @brief Completion callback of lora_frag_send().
+     * @param status LORA_OK when every fragment was sent, else the first failure.
+     * @param ctx User context passed to lora_frag_send().
+     */
+    typedef void (*lora_frag_done_cb_t)(lora_status_t status, void *ctx);
+
+    /**
+     * @brief Callback for a reassembled message.
+     *
+     * The data is only valid during the call.
+     *
+     * @param msg Message data.
+     * @param len Message length.
+     * @param id Message id chosen by the sender.
+     * @param ctx User context passed to lora_frag_rx_init().
+     */
+    typedef void (*lora_frag_msg_cb_t)(const uint8_t *msg, size_t len, uint8_t id, void *ctx);
+
+    /**
+     * @brief Sender state of one message.
+     */
+    typedef struct
+    {
+        lora_dev_t *dev;
+        const uint8_t *msg;
+        size_t len;
+        uint8_t chunk;     /**< Payload bytes per fragment. */
+        uint8_t id;        /**< Id of the current message, incremented per message. */
+        uint8_t count;     /**< Fragments of the current message. */
+        uint8_t queued;    /**< Fragments handed to the transmit queue. */
+        uint8_t completed; /**< Fragments whose transmission ended. */
+        bool busy;
+        lora_status_t status;
+        lora_frag_done_cb_t cb;
+        void *ctx;
+        uint8_t headers[LORA_FRAG_TX_WINDOW][LORA_FRAG_HEADER_LEN];
+    } lora_frag_tx_t;
+
+    /**
+     * @brief Partially received message.
+     */
+    typedef struct
+    {
+        bool in_use;
+        uint8_t id;
+        uint8_t count;
+        uint8_t chunk;
+        uint8_t received;         /**< Distinct fragments received. */
+        uint32_t seen[8];         /**< One bit per fragment index. */
+        size_t len;               /**< Message length, known once the last fragment arrived. */
+        uint64_t updated_us;      /**< Arrival of the latest fragment. */
+        uint8_t buf[LORA_FRAG_MAX_MESSAGE];
+    } lora_frag_slot_t;
+
+    /**
+     * @brief Receiver state with its reassembly buffers.
+     */
+    typedef struct
+    {
+        lora_frag_slot_t slots[LORA_FRAG_RX_SLOTS];
+        uint64_t timeout_us;
+        uint32_t dropped; /**< Messages given up: timed out, evicted or too large. */
+        lora_frag_msg_cb_t cb;
+        void *ctx;
+    } lora_frag_rx_t;
+
+    /**
+     * @brief Prepare a sender.
+     * @param tx Sender state.
+     * @param dev Device whose asynchronous transmit queue carries the fragments.
+     * @param chunk Payload bytes per fragment, 1 to LORA_FRAG_MAX_CHUNK; smaller values keep frames short at high SF.
+     * @return lora_status_t LORA_OK, or LORA_FAIL for an invalid chunk size.
+     */
+    lora_status_t lora_frag_tx_init(lora_frag_tx_t *tx, lora_dev_t *dev, uint8_t chunk);
+
+    /**
+     * @brief Start sending a message.
+     *
+     * Up to LORA_FRAG_TX_WINDOW fragments are queued right away and the rest
+     * as earlier ones complete, from lora_service(). The message is not copied
+     * and must stay valid until the callback is called. A failed fragment
+     * stops the message.
+     *
+     * @param tx Sender state, idle.
+     * @param msg Message data.
+     * @param len Message length, at most 255 fragments.
+     * @param cb Callback called from lora_service() once the message is done, may be NULL.
+     * @param ctx User context passed to the callback.
+     * @return lora_status_t LORA_OK when started, LORA_FAIL when busy or too long,
+     *         LORA_QUEUE_FULL when not even the first fragment could be queued.
+     */
+    lora_status_t lora_frag_send(lora_frag_tx_t *tx, const uint8_t *msg, size_t len, lora_frag_done_cb_t cb,
+                                 void *ctx);
+
+    /**
+     * @brief Prepare a receiver.
+     * @param rx Receiver state.
+     * @param timeout_us Time a message may go without a new fragment, 0 for LORA_FRAG_RX_TIMEOUT_US.
+     * @param cb Callback for reassembled messages.
+     * @param ctx User context passed to the callback.
+     */
+    void lora_frag_rx_init(lora_frag_rx_t *rx, uint64_t timeout_us, lora_frag_msg_cb_t cb, void *ctx);
+
+    /**
+     * @brief Add one received frame.
+     *
+     * Duplicates are ignored. A new message takes a free slot, else the one
+     * that was updated least recently.
+     *
+     * @param rx Receiver state.
+     * @param frame Frame data, header included.
+     * @param len Frame length.
+     * @param now_us Arrival time of the frame.
+     * @return lora_status_t LORA_OK, or LORA_FAIL for a frame that is not a valid fragment.
+     */
+    lora_status_t lora_frag_rx_feed(lora_frag_rx_t *rx, const uint8_t *frame, uint8_t len, uint64_t now_us);
+
+#if LORA_CONFIG_RX_RING
+    /**
+     * @brief Feed every packet waiting in the receive ring of a device.
+     *
+     * Uses lora_rx_loan(), so frames are reassembled straight from the ring.
+     *
+     * @param rx Receiver state.
+     * @param dev Device with the streaming receive engine running.
+     * @return Number of frames consumed.
+     */
+    size_t lora_frag_rx_drain(lora_frag_rx_t *rx, lora_dev_t *dev);
+#endif
+
+    /**
+     * @brief Drop messages that have not progressed within the timeout.
+     * @param rx Receiver state.
+     * @param now_us Current time.
+     */
+    void lora_frag_rx_expire(lora_frag_rx_t *rx, uint64_t now_us);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _LORA_FRAG_H_
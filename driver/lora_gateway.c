@@ -0,0 +1,300 @@
+#include <string.h>
+#include <stdatomic.h>
+#include "lora_gateway.h"
+#include "api/driver_api.h"
+
+#if LORA_CONFIG_RX_RING
+
+/*
+ * Slot of a worker queue. seq tells the slot's state for position pos:
+ * pos when free for the owner, pos + 1 once filled, and pos + LEN once taken,
+ * which frees it for the next round.
+ */
+typedef struct
+{
+   atomic_uint seq;
+   lora_gw_packet_t pkt;
+} lora_gw_slot_t;
+
+/*
+ * Packet queue of one worker. Only the owner adds packets, at bottom; the
+ * owner and the other workers claim them at top with a compare-and-swap and
+ * only copy a slot they have claimed.
+ */
+typedef struct
+{
+   lora_gw_slot_t slots[LORA_GW_QUEUE_LEN];
+   atomic_uint top;
+   unsigned int bottom; /* Written and read by the owner only. */
+   lora_gw_packet_t current; /* Packet being handled, owned by the worker task. */
+   atomic_uint received;
+   atomic_uint handled;
+   atomic_uint stolen;
+} lora_gw_worker_t;
+
+struct lora_gw
+{
+   bool in_use;
+   uint8_t n_workers;
+   uint8_t n_radios;
+   lora_gw_rx_cb_t cb;
+   void *ctx;
+   lora_dev_t *radios[LORA_GW_MAX_RADIOS];
+   lora_gw_worker_t workers[LORA_GW_MAX_WORKERS];
+};
+
+static lora_gw_t __gateways[LORA_GW_MAX_GATEWAYS];
+
+lora_gw_t *lora_gw_create(uint8_t workers, lora_gw_rx_cb_t cb, void *ctx)
+{
+   if (workers < 1 || workers > LORA_GW_MAX_WORKERS || NULL == cb)
+   {
+      return NULL;
+   }
+
+   for (uint8_t i = 0; i < LORA_GW_MAX_GATEWAYS; i++)
+   {
+      lora_gw_t *gw = &__gateways[i];
+      if (!gw->in_use)
+      {
+         memset(gw, 0, sizeof(*gw));
+         gw->in_use = true;
+         gw->n_workers = workers;
+         gw->cb = cb;
+         gw->ctx = ctx;
+         for (uint8_t w = 0; w < workers; w++)
+         {
+            for (unsigned int pos = 0; pos < LORA_GW_QUEUE_LEN; pos++)
+            {
+               atomic_init(&gw->workers[w].slots[pos].seq, pos);
+            }
+         }
+         return gw;
+      }
+   }
+
+   return NULL;
+}
+
+void lora_gw_destroy(lora_gw_t *gw)
+{
+   gw->in_use = false;
+}
+
+lora_status_t lora_gw_add_radio(lora_gw_t *gw, lora_dev_t *dev, uint8_t *radio)
+{
+   if (gw->n_radios >= LORA_GW_MAX_RADIOS)
+   {
+      return LORA_FAIL;
+   }
+
+   lora_status_t ret = lora_rx_start(dev);
+   if (LORA_OK != ret)
+   {
+      return ret;
+   }
+
+   if (NULL != radio)
+   {
+      *radio = gw->n_radios;
+   }
+   gw->radios[gw->n_radios++] = dev;
+
+   return LORA_OK;
+}
+
+/*
+ * Service the radios of a worker, r % n_workers == worker, and move their
+ * frames into its queue while there is room.
+ */
+static void lora_gw_poll(lora_gw_t *gw, uint8_t worker)
+{
+   lora_gw_worker_t *w = &gw->workers[worker];
+
+   for (uint8_t r = worker; r < gw->n_radios; r += gw->n_workers)
+   {
+      lora_dev_t *dev = gw->radios[r];
+      const lora_rx_packet_t *pkt;
+
+      (void)lora_service(dev, 0);
+      while (true)
+      {
+         lora_gw_slot_t *slot = &w->slots[w->bottom % LORA_GW_QUEUE_LEN];
+
+         /* A slot still taken by a slow consumer counts as full. */
+         if (atomic_load_explicit(&slot->seq, memory_order_acquire) != w->bottom ||
+             NULL == (pkt = lora_rx_loan(dev)))
+         {
+            break;
+         }
+
+         slot->pkt.pkt = *pkt;
+         slot->pkt.radio = r;
+         lora_rx_return(dev);
+
+         atomic_store_explicit(&slot->seq, ++w->bottom, memory_order_release);
+         atomic_fetch_add_explicit(&w->received, 1, memory_order_relaxed);
+      }
+   }
+}
+
+static bool lora_gw_take(lora_gw_worker_t *w, lora_gw_packet_t *out)
+{
+   unsigned int top = atomic_load_explicit(&w->top, memory_order_relaxed);
+
+   while (true)
+   {
+      lora_gw_slot_t *slot = &w->slots[top % LORA_GW_QUEUE_LEN];
+      int filled = (int)(atomic_load_explicit(&slot->seq, memory_order_acquire) - (top + 1));
+
+      if (filled < 0)
+      {
+         return false;
+      }
+
+      if (0 == filled)
+      {
+         if (atomic_compare_exchange_weak_explicit(&w->top, &top, top + 1, memory_order_relaxed,
+                                                   memory_order_relaxed))
+         {
+            *out = slot->pkt;
+            atomic_store_explicit(&slot->seq, top + LORA_GW_QUEUE_LEN, memory_order_release);
+            return true;
+         }
+      }
+      else
+      {
+         /* Another consumer took it, top has moved on. */
+         top = atomic_load_explicit(&w->top, memory_order_relaxed);
+      }
+   }
+}
+
+/*
+ * Own queue first, then the others starting with the next worker, so that
+ * thieves spread over the victims.
+ */
+static bool lora_gw_find(lora_gw_t *gw, uint8_t worker)
+{
+   lora_gw_worker_t *w = &gw->workers[worker];
+
+   if (lora_gw_take(w, &w->current))
+   {
+      return true;
+   }
+
+   for (uint8_t i = 1; i < gw->n_workers; i++)
+   {
+      if (lora_gw_take(&gw->workers[(worker + i) % gw->n_workers], &w->current))
+      {
+         atomic_fetch_add_explicit(&w->stolen, 1, memory_order_relaxed);
+         return true;
+      }
+   }
+
+   return false;
+}
+
+/*
+ * Wait for traffic. A worker with a single radio sleeps in lora_service() and
+ * wakes up on its interrupts; the others only nap. Either way the nap is
+ * LORA_GW_IDLE_MS when there are other queues to steal from.
+ */
+static void lora_gw_idle(lora_gw_t *gw, uint8_t worker, uint32_t ms)
+{
+   if (gw->n_workers > 1 && ms > LORA_GW_IDLE_MS)
+   {
+      ms = LORA_GW_IDLE_MS;
+   }
+
+   if (worker < gw->n_radios && worker + gw->n_workers >= gw->n_radios)
+   {
+      (void)lora_service(gw->radios[worker], ms);
+   }
+   else
+   {
+      lora_delay(ms);
+   }
+}
+
+bool lora_gw_work(lora_gw_t *gw, uint8_t worker, uint32_t timeout_ms)
+{
+   lora_gw_worker_t *w = &gw->workers[worker];
+   uint64_t deadline = lora_time_us() + (uint64_t)timeout_ms * 1000;
+
+   lora_gw_poll(gw, worker);
+   bool found = lora_gw_find(gw, worker);
+
+   while (!found)
+   {
+      uint64_t now = lora_time_us();
+      if (now >= deadline)
+      {
+         return false;
+      }
+
+      lora_gw_idle(gw, worker, (uint32_t)((deadline - now + 999) / 1000));
+      lora_gw_poll(gw, worker);
+      found = lora_gw_find(gw, worker);
+   }
+
+   gw->cb(&w->current, worker, gw->ctx);
+   atomic_fetch_add_explicit(&w->handled, 1, memory_order_relaxed);
+
+   return true;
+}
+
+lora_status_t lora_gw_send(lora_gw_t *gw, uint32_t radios, const struct iovec *iov, uint8_t iovcnt,
+                           lora_tx_cb_t cb, void *ctx, uint8_t *radio)
+{
+   size_t size = 0;
+
+   for (uint8_t i = 0; i < iovcnt; i++)
+   {
+      size += iov[i].iov_len;
+   }
+
+   if (iovcnt > LORA_TX_IOV_MAX || size > LORA_MAX_PAYLOAD)
+   {
+      return LORA_FAILED_SEND_PACKET;
+   }
+
+   uint8_t best = 0;
+   uint64_t best_wait = UINT64_MAX;
+
+   for (uint8_t r = 0; r < gw->n_radios; r++)
+   {
+      if (radios & (1UL << r))
+      {
+         uint64_t wait = lora_tx_wait_us(gw->radios[r]);
+         if (wait < best_wait)
+         {
+            best = r;
+            best_wait = wait;
+         }
+      }
+   }
+
+   if (UINT64_MAX == best_wait)
+   {
+      return LORA_QUEUE_FULL;
+   }
+
+   lora_status_t ret = lora_send_packet_iov_async(gw->radios[best], iov, iovcnt, cb, ctx);
+   if (LORA_OK == ret && NULL != radio)
+   {
+      *radio = best;
+   }
+
+   return ret;
+}
+
+void lora_gw_get_stats(lora_gw_t *gw, uint8_t worker, lora_gw_stats_t *stats)
+{
+   lora_gw_worker_t *w = &gw->workers[worker];
+
+   stats->received = atomic_load_explicit(&w->received, memory_order_relaxed);
+   stats->handled = atomic_load_explicit(&w->handled, memory_order_relaxed);
+   stats->stolen = atomic_load_explicit(&w->stolen, memory_order_relaxed);
+}
+#endif
@@ -0,0 +1,152 @@
+/**
+ * @file lora_gateway.h
+ * @brief Multi-radio gateway: merged reception and downlink routing
+ *
+ * Merges the receive rings of several radios into a pool of worker tasks.
+ * Radio r belongs to worker r % workers, which alone services the radio and
+ * moves its frames into the bounded queue of that worker; a worker whose
+ * queue is empty takes packets from the others, so a burst on one radio is
+ * spread over all workers while packets of a quiet radio stay on the worker
+ * that received them. A full worker queue leaves the frames in the receive
+ * ring of the radio.
+ *
+ * The application creates the tasks and runs lora_gw_work() in each of them,
+ * one task per worker index.
+ *
+ * Downlinks go to the radio among the allowed ones whose transmit queue and
+ * duty-cycle budget let the frame start soonest, see lora_tx_wait_us().
+ *
+ * Built only with LORA_CONFIG_RX_RING, whose receive rings it drains.
+ */
+
+#ifndef _LORA_GATEWAY_H_
+#define _LORA_GATEWAY_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "lora_driver.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#if LORA_CONFIG_RX_RING
+    /** @brief Every radio of the gateway, for lora_gw_send(). */
+#define LORA_GW_ALL_RADIOS UINT32_MAX
+
+    /** @brief Idle sleep of a worker that cannot block on a radio of its own, in milliseconds. */
+#ifndef LORA_GW_IDLE_MS
+#define LORA_GW_IDLE_MS 1
+#endif
+
+    /**
+     * @brief Gateway state, allocated by lora_gw_create().
+     */
+    typedef struct lora_gw lora_gw_t;
+
+    /**
+     * @brief Received packet handed to a worker.
+     */
+    typedef struct
+    {
+        lora_rx_packet_t pkt; /**< Frame as stored by the receive ring. */
+        uint8_t radio;        /**< Index of the radio it was received on. */
+    } lora_gw_packet_t;
+
+    /**
+     * @brief Packet handler, called from lora_gw_work().
+     * @param pkt Packet, valid until the handler returns.
+     * @param worker Index of the worker running the handler.
+     * @param ctx User context passed to lora_gw_create().
+     */
+    typedef void (*lora_gw_rx_cb_t)(const lora_gw_packet_t *pkt, uint8_t worker, void *ctx);
+
+    /**
+     * @brief Counters of one worker.
+     */
+    typedef struct
+    {
+        uint32_t received; /**< Packets moved from its radios into its queue. */
+        uint32_t handled;  /**< Packets it passed to the handler. */
+        uint32_t stolen;   /**< Handled packets taken from the queue of another worker. */
+    } lora_gw_stats_t;
+
+    /**
+     * @brief Allocate a gateway from the pool of LORA_GW_MAX_GATEWAYS.
+     * @param workers Number of worker tasks, 1 to LORA_GW_MAX_WORKERS.
+     * @param cb Packet handler.
+     * @param ctx User context passed to the handler.
+     * @return The gateway, or NULL when the pool is exhausted or the arguments are invalid.
+     */
+    lora_gw_t *lora_gw_create(uint8_t workers, lora_gw_rx_cb_t cb, void *ctx);
+
+    /**
+     * @brief Release a gateway; its workers must have stopped.
+     * @param gw Gateway.
+     */
+    void lora_gw_destroy(lora_gw_t *gw);
+
+    /**
+     * @brief Add a radio and start its streaming receive engine.
+     *
+     * Radios are added before the workers start. The radio then belongs to the
+     * gateway: only its worker may call lora_service() and read its ring.
+     *
+     * @param gw Gateway.
+     * @param dev Initialized device.
+     * @param radio Filled with the index of the radio, may be NULL.
+     * @return lora_status_t LORA_OK, LORA_FAIL when LORA_GW_MAX_RADIOS are in use,
+     *         or the result of lora_rx_start().
+     */
+    lora_status_t lora_gw_add_radio(lora_gw_t *gw, lora_dev_t *dev, uint8_t *radio);
+
+    /**
+     * @brief Run one step of a worker.
+     *
+     * Services the radios of the worker and moves their frames into its
+     * queue, then passes one packet to the handler: its own oldest one, or one
+     * taken from another worker. Without any it waits up to timeout_ms, in
+     * lora_service() when the worker has radios, and tries once more.
+     *
+     * @param gw Gateway.
+     * @param worker Worker index; each index must be run by a single task.
+     * @param timeout_ms Longest wait for a packet.
+     * @return true when a packet was handled.
+     */
+    bool lora_gw_work(lora_gw_t *gw, uint8_t worker, uint32_t timeout_ms);
+
+    /**
+     * @brief Queue a downlink on the radio where it starts soonest.
+     *
+     * Radios with a full transmit queue or a closed sub-band are skipped. The
+     * frame is sent by lora_service() in the worker owning the radio, which
+     * also runs cb.
+     *
+     * @param gw Gateway.
+     * @param radios Bit mask of the radios allowed to send, LORA_GW_ALL_RADIOS for any.
+     * @param iov Segments, in the order they are sent; must stay valid until cb runs.
+     * @param iovcnt Number of segments, at most LORA_TX_IOV_MAX.
+     * @param cb Completion callback, may be NULL.
+     * @param ctx User context passed to cb.
+     * @param radio Filled with the index of the chosen radio, may be NULL.
+     * @return lora_status_t LORA_OK, LORA_QUEUE_FULL when no allowed radio can take the frame,
+     *         or the result of lora_send_packet_iov_async().
+     */
+    lora_status_t lora_gw_send(lora_gw_t *gw, uint32_t radios, const struct iovec *iov, uint8_t iovcnt,
+                               lora_tx_cb_t cb, void *ctx, uint8_t *radio);
+
+    /**
+     * @brief Read the counters of a worker.
+     * @param gw Gateway.
+     * @param worker Worker index.
+     * @param stats Filled with the counters.
+     */
+    void lora_gw_get_stats(lora_gw_t *gw, uint8_t worker, lora_gw_stats_t *stats);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _LORA_GATEWAY_H_
@@ -0,0 +1,88 @@
+#include "lora_trace.h"
+
+static const char *const __event_names[LORA_TRACE_EVENT_COUNT] = {
+    "tx_start",
+    "tx_done",
+    "tx_fail",
+    "tx_timeout",
+    "rx_done",
+    "rx_crc_error",
+    "rx_overrun",
+    "cad_done",
+    "dio_mapping",
+    "ack_timeout",
+};
+
+const char *lora_trace_event_name(uint8_t event)
+{
+   return (event < LORA_TRACE_EVENT_COUNT) ? __event_names[event] : "unknown";
+}
+
+#if LORA_TRACE_RING
+#include <stdatomic.h>
+#include "api/driver_api.h"
+
+/*
+ * Multi-producer ring: a writer claims a slot with one atomic increment and
+ * publishes it by storing its sequence number last. The reader only accepts
+ * slots whose sequence number is the one it expects.
+ */
+static lora_trace_record_t __ring[LORA_TRACE_RING_LEN];
+static atomic_uint __ring_seq[LORA_TRACE_RING_LEN];
+static atomic_uint __ring_head;
+static unsigned int __ring_tail;
+
+void lora_trace_record(uint8_t level, uint8_t event, int32_t arg)
+{
+   unsigned int slot = atomic_fetch_add_explicit(&__ring_head, 1, memory_order_relaxed);
+   lora_trace_record_t *rec = &__ring[slot % LORA_TRACE_RING_LEN];
+
+   /* Mark the slot busy so a reader does not take a half written record. */
+   atomic_store_explicit(&__ring_seq[slot % LORA_TRACE_RING_LEN], 0, memory_order_relaxed);
+   rec->seq = slot;
+   rec->time_us = (uint32_t)lora_time_us();
+   rec->level = level;
+   rec->event = event;
+   rec->arg = arg;
+   atomic_store_explicit(&__ring_seq[slot % LORA_TRACE_RING_LEN], slot + 1, memory_order_release);
+}
+
+size_t lora_trace_drain(lora_trace_record_t *out, size_t max)
+{
+   unsigned int head = atomic_load_explicit(&__ring_head, memory_order_acquire);
+   size_t n = 0;
+
+   if (head - __ring_tail > LORA_TRACE_RING_LEN)
+   {
+      __ring_tail = head - LORA_TRACE_RING_LEN;
+   }
+
+   while (n < max && __ring_tail != head)
+   {
+      unsigned int idx = __ring_tail % LORA_TRACE_RING_LEN;
+      unsigned int seq = atomic_load_explicit(&__ring_seq[idx], memory_order_acquire);
+
+      if (seq == __ring_tail + 1)
+      {
+         out[n] = __ring[idx];
+         seq = atomic_load_explicit(&__ring_seq[idx], memory_order_acquire);
+      }
+      if (seq != __ring_tail + 1)
+      {
+         if (0 == seq || (int)(seq - (__ring_tail + 1)) < 0)
+         {
+            /* Still being written. */
+            break;
+         }
+         /* Overwritten by a newer record: skip to the oldest one still held. */
+         head = atomic_load_explicit(&__ring_head, memory_order_acquire);
+         __ring_tail = head - LORA_TRACE_RING_LEN;
+         continue;
+      }
+      n++;
+      __ring_tail++;
+   }
+
+   return n;
+}
+#endif
@@ -0,0 +1,142 @@
+/**
+ * @file lora_trace.h
+ * @brief Compile-time trace layer of the LoRa driver
+ *
+ * Trace points are macros filtered by LORA_TRACE_LEVEL at compile time; with
+ * the default level of LORA_TRACE_LEVEL_NONE they expand to nothing and their
+ * arguments are not evaluated. Enabled trace points either print right away
+ * (default) or, with LORA_TRACE_RING set to 1, store a small binary record in
+ * a ring buffer that is drained later with lora_trace_drain(), off the hot path.
+ */
+
+#ifndef _LORA_TRACE_H_
+#define _LORA_TRACE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define LORA_TRACE_LEVEL_NONE 0
+#define LORA_TRACE_LEVEL_ERROR 1
+#define LORA_TRACE_LEVEL_WARN 2
+#define LORA_TRACE_LEVEL_INFO 3
+#define LORA_TRACE_LEVEL_DEBUG 4
+
+#ifndef LORA_TRACE_LEVEL
+#define LORA_TRACE_LEVEL LORA_TRACE_LEVEL_NONE
+#endif
+
+#ifndef LORA_TRACE_RING
+#define LORA_TRACE_RING 0
+#endif
+
+/** @brief Number of records kept by the ring backend, a power of two. */
+#ifndef LORA_TRACE_RING_LEN
+#define LORA_TRACE_RING_LEN 64
+#endif
+#if LORA_TRACE_RING_LEN < 1 || (LORA_TRACE_RING_LEN & (LORA_TRACE_RING_LEN - 1))
+#error "LORA_TRACE_RING_LEN must be a power of two"
+#endif
+
+    /**
+     * @brief Trace events.
+     */
+    typedef enum
+    {
+        LORA_TRACE_TX_START,     /**< Frame handed to the modem, arg = size. */
+        LORA_TRACE_TX_DONE,      /**< TxDone, arg = time on air seen by the driver in ms. */
+        LORA_TRACE_TX_FAIL,      /**< Frame could not be started, arg = lora_status_t. */
+        LORA_TRACE_TX_TIMEOUT,   /**< TxDone missed the deadline, radio recovered. */
+        LORA_TRACE_RX_DONE,      /**< Frame received, arg = size. */
+        LORA_TRACE_RX_CRC_ERROR, /**< Frame dropped for a bad CRC. */
+        LORA_TRACE_RX_OVERRUN,   /**< Frame dropped because the RX ring was full. */
+        LORA_TRACE_CAD_DONE,     /**< CAD finished, arg = 1 when activity was detected. */
+        LORA_TRACE_DIO_MAPPING,  /**< DIO mapping changed, arg = (dio << 8) | mapping. */
+        LORA_TRACE_ACK_TIMEOUT,  /**< Confirmed send not acknowledged, arg = attempts made. */
+        LORA_TRACE_EVENT_COUNT,
+    } lora_trace_event_t;
+
+    /**
+     * @brief Binary trace record stored by the ring backend.
+     */
+    typedef struct
+    {
+        uint32_t seq;     /**< Sequence number, counts every record ever written. */
+        uint32_t time_us; /**< Low 32 bits of lora_time_us(). */
+        uint8_t level;    /**< LORA_TRACE_LEVEL_ERROR to LORA_TRACE_LEVEL_DEBUG. */
+        uint8_t event;    /**< lora_trace_event_t. */
+        int32_t arg;      /**< Event specific argument. */
+    } lora_trace_record_t;
+
+    /**
+     * @brief Return the name of a trace event.
+     * @param event lora_trace_event_t value.
+     * @return Constant string.
+     */
+    const char *lora_trace_event_name(uint8_t event);
+
+#if LORA_TRACE_RING
+    /**
+     * @brief Append a record to the trace ring; the oldest record is overwritten when full.
+     * @param level Trace level.
+     * @param event Trace event.
+     * @param arg Event argument.
+     */
+    void lora_trace_record(uint8_t level, uint8_t event, int32_t arg);
+
+    /**
+     * @brief Move the oldest records out of the trace ring.
+     * @param out Destination array.
+     * @param max Capacity of out.
+     * @return Number of records copied; gaps in seq tell how many were overwritten.
+     */
+    size_t lora_trace_drain(lora_trace_record_t *out, size_t max);
+
+#define LORA_TRACE_EMIT(level, event, arg) lora_trace_record((level), (event), (int32_t)(arg))
+#else
+#include <stdio.h>
+#define LORA_TRACE_EMIT(level, event, arg) \
+    printf("lora: %s %ld\n", lora_trace_event_name(event), (long)(arg))
+#endif
+
+/* Disabled trace points: the arguments are not evaluated, only kept from looking unused. */
+#define LORA_TRACE_DISCARD(event, arg) \
+    do                                 \
+    {                                  \
+        (void)sizeof(event);           \
+        (void)sizeof(arg);             \
+    } while (0)
+
+#if LORA_TRACE_LEVEL >= LORA_TRACE_LEVEL_ERROR
+#define LORA_TRACE_ERROR(event, arg) LORA_TRACE_EMIT(LORA_TRACE_LEVEL_ERROR, event, arg)
+#else
+#define LORA_TRACE_ERROR(event, arg) LORA_TRACE_DISCARD(event, arg)
+#endif
+
+#if LORA_TRACE_LEVEL >= LORA_TRACE_LEVEL_WARN
+#define LORA_TRACE_WARN(event, arg) LORA_TRACE_EMIT(LORA_TRACE_LEVEL_WARN, event, arg)
+#else
+#define LORA_TRACE_WARN(event, arg) LORA_TRACE_DISCARD(event, arg)
+#endif
+
+#if LORA_TRACE_LEVEL >= LORA_TRACE_LEVEL_INFO
+#define LORA_TRACE_INFO(event, arg) LORA_TRACE_EMIT(LORA_TRACE_LEVEL_INFO, event, arg)
+#else
+#define LORA_TRACE_INFO(event, arg) LORA_TRACE_DISCARD(event, arg)
+#endif
+
+#if LORA_TRACE_LEVEL >= LORA_TRACE_LEVEL_DEBUG
+#define LORA_TRACE_DEBUG(event, arg) LORA_TRACE_EMIT(LORA_TRACE_LEVEL_DEBUG, event, arg)
+#else
+#define LORA_TRACE_DEBUG(event, arg) LORA_TRACE_DISCARD(event, arg)
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _LORA_TRACE_H_